@@ -5,27 +5,57 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 
 #define CEREAL_VERSION "0.0.1"
 #define CEREAL_TAB_STOP 8
 #define CEREAL_QUIT_TIMES 3
+#define CEREAL_FOLLOW_CHUNK 65536
+#define CEREAL_FOLLOW_MAX (16 * 1024 * 1024)
+#define CEREAL_BLOCK_ROWS 256
+#define CEREAL_BLOCK_MIN_ROWS 32
+#define CEREAL_BLOCK_LRU 16
+#define CEREAL_COLD_MIN_ROWS 4096
+#define CEREAL_LONG_LINE (64 * 1024)
+#define CEREAL_CHUNK_SIZE 4096
+#define CEREAL_INDEX_MIN_SIZE (1024 * 1024)
+#define CEREAL_UNMAP_ROWS 65536
+#define CEREAL_KILL_RING 16
+#define BRACKET_NONE (INT_MAX / 2)
 
 // CTRL key strips bits 5 and 6 from the key pressed in combination with CTRL.
 // This behavier is reproduced using Bitmasking with 0x1f, that is 00011111.
 #define CTRL_KEY(k) ((k)&0x1f)
+// ESC followed by a key, as terminals send Meta/Alt combinations.
+#define META_KEY(k) ((k) | 0x800)
 
 #define HL_HIGHLIGHT_NUMBER (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
@@ -51,19 +81,113 @@ enum editorHighlight {
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_CURSOR // an extra cursor, drawn in inverse video
 };
 
 /*** data ***/
 
+// Highlighter state at a position within a row.
+struct hlState {
+    int in_comment;
+    int in_string;
+    int prev_sep;
+    int in_line_comment; // a single-line comment runs to the end of the row
+};
+
+// A point at which editorHighlight records its state.
+struct hlMark {
+    int at;
+    struct hlState st;
+    int skip;              // bytes past at already consumed by a token
+    unsigned char skip_hl; // and their highlight
+};
+
+// A piece of a long row. width[p] is the display width of the piece when it
+// starts at a column with remainder p modulo CEREAL_TAB_STOP; mark holds
+// the highlighter state where it starts.
+struct rowChunk {
+    char *s;
+    int len;
+    int cap;
+    int width[CEREAL_TAB_STOP];
+    struct hlMark mark;
+};
+
+// The text of a very long row split in chunks so that typing only touches
+// one chunk. render and hl then only cover a window of whole chunks around
+// E.buf->coloff, starting at display column render_col.
+struct rowChunks {
+    struct rowChunk *c;
+    int n;
+    int cap;
+    int render_col;
+    char *text; // the whole row for editorRowText, until the next edit
+};
+
+// Search matches of one row, as [rb[2k], rb[2k+1]) spans of render bytes,
+// drawn over hl. Valid while row, version and the search generation agree.
+struct matchSpans {
+    int row;
+    unsigned int version;
+    unsigned int gen;
+    int *rb;
+    int n, cap;
+};
+
+// The brackets of a row, or of a run of rows, that lie outside strings and
+// comments: net is the change in nesting depth across it, lo and lo_after
+// the lowest depth, relative to its start, just before and just after any
+// one of them (BRACKET_NONE when there are none).
+struct bracketSum {
+    int net;
+    int lo;
+    int lo_after;
+};
+
+// A symbol of the outline, see editorOutlinePoll.
+struct outlineSym {
+    int row;
+    int col; // of the name, in chars
+    int name; // offset of the NUL-terminated name in the pool
+    unsigned int letters; // see editorLetterMask
+    unsigned char len;
+    unsigned char kind;
+};
+
+// A compressed run of cold rows, see editorFreezeRows.
+struct rowBlock {
+    int refs; // cold rows still pointing into this block
+    int len;
+    int clen;
+    char *data;
+    char *plain; // decompressed text while the block is in the LRU
+    uint64_t hash; // of the plain text
+    struct rowBlock *next; // in its E.blktab chain
+    int mapped; // plain is the whole file, mmapped, see editorOpenIndexed
+};
+
+// A row is cold when blk is set: chars, render and hl are then NULL and
+// the text lives at blkoff in the block. size, hl_open_comment and brk stay
+// valid.
+// A row is long when chunks is set: chars is then NULL and render/hl hold
+// just the visible window, see editorRowChunk.
 typedef struct erow {
     int idx;
     int size;
     int rsize;
+    int orig; // line of the file on disk it came from, -1 for a new row
     char *chars;
     char *render;
     unsigned char *hl;
     int hl_open_comment;
+    int ascii; // chars are pure ASCII: one byte per column
+    struct rowBlock *blk;
+    int blkoff;
+    int edited; // changed since it came from line orig, maybe back again
+    struct rowChunks *chunks;
+    unsigned int version; // changes whenever render does
+    struct bracketSum brk;
 } erow;
 
 struct editorSyntax {
@@ -76,21 +200,186 @@ struct editorSyntax {
     int flags;
 };
 
-struct editorConfig {
+// Text killed by C-w or copied by M-w, its rows joined by newlines and kept
+// compressed, see editorKillPush.
+struct killEntry {
+    char *data;
+    int len;
+    int clen;
+};
+
+// A cursor besides cx, cy, see editorCursorsKey.
+struct editorCursor {
+    int cx, cy;
+};
+
+// Folded rows, as runs hidden under the row before each: fold i hides
+// len[i] rows starting gap[i] rows after the end of fold i - 1. Fenwick
+// trees over gap and over gap + len map rows to lines of the screen and
+// back in O(log n) folds, see editorVisibleIndex.
+struct foldIndex {
+    int n, cap;
+    int *gap;
+    int *len;
+    int *fgap; // 1-based Fenwick trees
+    int *fall;
+};
+
+// One open file: its rows and everything about how it is being viewed
+// and edited. E.buf is the one on screen.
+struct editorBuffer {
     int cx, cy;
     int rx;
     int rowoff;
     int coloff;
-    int screenrows;
-    int screencols;
     int numrows;
+    int rowcap;
     erow *row;
     int dirty;
     char *filename;
+    struct timespec file_mtime; // of the file as last opened or saved
+    off_t file_size;
+    struct editorSyntax *syntax;
+    int markx, marky;
+    int mark_active; // the region runs between the mark and the cursor
+
+    // follow mode, see editorFollowPoll
+    int follow;
+    int follow_fd;
+    int follow_stream; // follow_fd is a pipe, not a regular file
+    int follow_inotify;
+    int follow_rotated;
+    int follow_partial; // last row has no trailing newline yet
+    off_t follow_off;
+    ino_t follow_ino;
+    char follow_tail[64]; // bytes just before follow_off, to detect rewrites
+    int follow_taillen;
+
+    // rows still read from the mapping of an indexed file, see editorMapPoll
+    int mapped;
+    int map_fd;
+
+    // rows thawed or inserted since the last editorFreezeColdRows sweep all
+    // lie within [warm_lo, warm_hi); [ws_lo, ws_hi) is the working set that
+    // sweep kept warm
+    int warm_lo, warm_hi;
+    int warm_count;
+    int ws_lo, ws_hi;
+
+    // rows whose update a macro replay deferred all lie within
+    // [stale_lo, stale_hi), see editorUpdateStaleRows
+    int stale_lo, stale_hi;
+
+    // bracket index, see editorBracketIndex
+    struct bracketSum *brk; // segment tree over rows, leaf j at brk_cap + j
+    int brk_cap;
+    int brk_rows; // leaves filled in from rows
+    int brk_valid; // leaves of rows before this one are up to date
+
+    // symbol outline, see editorOutlinePoll
+    struct outlineSym *syms; // in row order
+    int nsyms;
+    char *sympool; // their names
+    int outline_lo, outline_hi; // rows to tokenize again
+    int outline_net; // bracket depth at the end of the rows at the last scan
+    unsigned int outline_gen; // bumped whenever syms change
+
+    struct hexView *hex; // set for a binary file, see editorHexOpen
+
+    char *name; // for buffers visiting no file, like *grep*
+    void (*enter)(); // run by Enter instead of inserting a newline
+
+    struct occurView *occur; // only matching rows are shown, see editorOccur
+    struct foldIndex folds;
+
+    // the file as last opened or saved, see editorDiffMark
+    uint64_t *base; // a hash of each of its lines
+    int nbase; // -1 until read, for files opened through their index
+    int basecap;
+    int gutter; // show the change markers
+
+    // extra cursors in row order, see editorCursorsKey
+    struct editorCursor *cursors;
+    int ncursors, cursorcap;
+    int cursors_dirty; // dirty as the cursors last left it
+};
+
+// What the heap holds, by kind, see memAlloc.
+enum memCategory {
+    MEM_ROWS, // row arrays
+    MEM_CHARS, // row text, chunks of long rows included
+    MEM_RENDER,
+    MEM_HL,
+    MEM_BLOCKS, // cold rows: compressed blocks and the decompressed cache
+    MEM_SEARCH, // match spans and occur views
+    MEM_OUTPUT, // append buffers, the frame being drawn among them
+    MEM_CATEGORIES
+};
+
+struct memCount {
+    atomic_llong bytes;
+    atomic_llong blocks; // allocations live
+};
+
+struct editorConfig {
+    struct editorBuffer *buf;
+    struct editorBuffer **bufs; // in order of last use, E.buf first
+    int nbufs;
+    int screenrows;
+    int screencols;
     char statusmsg[80];
     time_t statusmsg_time;
-    struct editorSyntax *syntax;
+    int ifd; // terminal input, /dev/tty when stdin is a pipe
+    unsigned int render_version; // last erow.version handed out
+    unsigned long highlighted; // rows editorHighlightRow has done, see make test
+
+    // matches of the search in progress, highlighted on every visible row
+    struct regex *search_re;
+    unsigned int search_gen; // bumped whenever search_re changes
+    char *search_last; // the last query searched for
+    struct matchSpans *overlay; // one per screen row, see editorMatchOverlay
     struct termios orig_termios;
+
+    // cold blocks of all buffers, see rowBlockIntern
+    struct rowBlock *blklru[CEREAL_BLOCK_LRU];
+    struct rowBlock **blktab; // by hash of the plain text
+    int blktab_size; // a power of two
+    int nblocks;
+
+    // what the terminal shows, see editorDrawRows
+    uint64_t *frame;
+    int frame_rowoff;
+    int frame_valid;
+
+    struct grepJob *grep; // M-x grep in progress, see editorGrepPoll
+    struct outlineJob *outline; // symbol scan in progress, see editorOutlinePoll
+
+    // newest first, see editorKillPush
+    struct killEntry kills[CEREAL_KILL_RING];
+    int nkills;
+    // the text the last yank inserted, which M-y replaces, see editorYankPop
+    struct editorBuffer *yank_buf;
+    int yank_y, yank_x;
+    int yank_ey, yank_ex; // the cursor must still be there
+    int yank_dirty; // E.yank_buf->dirty right after it
+    int yank_idx;
+
+    // keyboard macro, see editorCallMacro
+    int *macro; // the keys recorded
+    int macro_len;
+    int macro_cap;
+    int macro_recording;
+    int macro_pos; // next key to replay, -1 when not replaying
+    int macro_failed; // a key of the replay ran off the buffer
+    int batch; // a key is being applied at every cursor, see editorCursorsKey
+
+    struct memCount mem[MEM_CATEGORIES];
+
+    // server mode, see editorServe
+    int server_fd; // listening socket, -1 when not a server
+    int client_fd; // client whose terminal is attached, -1 when none
+    int attached;
+    jmp_buf session; // where die() ends the session of the client attached
 };
 
 struct editorConfig E;
@@ -121,31 +410,143 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allow_empty);
+void editorPromptQuote(char *dst, size_t size, const char *s);
+int editorFollowPoll();
+int editorGrepPoll();
+int editorMapPoll(int max);
+void editorGrepStop(struct editorBuffer *b);
+int editorOutlinePoll();
+void editorOutlineStop(struct editorBuffer *b);
+void editorOutlineReset();
+void editorOutlineDirty(int at);
+void editorOutlineShift(int at, int d);
+void editorOccurSplice(int lo, int old_hi, int new_hi);
+void editorOccurClose(struct editorBuffer *b);
+void editorFoldShift(int at, int d);
+void editorFoldDelete(int at, int n);
+void editorFoldRelease(int lo, int hi);
+void editorFoldClear(struct editorBuffer *b);
+void editorCursorsClear(struct editorBuffer *b);
+int editorScreenRow(int y);
+int editorTextCols();
+void editorDiffSetBase(erow *row);
+void editorDiffReset(int nbase);
+void editorDiffRebase(const char *buf);
+void editorFollowStop();
+void editorProcessKeypress();
+void editorMoveCursor(int key);
+const char *editorRowText(erow *row);
+void editorFreezeColdRows();
+void editorUpdateRender(erow *row);
+void editorRowThawText(erow *row);
+void editorRowThaw(erow *row);
+void editorBracketRow(erow *row);
+void editorNoteWarm(int at);
+void rowBlockRelease(struct rowBlock *blk);
+int editorChunkRescan(erow *row, int from);
+void editorRowFlatten(erow *row);
+void editorRowChunk(erow *row);
+void editorRowFreeChunks(erow *row);
+int editorChunkSplitPoint(const char *s, int at);
+int editorChunkCxToRx(erow *row, int cx);
+int editorChunkRxToCx(erow *row, int rx);
+int editorChunkNextCx(erow *row, int cx);
+int editorChunkPrevCx(erow *row, int cx);
+void editorChunkInsert(erow *row, int cx, const char *s, int len);
+void editorChunkDelete(erow *row, int cx, int len);
+void editorChunkRender(erow *row);
+void editorKillServer();
+uint64_t editorHashMore(uint64_t h, const char *s, int len);
+uint64_t editorHashLine(const char *s, int len);
+int editorOpenIndexed(const char *filename, int fd, struct stat *st);
+void editorWriteIndex(const uint64_t *offsets);
+int editorUnmapRows(int max);
+void editorMapClose();
+void editorFollowReset();
+int editorFollowRead();
+int editorClientAlive();
+void editorServerRefuse();
+int editorIsBinary(int fd);
+int editorHexOpen(int fd, struct stat *st);
+void editorHexClose();
+void editorHexSave();
+void editorHexGotoOffset();
+
+/*** memory ***/
+
+// Allocations of the kinds that can grow with a file go through these, so
+// M-x memory-report can tell where the heap went. They count what
+// malloc_usable_size says a block holds, rounding included, and atomically,
+// since grep and occur workers allocate too.
+
+void memNote(int cat, void *p, int sign) {
+    if (!p) return;
+    atomic_fetch_add(&E.mem[cat].bytes, sign * (long long)malloc_usable_size(p));
+    atomic_fetch_add(&E.mem[cat].blocks, sign);
+}
+
+void *memAlloc(int cat, size_t size) {
+    void *p = malloc(size);
+    memNote(cat, p, 1);
+    return p;
+}
+
+// The old block is un-counted only once realloc has let go of it: when
+// realloc fails it is still live.
+void *memRealloc(int cat, void *p, size_t size) {
+    long long old = p ? (long long)malloc_usable_size(p) : 0;
+    void *q = realloc(p, size);
+    if (!q && size > 0) return NULL;
+    if (p) {
+        atomic_fetch_add(&E.mem[cat].bytes, -old);
+        atomic_fetch_add(&E.mem[cat].blocks, -1);
+    }
+    memNote(cat, q, 1);
+    return q;
+}
+
+void memFree(int cat, void *p) {
+    memNote(cat, p, -1);
+    free(p);
+}
 
 /*** terminal ***/
 
 void die(const char *s) {
+    int err = errno;
     // clear screen on exit
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
 
+    // a server ends the session and tells the client why, but keeps running
+    // for the buffers it holds
+    if (E.client_fd != -1) {
+        dprintf(E.client_fd, "%s: %s\n", s, strerror(err));
+        longjmp(E.session, 1);
+    }
+    errno = err;
     perror(s);
     exit(1);
 }
 
 // restore terminal's original attributes on exit
 void disableRawMode() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
+    if (E.ifd == -1) return; // a server with no terminal attached
+    if (tcsetattr(E.ifd, TCSAFLUSH, &E.orig_termios) == -1) {
         die("tcsetattr");
     }
 }
 
 void enableRawMode() {
-    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) {
+    static int registered = 0;
+    if (tcgetattr(E.ifd, &E.orig_termios) == -1) {
         die("tcgetattr");
     }
-    atexit(disableRawMode);
+    if (!registered) {
+        atexit(disableRawMode);
+        registered = 1;
+    }
 
     struct termios raw = E.orig_termios;
     // use bitwise-NOT operator (~) to disable the following
@@ -172,18 +573,35 @@ void enableRawMode() {
     raw.c_cc[VTIME] = 1;
 
     // TCSAFLUSH allows the leftover input no longer fed into the shell
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+    if (tcsetattr(E.ifd, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
 }
 
 // reads and handles key
-int editorReadKey() {
+int editorReadTerminalKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    while ((nread = read(E.ifd, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) {
-            die("read");
+            if (E.client_fd == -1) {
+                die("read");
+            }
+            E.attached = 0;
+        }
+        // a server whose client went away answers every read with ESC, which
+        // backs out of prompts until editorServeClient sees it detached
+        if (E.client_fd != -1 && !editorClientAlive()) {
+            E.attached = 0;
+            return '\x1b';
+        }
+        // read times out every 100ms (VTIME), which doubles as the follow tick
+        if (E.server_fd != -1) {
+            editorServerRefuse();
+        }
+        if (editorFollowPoll() | editorGrepPoll() | editorOutlinePoll() |
+            editorMapPoll(CEREAL_UNMAP_ROWS)) {
+            editorRefreshScreen();
         }
     }
 
@@ -193,14 +611,19 @@ int editorReadKey() {
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1 ||
-            read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (read(E.ifd, &seq[0], 1) != 1) {
+            return '\x1b';
+        }
+        if (seq[0] != '[' && seq[0] != 'O') {
+            return META_KEY((unsigned char)seq[0]);
+        }
+        if (read(E.ifd, &seq[1], 1) != 1) {
             return '\x1b';
         }
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (read(E.ifd, &seq[2], 1) != 1) {
                     return '\x1b';
                 }
                 if (seq[2] == '~') {
@@ -237,7 +660,7 @@ int editorReadKey() {
                     return END_KEY;
                 }
             }
-        } else if (seq[0] == '0') {
+        } else if (seq[0] == 'O') {
             switch (seq[1]) {
             case 'H':
                 return HOME_KEY;
@@ -247,8 +670,26 @@ int editorReadKey() {
         }
         return '\x1b';
     } else {
-        return c;
+        return (unsigned char)c;
+    }
+}
+
+// Reads the next key: from the macro while one is replaying, otherwise from
+// the terminal, recording it while a macro is being defined.
+int editorReadKey() {
+    if (E.macro_pos >= 0) {
+        // a replay that runs out of keys inside a prompt backs out of it
+        return E.macro_pos < E.macro_len ? E.macro[E.macro_pos++] : CTRL_KEY('g');
     }
+    int c = editorReadTerminalKey();
+    if (E.macro_recording) {
+        if (E.macro_len == E.macro_cap) {
+            E.macro_cap = E.macro_cap ? E.macro_cap * 2 : 64;
+            E.macro = realloc(E.macro, sizeof(E.macro[0]) * E.macro_cap);
+        }
+        E.macro[E.macro_len++] = c;
+    }
+    return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -260,7 +701,7 @@ int getCursorPosition(int *rows, int *cols) {
     }
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+        if (read(E.ifd, &buf[i], 1) != 1) {
             break;
         }
         if (buf[i] == 'R') {
@@ -297,49 +738,87 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** syntax highlighting ***/
+// Fits the screen to the terminal, forgetting what was drawn before.
+void editorResize() {
+    for (int y = 0; E.overlay && y < E.screenrows; ++y) {
+        memFree(MEM_SEARCH, E.overlay[y].rb);
+    }
+    free(E.overlay);
+    free(E.frame);
+    E.overlay = NULL;
+    E.frame = NULL;
 
-int is_separator (int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]\\\"';", c) != NULL;
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+        die("getwindowsize");
+    }
+    E.screenrows -= 2;
+
+    E.frame = calloc(E.screenrows, sizeof(E.frame[0]));
+    E.frame_rowoff = 0;
+    E.frame_valid = 0;
+
+    E.overlay = calloc(E.screenrows, sizeof(struct matchSpans));
+    for (int y = 0; y < E.screenrows; ++y) {
+        E.overlay[y].row = -1;
+    }
 }
 
-void editorUpdateSyntax (erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+/*** syntax highlighting ***/
 
-    if (E.syntax == NULL) return;
+int is_separator (int c) {
+    return isspace((unsigned char)c) || c == '\0' || strchr(",.()+-/*=~%<>[]\\\"';", c) != NULL;
+}
 
-    char **keywords = E.syntax->keywords;
+// Highlights text[0..len) into hl (already HL_NORMAL) carrying the state in
+// *st across calls. text must be NUL-terminated. When marks is given, the
+// state on reaching each marks[].at (ascending) is recorded there, which is
+// how long rows remember where every chunk starts, see editorChunkRescan.
+// Touches nothing global, so the outline thread can use it too.
+void editorHighlight(const struct editorSyntax *syntax, const char *text,
+                     unsigned char *hl, int len, struct hlState *st,
+                     struct hlMark *marks, int nmarks) {
+    char **keywords = syntax->keywords;
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
 
     int scs_len = scs ? strlen(scs) : 0;
     int mcs_len = mcs ? strlen(mcs) : 0;
     int mce_len = mce ? strlen(mce) : 0;
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int prev_sep = st->prev_sep;
+    int in_string = st->in_string;
+    int in_comment = st->in_comment;
 
+    int m = 0;
     int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    while (i < len) {
+        for (; m < nmarks && marks[m].at <= i; ++m) {
+            struct hlMark *mk = &marks[m];
+            mk->st.in_comment = in_comment;
+            mk->st.in_string = in_string;
+            mk->st.prev_sep = prev_sep;
+            mk->st.in_line_comment = 0;
+            mk->skip = i - mk->at;
+            mk->skip_hl = mk->skip ? hl[mk->at] : HL_NORMAL;
+        }
+
+        char c = text[i];
 
         if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+            if (!strncmp(&text[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, len - i);
+                st->in_line_comment = 1;
                 break;
             }
         }
 
         if (mcs_len && mce_len && !in_string) {
             if(in_comment){
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)){
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                hl[i] = HL_MLCOMMENT;
+                if (!strncmp(&text[i], mce, mce_len)){
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -348,19 +827,19 @@ void editorUpdateSyntax (erow *row) {
                     ++i;
                     continue;
                 }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)){
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+            } else if (!strncmp(&text[i], mcs, mcs_len)){
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
             }
         }
 
-        if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if(syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (in_string) { // closing quote
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->size) {
-                    row->hl[i + 1] = HL_STRING;
+                hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -370,7 +849,7 @@ void editorUpdateSyntax (erow *row) {
                 continue;
             } else if (c == '"' || c == '\'') {
                 in_string = c;
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 ++i;
                 continue;
             }
@@ -385,9 +864,9 @@ void editorUpdateSyntax (erow *row) {
                     --klen;
                 }
 
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                if (!strncmp(&text[i], keywords[j], klen) &&
+                    is_separator(text[i + klen])) {
+                    memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
                     i += klen;
                     break;
                 }
@@ -402,10 +881,50 @@ void editorUpdateSyntax (erow *row) {
         ++i;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    st->prev_sep = prev_sep;
+    st->in_string = in_string;
+    st->in_comment = in_comment;
+    // marks past the end, or inside a single-line comment
+    for (; m < nmarks; ++m) {
+        marks[m].st = *st;
+        marks[m].skip = i > marks[m].at ? i - marks[m].at : 0;
+        marks[m].skip_hl = marks[m].skip ? hl[marks[m].at] : HL_NORMAL;
+    }
+}
+
+// Highlights a single row. Returns 1 if the multi-line comment state it
+// hands to the next row changed.
+int editorHighlightRow(erow *row) {
+    ++E.highlighted;
+    if (row->chunks) return editorChunkRescan(row, 0);
+    if (!row->render) editorUpdateRender(row); // stale, see editorUpdateRow
+
+    row->hl = memRealloc(MEM_HL, row->hl, row->rsize);
+    if (row->rsize > 0) memset(row->hl, HL_NORMAL, row->rsize); // else hl is NULL
+
+    if (E.buf->syntax == NULL) {
+        editorBracketRow(row);
+        return 0;
+    }
+
+    struct hlState st = { 0, 0, 1, 0 };
+    st.in_comment = (row->idx > 0 && E.buf->row[row->idx - 1].hl_open_comment);
+    editorHighlight(E.buf->syntax, row->render, row->hl, row->rsize, &st, NULL, 0);
+    editorBracketRow(row);
+
+    int changed = (row->hl_open_comment != st.in_comment);
+    row->hl_open_comment = st.in_comment;
+    return changed;
+}
+
+// Highlights row, then keeps going down for as long as the comment state
+// the next row inherits changes. Iterative, so opening a comment at the
+// top of a huge file can't blow the stack.
+void editorUpdateSyntax(erow *row) {
+    while (editorHighlightRow(row) && row->idx + 1 < E.buf->numrows) {
+        row = &E.buf->row[row->idx + 1];
+        editorRowThawText(row);
+        editorOutlineDirty(row->idx);
     }
 }
 
@@ -424,10 +943,11 @@ int editorSyntaxToColor (int hl) {
 }
 
 void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) return;
+    E.buf->syntax = NULL;
+    editorOutlineReset();
+    if (E.buf->filename == NULL) return;
 
-    char *ext = strrchr(E.filename, '.');
+    char *ext = strrchr(E.buf->filename, '.');
 
     for (unsigned int j = 0; j < HLDB_ENTRIES; ++j) {
         struct editorSyntax *s = &HLDB[j];
@@ -435,12 +955,17 @@ void editorSelectSyntaxHighlight() {
         while (s->filematch[i]) {
             int is_ext = (s->filematch[i][0] == '.');
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+                (!is_ext && strstr(E.buf->filename, s->filematch[i]))) {
+                E.buf->syntax = s;
 
 
-                for (int filerow = 0; filerow < E.numrows; ++filerow){
-                    editorUpdateSyntax(&E.row[filerow]);
+                for (int filerow = 0; filerow < E.buf->numrows; ++filerow){
+                    if (E.buf->row[filerow].blk) {
+                        editorRowThaw(&E.buf->row[filerow]);
+                        editorFreezeColdRows();
+                    } else {
+                        editorUpdateSyntax(&E.buf->row[filerow]);
+                    }
                 }
 
                 return;
@@ -450,38 +975,279 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
+/*** utf-8 ***/
+
+// Returns 1 if s[0..len) is pure ASCII. Most log lines are, and for those
+// the byte-per-column paths below apply unchanged.
+int utf8IsAscii(const char *s, int len) {
+    int j = 0;
+#ifdef __SSE2__
+    for (; j + 64 <= len; j += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + j)),
+                         _mm_loadu_si128((const __m128i *)(s + j + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + j + 32)),
+                         _mm_loadu_si128((const __m128i *)(s + j + 48))));
+        if (_mm_movemask_epi8(v)) return 0;
+    }
+    for (; j + 16 <= len; j += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + j)))) {
+            return 0;
+        }
+    }
+#endif
+    for (; j + 8 <= len; j += 8) {
+        uint64_t v;
+        memcpy(&v, s + j, 8);
+        if (v & 0x8080808080808080ULL) return 0;
+    }
+    for (; j < len; ++j) {
+        if (s[j] & 0x80) return 0;
+    }
+    return 1;
+}
+
+// Decodes the codepoint at s into *cp and returns its length in bytes.
+// Malformed input decodes as a single byte with *cp = -1.
+int utf8Decode(const char *str, int len, int *cp) {
+    const unsigned char *s = (const unsigned char *)str;
+    if (s[0] < 0x80) {
+        *cp = s[0];
+        return 1;
+    }
+
+    int n, min;
+    if ((s[0] & 0xe0) == 0xc0) {
+        n = 2; min = 0x80; *cp = s[0] & 0x1f;
+    } else if ((s[0] & 0xf0) == 0xe0) {
+        n = 3; min = 0x800; *cp = s[0] & 0x0f;
+    } else if ((s[0] & 0xf8) == 0xf0) {
+        n = 4; min = 0x10000; *cp = s[0] & 0x07;
+    } else {
+        *cp = -1;
+        return 1;
+    }
+    if (n > len) {
+        *cp = -1;
+        return 1;
+    }
+    for (int j = 1; j < n; ++j) {
+        if ((s[j] & 0xc0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        *cp = (*cp << 6) | (s[j] & 0x3f);
+    }
+    if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff)) {
+        *cp = -1;
+        return 1;
+    }
+    return n;
+}
+
+struct utf8Range {
+    int first, last;
+};
+
+// combining marks and other zero-width codepoints
+static const struct utf8Range utf8ZeroWidth[] = {
+    { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+    { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+    { 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+    { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+    { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0711, 0x0711 },
+    { 0x0730, 0x074a }, { 0x0900, 0x0902 }, { 0x093a, 0x093a },
+    { 0x093c, 0x093c }, { 0x0941, 0x0948 }, { 0x094d, 0x094d },
+    { 0x0951, 0x0957 }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a },
+    { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+    { 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x2060, 0x2064 },
+    { 0x20d0, 0x20ff }, { 0x302a, 0x302d }, { 0x3099, 0x309a },
+    { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff },
+    { 0x1f3fb, 0x1f3ff }, { 0xe0001, 0xe007f }, { 0xe0100, 0xe01ef },
+};
+
+// East Asian wide and fullwidth codepoints, and emoji
+static const struct utf8Range utf8Wide[] = {
+    { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+    { 0x23e9, 0x23ec }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x26aa, 0x26ab }, { 0x26bd, 0x26be },
+    { 0x26c4, 0x26c5 }, { 0x26f2, 0x26f5 }, { 0x2705, 0x2705 },
+    { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x2795, 0x2797 },
+    { 0x2b1b, 0x2b1c }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff },
+    { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+    { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff },
+    { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 },
+    { 0xffe0, 0xffe6 }, { 0x16fe0, 0x18aff }, { 0x1b000, 0x1b2ff },
+    { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e },
+    { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f3fa },
+    { 0x1f400, 0x1f64f }, { 0x1f680, 0x1f6ff }, { 0x1f7e0, 0x1f7eb },
+    { 0x1f90c, 0x1f9ff }, { 0x1fa70, 0x1faff }, { 0x20000, 0x2fffd },
+    { 0x30000, 0x3fffd },
+};
+
+static int utf8InTable(int cp, const struct utf8Range *t, int n) {
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < t[mid].first) {
+            hi = mid - 1;
+        } else if (cp > t[mid].last) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Display width of a codepoint. Control characters and malformed bytes are
+// drawn as a single inverse-video cell.
+int utf8Width(int cp) {
+    if (cp < 0x300) return 1;
+    if (utf8InTable(cp, utf8ZeroWidth,
+                    sizeof(utf8ZeroWidth) / sizeof(utf8ZeroWidth[0]))) {
+        return 0;
+    }
+    if (cp >= 0x1100 &&
+        utf8InTable(cp, utf8Wide, sizeof(utf8Wide) / sizeof(utf8Wide[0]))) {
+        return 2;
+    }
+    return 1;
+}
+
 /*** row operations ***/
 
-// convert chars-x to render-x
+// convert chars-x to render-x, the display column
 int editorRowCxToRx(erow *row, int cx) {
+    if (row->chunks) return editorChunkCxToRx(row, cx);
     int rx = 0;
     int j;
-    for (j = 0; j < cx; ++j) {
+    if (row->ascii) {
+        for (j = 0; j < cx; ++j) {
+            if (row->chars[j] == '\t') {
+                rx += (CEREAL_TAB_STOP - 1) - (rx % CEREAL_TAB_STOP);
+            }
+            ++rx;
+        }
+        return rx;
+    }
+
+    for (j = 0; j < cx && j < row->size;) {
         if (row->chars[j] == '\t') {
-            rx += (CEREAL_TAB_STOP - 1) - (rx % CEREAL_TAB_STOP);
+            rx += CEREAL_TAB_STOP - (rx % CEREAL_TAB_STOP);
+            ++j;
+        } else {
+            int cp;
+            j += utf8Decode(&row->chars[j], row->size - j, &cp);
+            rx += utf8Width(cp);
         }
-        ++rx;
     }
     return rx;
 }
 
 // convert render-x to chars-x
 int editorRowRxToCx(erow *row, int rx){
+    if (row->chunks) return editorChunkRxToCx(row, rx);
     int cur_rx = 0;
     int cx;
-    for (cx = 0; cx < row->size; ++cx){
-        if (row->chars[cx] == '\t'){
-            cur_rx += (CEREAL_TAB_STOP - 1) - (cur_rx % CEREAL_TAB_STOP);
+    if (row->ascii) {
+        for (cx = 0; cx < row->size; ++cx){
+            if (row->chars[cx] == '\t'){
+                cur_rx += (CEREAL_TAB_STOP - 1) - (cur_rx % CEREAL_TAB_STOP);
+            }
+            ++cur_rx;
+            if (cur_rx > rx){
+                return cx;
+            }
         }
-        ++cur_rx;
-        if (cur_rx > rx){
+        return cx;
+    }
+
+    for (cx = 0; cx < row->size;) {
+        int width, len = 1;
+        if (row->chars[cx] == '\t') {
+            width = CEREAL_TAB_STOP - (cur_rx % CEREAL_TAB_STOP);
+        } else {
+            int cp;
+            len = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+            width = utf8Width(cp);
+        }
+        if (cur_rx + width > rx) {
             return cx;
         }
+        cur_rx += width;
+        cx += len;
     }
     return cx;
 }
 
-void editorUpdateRow(erow *row) {
+// convert chars-x to an index into render (and hl)
+int editorRowCxToRb(erow *row, int cx) {
+    if (row->ascii) return editorRowCxToRx(row, cx);
+
+    int rx = 0, rb = 0;
+    for (int j = 0; j < cx && j < row->size;) {
+        if (row->chars[j] == '\t') {
+            int spaces = CEREAL_TAB_STOP - (rx % CEREAL_TAB_STOP);
+            rx += spaces;
+            rb += spaces;
+            ++j;
+        } else {
+            int cp;
+            int len = utf8Decode(&row->chars[j], row->size - j, &cp);
+            rx += utf8Width(cp);
+            rb += len;
+            j += len;
+        }
+    }
+    return rb;
+}
+
+// The cursor moves over whole codepoints, and a combining mark travels with
+// the character it modifies.
+int editorRowNextCx(erow *row, int cx) {
+    if (cx >= row->size) return row->size;
+    if (row->chunks) return editorChunkNextCx(row, cx);
+    if (row->ascii) return cx + 1;
+
+    int cp;
+    cx += utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    while (cx < row->size) {
+        int len = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+        if (utf8Width(cp) != 0) break;
+        cx += len;
+    }
+    return cx;
+}
+
+int editorRowPrevCx(erow *row, int cx) {
+    if (cx <= 0) return 0;
+    if (row->chunks) return editorChunkPrevCx(row, cx);
+    if (row->ascii) return cx - 1;
+
+    while (cx > 0) {
+        int start = cx - 1;
+        while (start > 0 && start > cx - 4 &&
+               (row->chars[start] & 0xc0) == 0x80) {
+            --start;
+        }
+        int cp;
+        if (start + utf8Decode(&row->chars[start], row->size - start, &cp) != cx) {
+            start = cx - 1; // stray continuation byte
+            cp = -1;
+        }
+        cx = start;
+        if (utf8Width(cp) != 0) break;
+    }
+    return cx;
+}
+
+void editorUpdateRender(erow *row) {
+    row->version = ++E.render_version;
+    if (row->chunks) {
+        editorChunkRender(row);
+        return;
+    }
     int tabs = 0;
     int j;
     for (j = 0; j < row->size; ++j) {
@@ -489,417 +1255,7788 @@ void editorUpdateRow(erow *row) {
             ++tabs;
         }
     }
-    free(row->render);
-    row->render = malloc(row->size + tabs * (CEREAL_TAB_STOP - 1) + 1);
+    memFree(MEM_RENDER, row->render);
+    row->render = memAlloc(MEM_RENDER, row->size + tabs * (CEREAL_TAB_STOP - 1) + 1);
+    row->ascii = utf8IsAscii(row->chars, row->size);
 
     int idx = 0;
-    for (j = 0; j < row->size; ++j) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % CEREAL_TAB_STOP != 0) {
+    if (row->ascii) {
+        for (j = 0; j < row->size; ++j) {
+            if (row->chars[j] == '\t') {
                 row->render[idx++] = ' ';
+                while (idx % CEREAL_TAB_STOP != 0) {
+                    row->render[idx++] = ' ';
+                }
+            } else {
+                row->render[idx++] = row->chars[j];
+            }
+        }
+    } else {
+        // tab stops count display columns, not bytes
+        int col = 0;
+        for (j = 0; j < row->size;) {
+            if (row->chars[j] == '\t') {
+                do {
+                    row->render[idx++] = ' ';
+                } while (++col % CEREAL_TAB_STOP != 0);
+                ++j;
+            } else {
+                int cp;
+                int len = utf8Decode(&row->chars[j], row->size - j, &cp);
+                memcpy(&row->render[idx], &row->chars[j], len);
+                idx += len;
+                j += len;
+                col += utf8Width(cp);
             }
-        } else {
-            row->render[idx++] = row->chars[j];
         }
     }
     row->render[idx] = '\0';
     row->rsize = idx;
+}
 
-    editorUpdateSyntax(row);
+// Leaves row stale, so the next editorHighlightRow renders it. Its chars
+// have changed, so ascii is redone now: moving the cursor relies on it.
+void editorRowDropRender(erow *row) {
+    memFree(MEM_RENDER, row->render);
+    row->render = NULL;
+    row->rsize = 0;
+    row->ascii = utf8IsAscii(row->chars, row->size);
 }
 
-void editorInsertRow(int at, char *s, size_t len){
-    if (at < 0 || at > E.numrows) return;
+// Notes that row at has chars but no render yet, see editorUpdateStaleRows.
+void editorNoteStale(int at) {
+    if (E.buf->stale_lo >= E.buf->stale_hi) {
+        E.buf->stale_lo = at;
+        E.buf->stale_hi = at + 1;
+    } else if (at < E.buf->stale_lo) {
+        E.buf->stale_lo = at;
+    } else if (at >= E.buf->stale_hi) {
+        E.buf->stale_hi = at + 1;
+    }
+}
+
+// A replay edits the same rows over and over, so while one runs rows are
+// left stale and rendered once at the end. So are the rows a key applied at
+// every cursor edits. Returns 1 if row was.
+int editorDeferRow(erow *row) {
+    if ((E.macro_pos < 0 && !E.batch) || row->chunks) return 0;
+    editorRowDropRender(row);
+    editorNoteStale(row->idx);
+    return 1;
+}
+
+// Tells the change marker, the outline and the occur list that the text of
+// row changed. Whatever rebuilds a row's chars calls it.
+void editorRowEdited(erow *row) {
+    row->edited = 1;
+    editorOutlineDirty(row->idx);
+    editorOccurSplice(row->idx, row->idx + 1, row->idx + 1);
+}
+
+void editorUpdateRow(erow *row) {
+    editorRowEdited(row);
+    if (row->chunks) {
+        // editorChunkInsert and editorChunkDelete highlight what they touch,
+        // and only the visible window is rendered, when it is drawn
+        row->version = ++E.render_version;
+        return;
+    }
+    if (editorDeferRow(row)) return;
+    editorUpdateRender(row);
+    editorUpdateSyntax(row);
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j < E.numrows; ++j) {
-        ++E.row[j].idx;
+// Renders and highlights the rows whose update a macro replay deferred, in
+// row order so a changed multi-line comment state cascades as usual. A
+// stale row is a warm one without render. Call it before reading hl,
+// hl_open_comment or brk of rows the replay may have touched.
+void editorUpdateStaleRows() {
+    int hi = E.buf->stale_hi < E.buf->numrows ? E.buf->stale_hi : E.buf->numrows;
+    for (int j = E.buf->stale_lo; j < hi; ++j) {
+        erow *row = &E.buf->row[j];
+        if (!row->render && !row->blk && !row->chunks) {
+            editorUpdateRender(row);
+            editorUpdateSyntax(row);
+        }
     }
+    E.buf->stale_lo = E.buf->stale_hi = 0;
+}
+
+// Sets up row as a new, warm row at at holding s, not rendered yet.
+void editorInitRow(erow *row, int at, const char *s, int len, int in_comment) {
+    row->idx = at;
+    row->size = len;
+    row->orig = -1;
+    row->edited = 1;
+    row->chars = memAlloc(MEM_CHARS, len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = in_comment;
+    row->ascii = utf8IsAscii(row->chars, len);
+    row->blk = NULL;
+    row->blkoff = 0;
+    row->chunks = NULL;
+    row->brk = (struct bracketSum){ 0, BRACKET_NONE, BRACKET_NONE };
+}
 
-    E.row[at].idx = at;
+// Inserts n rows at at with one move of the row array and one pass over
+// the idx of the rows after them, then renders and highlights them in
+// order, so a yank of many rows costs about what loading them would.
+void editorInsertRows(int at, char **s, int *len, int n) {
+    struct editorBuffer *b = E.buf;
+    if (at < 0 || at > b->numrows || n <= 0) return;
+
+    // grow geometrically so appending rows (loading, following) is amortized O(1)
+    if (b->numrows + n > b->rowcap) {
+        while (b->numrows + n > b->rowcap) {
+            b->rowcap = b->rowcap ? b->rowcap * 2 : 64;
+        }
+        b->row = memRealloc(MEM_ROWS, b->row, sizeof(erow) * b->rowcap);
+    }
+    memmove(&b->row[at + n], &b->row[at], sizeof(erow) * (b->numrows - at));
+    b->numrows += n;
+    for (int j = at + n; j < b->numrows; ++j) {
+        b->row[j].idx = j;
+    }
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    // a new row hands on the comment state it starts in until it is
+    // highlighted, so only a change to that state cascades past it
+    int in_comment = at > 0 && b->row[at - 1].hl_open_comment;
+    for (int j = 0; j < n; ++j) {
+        editorInitRow(&b->row[at + j], at + j, s[j], len[j], in_comment);
+    }
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    ++b->dirty;
+    if (at < b->brk_valid) b->brk_valid = at;
+    editorOutlineShift(at, n);
+    editorOccurSplice(at, at, at + n);
+    editorFoldShift(at, n);
+    if (b->mark_active && at <= b->marky) b->marky += n;
+    if (at < b->warm_hi) b->warm_hi += n;
+    if (at < b->stale_lo) b->stale_lo += n;
+    if (at < b->stale_hi) b->stale_hi += n;
+    if (at < b->ws_hi) b->ws_hi += n;
+
+    // each row starts where the one before it left off, so only the last
+    // can cascade into the rows that were already there
+    for (int j = at; j < at + n; ++j) {
+        erow *row = &b->row[j];
+        editorNoteWarm(j);
+        editorOutlineDirty(j);
+        if (editorDeferRow(row)) continue;
+        editorUpdateRender(row);
+        if (j + 1 < at + n) {
+            editorHighlightRow(row);
+        } else {
+            editorUpdateSyntax(row);
+        }
+    }
+}
 
-    ++E.numrows;
-    ++E.dirty;
+void editorInsertRow(int at, char *s, size_t len){
+    int n = len;
+    editorInsertRows(at, &s, &n, 1);
 }
 
 void editorFreeRow(erow *row){
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    if (row->blk) {
+        rowBlockRelease(row->blk);
+        row->blk = NULL;
+    }
+    if (row->chunks) {
+        editorRowFreeChunks(row);
+    }
+    memFree(MEM_RENDER, row->render);
+    memFree(MEM_CHARS, row->chars);
+    memFree(MEM_HL, row->hl);
+}
+
+// Where a row bound ends up once rows [at, at + n) are deleted.
+int editorDelBound(int bound, int at, int n) {
+    if (bound <= at) return bound;
+    return bound >= at + n ? bound - n : at;
+}
+
+// Deletes rows [at, at + n) with one move of the row array and one pass
+// over the idx of the rows after them.
+void editorDelRows(int at, int n) {
+    struct editorBuffer *b = E.buf;
+    if (at < 0 || at >= b->numrows || n <= 0) return;
+    if (n > b->numrows - at) n = b->numrows - at;
+
+    int handed = b->row[at + n - 1].hl_open_comment;
+    for (int j = at; j < at + n; ++j) {
+        editorFreeRow(&b->row[j]);
+    }
+    memmove(&b->row[at], &b->row[at + n], sizeof(erow) * (b->numrows - at - n));
+    b->numrows -= n;
+    for (int j = at; j < b->numrows; ++j) {
+        b->row[j].idx = j;
+    }
+
+    ++b->dirty;
+    if (at < b->brk_valid) b->brk_valid = at;
+    editorOutlineShift(at, -n);
+    editorOccurSplice(at, at + n, at);
+    editorFoldDelete(at, n);
+    if (b->mark_active) b->marky = editorDelBound(b->marky, at, n);
+    b->warm_hi = editorDelBound(b->warm_hi, at, n);
+    b->stale_lo = editorDelBound(b->stale_lo, at, n);
+    b->stale_hi = editorDelBound(b->stale_hi, at, n);
+    b->ws_hi = editorDelBound(b->ws_hi, at, n);
+
+    // the row after the deleted ones now starts in another comment state
+    int in_comment = at > 0 && b->row[at - 1].hl_open_comment;
+    if (at < b->numrows && in_comment != handed) {
+        erow *row = &b->row[at];
+        editorRowThawText(row);
+        editorOutlineDirty(at);
+        editorUpdateSyntax(row);
+    }
 }
 
 void editorDelRow(int at){
-    if(at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; ++j) {
-        --E.row[j].idx;
+    editorDelRows(at, 1);
+}
+
+// Updates a row editorSplitRows or editorJoinRows left stale, unless the
+// comment state cascading from a row above got there first, and rendered
+// and highlighted it already. Going top down, no cascade then runs through
+// rows whose text is still to change.
+void editorUpdateSpliced(erow *row) {
+    editorNoteWarm(row->idx);
+    if (!row->render) editorUpdateRow(row);
+}
+
+// Splits rows at the n points (ys[k], xs[k]), in order and all on rows that
+// exist: the text from each point on starts a new row. The row array moves
+// once however many rows split, so Enter at every one of many cursors costs
+// about what one editorInsertRows does. Leaves the rows split and the new
+// rows to be rendered through editorUpdateRow, deferred or not.
+void editorSplitRows(const int *ys, const int *xs, int n) {
+    struct editorBuffer *b = E.buf;
+    if (n <= 0) return;
+    for (int k = 0; k < n; ++k) {
+        erow *row = &b->row[ys[k]];
+        editorRowThaw(row);
+        editorRowFlatten(row);
+    }
+    if (b->numrows + n > b->rowcap) {
+        while (b->numrows + n > b->rowcap) {
+            b->rowcap = b->rowcap ? b->rowcap * 2 : 64;
+        }
+        b->row = memRealloc(MEM_ROWS, b->row, sizeof(erow) * b->rowcap);
+    }
+
+    // bottom up, every row moves down by the splits on the rows above it,
+    // so none is overwritten before it has moved
+    int k = n - 1;
+    for (int j = b->numrows - 1; j >= ys[0]; --j) {
+        int last = k;
+        while (k >= 0 && ys[k] == j) --k;
+        erow row = b->row[j];
+        for (int p = last; p > k; --p) {
+            int end = p == last ? row.size : xs[p + 1];
+            editorInitRow(&b->row[j + p + 1], j + p + 1, &row.chars[xs[p]],
+                          end - xs[p], row.hl_open_comment);
+        }
+        if (last > k) {
+            row.size = xs[k + 1];
+            row.chars[row.size] = '\0';
+            row.edited = 1;
+            editorRowDropRender(&row);
+        }
+        row.idx = j + k + 1;
+        b->row[j + k + 1] = row;
+    }
+    b->numrows += n;
+
+    // the hooks see the splits from the bottom up, each in the rows as
+    // they are before it
+    ++b->dirty;
+    if (ys[0] < b->brk_valid) b->brk_valid = ys[0];
+    for (k = n - 1; k >= 0; --k) {
+        int at = ys[k] + 1;
+        editorOutlineShift(at, 1);
+        editorOccurSplice(at - 1, at, at + 1);
+        editorFoldShift(at, 1);
+        if (b->mark_active && at <= b->marky) ++b->marky;
+        if (at < b->warm_hi) ++b->warm_hi;
+        if (at < b->stale_lo) ++b->stale_lo;
+        if (at < b->stale_hi) ++b->stale_hi;
+        if (at < b->ws_hi) ++b->ws_hi;
+    }
+    for (k = 0; k < n; ++k) {
+        int y = ys[k] + k;
+        if (k == 0 || ys[k - 1] != ys[k]) {
+            editorUpdateSpliced(&b->row[y]);
+        }
+        editorUpdateSpliced(&b->row[y + 1]);
+    }
+}
+
+// Joins each of the n rows ys[k], in order and all past row 0, onto the
+// end of the row before it, with one move of the row array. offs[k] gets
+// the column of the joined row where the text of row ys[k] now starts.
+void editorJoinRows(const int *ys, int n, int *offs) {
+    struct editorBuffer *b = E.buf;
+    if (n <= 0) return;
+    for (int k = 0; k < n; ++k) {
+        editorRowThaw(&b->row[ys[k] - 1]);
+        editorRowFlatten(&b->row[ys[k] - 1]);
+        editorRowThaw(&b->row[ys[k]]);
+        editorRowFlatten(&b->row[ys[k]]);
+    }
+    int k = 0, dst = ys[0] - 1;
+    for (int j = ys[0]; j < b->numrows; ++j) {
+        if (k < n && ys[k] == j) {
+            erow *into = &b->row[dst], *row = &b->row[j];
+            offs[k++] = into->size;
+            into->chars = memRealloc(MEM_CHARS, into->chars, into->size + row->size + 1);
+            memcpy(&into->chars[into->size], row->chars, row->size + 1);
+            into->size += row->size;
+            // the state the row after was highlighted in, so a change to
+            // it cascades
+            into->hl_open_comment = row->hl_open_comment;
+            into->edited = 1;
+            editorRowDropRender(into);
+            editorFreeRow(row);
+        } else {
+            b->row[++dst] = b->row[j];
+            b->row[dst].idx = dst;
+        }
+    }
+    b->numrows -= n;
+
+    ++b->dirty;
+    if (ys[0] - 1 < b->brk_valid) b->brk_valid = ys[0] - 1;
+    for (k = n - 1; k >= 0; --k) {
+        int at = ys[k];
+        editorOutlineShift(at, -1);
+        editorOccurSplice(at - 1, at + 1, at);
+        editorFoldDelete(at, 1);
+        if (b->mark_active) b->marky = editorDelBound(b->marky, at, 1);
+        b->warm_hi = editorDelBound(b->warm_hi, at, 1);
+        b->stale_lo = editorDelBound(b->stale_lo, at, 1);
+        b->stale_hi = editorDelBound(b->stale_hi, at, 1);
+        b->ws_hi = editorDelBound(b->ws_hi, at, 1);
+    }
+    for (k = 0; k < n; ++k) {
+        int y = ys[k] - 1 - k;
+        if (k == 0 || ys[k - 1] != ys[k] - 1) {
+            editorUpdateSpliced(&b->row[y]);
+        }
     }
-    --E.numrows;
-    ++E.dirty;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
+    editorRowThaw(row);
     if (at < 0 || at > row->size) {
         at = row->size;
     }
-    row->chars = realloc(row->chars, row->size + 2);
+    if (!row->chunks && row->size >= CEREAL_LONG_LINE) {
+        editorRowChunk(row);
+    }
+    if (row->chunks) {
+        char ch = c;
+        editorChunkInsert(row, at, &ch, 1);
+        editorUpdateRow(row);
+        ++E.buf->dirty;
+        return;
+    }
+    row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     ++row->size;
     row->chars[at] = c;
     editorUpdateRow(row);
-    ++E.dirty;
+    ++E.buf->dirty;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len){
-    row->chars = realloc(row->chars, row->size + len + 1);
+    editorRowThaw(row);
+    if (!row->chunks && row->size + len >= CEREAL_LONG_LINE) {
+        editorRowChunk(row);
+    }
+    if (row->chunks) {
+        // append to the last chunk, which splits itself as it grows
+        while (len > 0) {
+            int n = len > CEREAL_CHUNK_SIZE ? CEREAL_CHUNK_SIZE : len;
+            if (n < (int)len) {
+                n = editorChunkSplitPoint(s, n);
+            }
+            editorChunkInsert(row, row->size, s, n);
+            s += n;
+            len -= n;
+        }
+        editorUpdateRow(row);
+        ++E.buf->dirty;
+        return;
+    }
+    row->chars = memRealloc(MEM_CHARS, row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
     editorUpdateRow(row);
-    ++E.dirty;
+    ++E.buf->dirty;
 }
 
 void editorInsertNewline() {
-    if (E.cx == 0){
-        editorInsertRow(E.cy, "", 0);
+    if (E.buf->cx == 0){
+        editorInsertRow(E.buf->cy, "", 0);
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        // the row keeps its head and is highlighted before the tail, so
+        // the tail starts in the right comment state
+        editorSplitRows(&E.buf->cy, &E.buf->cx, 1);
     }
-    ++E.cy;
-    E.cx = 0;
+    ++E.buf->cy;
+    E.buf->cx = 0;
 }
 
-void editorRowDelChar(erow *row, int at){
-    if(at < 0 || at >= row->size) return;
+// deletes len bytes at at, e.g. one whole UTF-8 sequence
+void editorRowDelChars(erow *row, int at, int len){
+    if(at < 0 || len <= 0 || at + len > row->size) return;
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    --row->size;
+    editorRowThaw(row);
+    if (!row->chunks && row->size >= CEREAL_LONG_LINE) {
+        editorRowChunk(row);
+    }
+    if (row->chunks) {
+        // editorChunkDelete stops at the end of a chunk
+        while (len > 0) {
+            int size = row->size;
+            editorChunkDelete(row, at, len);
+            len -= size - row->size;
+        }
+        editorUpdateRow(row);
+        ++E.buf->dirty;
+        return;
+    }
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
     editorUpdateRow(row);
-    ++E.dirty;
+    ++E.buf->dirty;
 }
 
-/*** editor operations ***/
+/*** cold rows ***/
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    ++E.cx;
-}
+// A small LZ77 codec in the spirit of LZ4: each sequence is a token byte
+// (literal count in the high nibble, match length - 4 in the low nibble,
+// 15 meaning "more length bytes follow"), the literals, then a 2-byte
+// little-endian match offset. The last sequence carries literals only.
 
-void editorDelChar(){
-    if(E.cy == E.numrows) return;
-    if(E.cx == 0 && E.cy == 0) return;
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
 
-    erow *row = &E.row[E.cy];
-    if(E.cx > 0){
-        editorRowDelChar(row, E.cx - 1);
-        --E.cx;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        --E.cy;
+static uint32_t lzRead32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int lzPutLength(unsigned char *dst, int op, int len) {
+    while (len >= 255) {
+        dst[op++] = 255;
+        len -= 255;
     }
+    dst[op++] = len;
+    return op;
 }
 
-/*** file i/o ***/
+// dst must hold LZ_BOUND(len) bytes. Returns the compressed size.
+int lzCompress(const char *source, int len, char *dest) {
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *dst = (unsigned char *)dest;
+    int table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH < len) {
+        uint32_t seq = lzRead32(src + ip);
+        int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > 0xffff || lzRead32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) {
+            ++mlen;
+        }
+
+        int lit = ip - anchor;
+        int ml = mlen - LZ_MIN_MATCH;
+        int token = op++;
+        dst[token] = ((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15);
+        if (lit >= 15) op = lzPutLength(dst, op, lit - 15);
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        dst[op++] = (ip - ref) & 0xff;
+        dst[op++] = (ip - ref) >> 8;
+        if (ml >= 15) op = lzPutLength(dst, op, ml - 15);
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    int lit = len - anchor;
+    dst[op++] = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) op = lzPutLength(dst, op, lit - 15);
+    memcpy(dst + op, src + anchor, lit);
+    return op + lit;
+}
+
+void lzDecompress(const char *source, int clen, char *dest) {
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *dst = (unsigned char *)dest;
+    int ip = 0, op = 0;
+    while (ip < clen) {
+        int token = src[ip++];
+        int lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do { b = src[ip++]; lit += b; } while (b == 255);
+        }
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip >= clen) break;
+
+        int off = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int mlen = (token & 15);
+        if (mlen == 15) {
+            int b;
+            do { b = src[ip++]; mlen += b; } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        // byte by byte: the match may overlap what it produces
+        for (int j = 0; j < mlen; ++j, ++op) {
+            dst[op] = dst[op - off];
+        }
+    }
+}
+
+// Returns the decompressed text of blk, keeping the last CEREAL_BLOCK_LRU
+// blocks decompressed. The pointer is valid until the next call.
+char *rowBlockPlain(struct rowBlock *blk) {
+    if (blk->mapped) return blk->plain;
     int j;
-    for (j = 0; j < E.numrows; ++j) {
-        totlen += E.row[j].size + 1;
+    for (j = 0; j < CEREAL_BLOCK_LRU - 1 && E.blklru[j] != blk; ++j);
+
+    if (E.blklru[j] != blk) {
+        struct rowBlock *victim = E.blklru[j];
+        if (victim) {
+            memFree(MEM_BLOCKS, victim->plain);
+            victim->plain = NULL;
+        }
+        blk->plain = memAlloc(MEM_BLOCKS, blk->len ? blk->len : 1);
+        lzDecompress(blk->data, blk->clen, blk->plain);
     }
-    *buflen = totlen;
+    // move to front
+    memmove(&E.blklru[1], &E.blklru[0], sizeof(E.blklru[0]) * j);
+    E.blklru[0] = blk;
+    return blk->plain;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; ++j) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        ++p;
+void rowBlockRelease(struct rowBlock *blk) {
+    if (--blk->refs > 0) return;
+    if (blk->mapped) {
+        munmap(blk->plain, blk->len);
+        free(blk);
+        return;
+    }
+    struct rowBlock **p = &E.blktab[blk->hash & (E.blktab_size - 1)];
+    while (*p != blk) p = &(*p)->next;
+    *p = blk->next;
+    --E.nblocks;
+    for (int j = 0; j < CEREAL_BLOCK_LRU; ++j) {
+        if (E.blklru[j] == blk) {
+            memmove(&E.blklru[j], &E.blklru[j + 1],
+                    sizeof(E.blklru[0]) * (CEREAL_BLOCK_LRU - j - 1));
+            E.blklru[CEREAL_BLOCK_LRU - 1] = NULL;
+            break;
+        }
     }
+    memFree(MEM_BLOCKS, blk->plain);
+    memFree(MEM_BLOCKS, blk->data);
+    free(blk);
+}
 
-    return buf;
+// Cold blocks are interned: freezing text some block already holds, in
+// this buffer or another, shares that block instead of compressing a copy.
+// Returns the block holding exactly plain, or NULL.
+struct rowBlock *rowBlockIntern(const char *plain, int len, uint64_t hash) {
+    if (!E.blktab) return NULL;
+    for (struct rowBlock *blk = E.blktab[hash & (E.blktab_size - 1)]; blk;
+         blk = blk->next) {
+        if (blk->hash == hash && blk->len == len &&
+            !memcmp(rowBlockPlain(blk), plain, len)) {
+            return blk;
+        }
+    }
+    return NULL;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+void rowBlockAdd(struct rowBlock *blk) {
+    if (E.nblocks >= E.blktab_size) {
+        int size = E.blktab_size ? E.blktab_size * 2 : 256;
+        struct rowBlock **tab = calloc(size, sizeof(tab[0]));
+        for (int j = 0; j < E.blktab_size; ++j) {
+            while (E.blktab[j]) {
+                struct rowBlock *b = E.blktab[j];
+                E.blktab[j] = b->next;
+                b->next = tab[b->hash & (size - 1)];
+                tab[b->hash & (size - 1)] = b;
+            }
+        }
+        free(E.blktab);
+        E.blktab = tab;
+        E.blktab_size = size;
+    }
+    struct rowBlock **head = &E.blktab[blk->hash & (E.blktab_size - 1)];
+    blk->next = *head;
+    *head = blk;
+    ++E.nblocks;
+}
 
-    editorSelectSyntaxHighlight();
+// Raw text of a row, warm, cold or chunked, for reading. Not NUL-terminated
+// for cold rows. A chunked row stays chunked: its text is copied out once
+// and kept until the row is next edited. Callers that change chars call
+// editorRowFlatten instead.
+const char *editorRowText(erow *row) {
+    struct rowChunks *cs = row->chunks;
+    if (cs) {
+        if (!cs->text) {
+            cs->text = memAlloc(MEM_CHARS, row->size + 1);
+            int off = 0;
+            for (int k = 0; k < cs->n; ++k) {
+                memcpy(cs->text + off, cs->c[k].s, cs->c[k].len);
+                off += cs->c[k].len;
+            }
+            cs->text[off] = '\0';
+        }
+        return cs->text;
+    }
+    if (row->blk) {
+        return rowBlockPlain(row->blk) + row->blkoff;
+    }
+    return row->chars;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
+void editorNoteWarm(int at) {
+    if (E.buf->warm_count == 0 || at < E.buf->warm_lo) {
+        E.buf->warm_lo = at;
+    }
+    if (E.buf->warm_count == 0 || at >= E.buf->warm_hi) {
+        E.buf->warm_hi = at + 1;
+    }
+    ++E.buf->warm_count;
+}
+
+// Copies a cold row's text out of its (cached) block, leaving the row
+// stale: editorHighlightRow renders it, so a row thawed while rows are
+// deferred isn't rendered twice.
+void editorRowThawText(erow *row) {
+    if (!row->blk) return;
+
+    struct rowBlock *blk = row->blk;
+    row->chars = memAlloc(MEM_CHARS, row->size + 1);
+    memcpy(row->chars, rowBlockPlain(blk) + row->blkoff, row->size);
+    row->chars[row->size] = '\0';
+    row->blk = NULL;
+    rowBlockRelease(blk);
+
+    editorNoteWarm(row->idx);
+}
+
+// Brings a cold row back with render and hl rebuilt. Cheap for warm rows,
+// so call it before touching chars, render or hl of any row that might be
+// off-screen.
+void editorRowThaw(erow *row) {
+    if (!row->blk) return;
+    editorRowThawText(row);
+    if (!editorDeferRow(row)) editorUpdateSyntax(row);
+}
+
+// Compresses rows [at, at + n) into one block and drops their render/hl.
+void editorFreezeRows(int at, int n) {
+    int len = 0;
+    for (int j = at; j < at + n; ++j) {
+        len += E.buf->row[j].size;
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 &&
-               (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            --linelen;
+    char *plain = malloc(len ? len : 1);
+    int off = 0;
+    for (int j = at; j < at + n; ++j) {
+        erow *row = &E.buf->row[j];
+        // warm, or cold in a mapped file (see editorUnmapRows)
+        const char *text = row->blk ? row->blk->plain + row->blkoff : row->chars;
+        memcpy(plain + off, text, row->size);
+        off += row->size;
+    }
+
+    uint64_t hash = editorHashLine(plain, len);
+    struct rowBlock *blk = rowBlockIntern(plain, len, hash);
+    if (blk) {
+        blk->refs += n;
+    } else {
+        blk = malloc(sizeof(struct rowBlock));
+        blk->refs = n;
+        blk->len = len;
+        blk->data = memAlloc(MEM_BLOCKS, LZ_BOUND(len));
+        blk->clen = lzCompress(plain, len, blk->data);
+        blk->data = memRealloc(MEM_BLOCKS, blk->data, blk->clen ? blk->clen : 1);
+        blk->plain = NULL;
+        blk->hash = hash;
+        blk->mapped = 0;
+        rowBlockAdd(blk);
+    }
+    free(plain);
+
+    off = 0;
+    for (int j = at; j < at + n; ++j) {
+        erow *row = &E.buf->row[j];
+        if (row->blk) {
+            rowBlockRelease(row->blk);
         }
-        editorInsertRow(E.numrows, line, linelen);
+        memFree(MEM_CHARS, row->chars);
+        memFree(MEM_RENDER, row->render);
+        memFree(MEM_HL, row->hl);
+        row->chars = row->render = NULL;
+        row->hl = NULL;
+        row->rsize = 0;
+        row->blk = blk;
+        row->blkoff = off;
+        off += row->size;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
 }
 
-void editorSave() {
-    // new file
-    if(E.filename == NULL) {
-        E.filename = editorPrompt("Save as : %s (ESC or C-g to cancel)", NULL);
-        if (E.filename == NULL){
-            editorSetStatusMessage("Save aborted");
-            return;
+// Whether a run of rows being frozen may end after row. The cut depends
+// only on the row's text, so equal stretches of text freeze into equal
+// blocks (shared by rowBlockIntern) even at different row numbers, in
+// different buffers, or after an edit further up.
+int editorIsBlockEnd(erow *row) {
+    return (editorHashLine(row->chars, row->size) >> 57) == 0;
+}
+
+// Freezes the warm rows of [lo, hi) that lie outside [ws_lo, ws_hi), in
+// blocks of CEREAL_BLOCK_MIN_ROWS to CEREAL_BLOCK_ROWS consecutive rows.
+// A run cut short by hi stays warm, noted for the next sweep, rather than
+// being ended where its content doesn't say so.
+void editorFreezeRange(int lo, int hi, int ws_lo, int ws_hi) {
+    if (hi > E.buf->numrows) hi = E.buf->numrows;
+
+    int run = 0; // warm rows collected up to j
+    for (int j = lo; j < hi; ++j) {
+        erow *row = &E.buf->row[j];
+        int eligible = (j < ws_lo || j >= ws_hi) && j != E.buf->cy &&
+            !row->blk && !row->chunks;
+        if (!eligible) {
+            if (run > 0) {
+                editorFreezeRows(j - run, run);
+            }
+            run = 0;
+            continue;
+        }
+        ++run;
+        if (run == CEREAL_BLOCK_ROWS ||
+            (run >= CEREAL_BLOCK_MIN_ROWS && editorIsBlockEnd(row))) {
+            editorFreezeRows(j - run + 1, run);
+            run = 0;
         }
-        editorSelectSyntaxHighlight();
     }
+    if (run > 0) {
+        editorNoteWarm(hi - run);
+        editorNoteWarm(hi - 1);
+    }
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
-    // create a new file if it doesn't already exist (O_CREAT),
-    //  then open it for reading and writing (O_RDWR)
-    // 0644 is the standard permission for text files needed due to O_CREAT flag
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1){
-        if(ftruncate(fd, len) != -1){ // sets the file size to len
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+// Compresses warm rows outside the working set (the viewport, a margin of
+// CEREAL_BLOCK_ROWS on each side, and the cursor row). Only rows warmed
+// since the last sweep and the previous working set are scanned, and only
+// once enough rows have warmed up, so the cost is amortized over the thaws.
+// Must not run while a caller holds row pointers it still uses.
+void editorFreezeColdRows() {
+    editorUpdateStaleRows(); // frozen rows keep hl_open_comment and brk
+    if (E.buf->numrows < CEREAL_COLD_MIN_ROWS) return;
+    if (E.buf->warm_count < 4 * CEREAL_BLOCK_ROWS) return;
+
+    int ws_lo = E.buf->rowoff - CEREAL_BLOCK_ROWS;
+    int ws_hi = editorScreenRow(E.screenrows - 1) + 1 + CEREAL_BLOCK_ROWS;
+    if (ws_lo < 0) ws_lo = 0;
+    if (ws_hi > E.buf->numrows) ws_hi = E.buf->numrows;
+
+    int warm_lo = E.buf->warm_lo, warm_hi = E.buf->warm_hi;
+    E.buf->warm_count = 0; // from here on counts the rows left warm
+    editorFreezeRange(warm_lo, warm_hi, ws_lo, ws_hi);
+    editorFreezeRange(E.buf->ws_lo, E.buf->ws_hi, ws_lo, ws_hi);
+
+    E.buf->ws_lo = ws_lo;
+    E.buf->ws_hi = ws_hi;
+}
+
+/*** long rows ***/
+
+// Display column reached after drawing s[0..len) from column col.
+int editorTextWidth(const char *s, int len, int col) {
+    int ascii = utf8IsAscii(s, len);
+    for (int j = 0; j < len;) {
+        if (s[j] == '\t') {
+            col += CEREAL_TAB_STOP - (col % CEREAL_TAB_STOP);
+            ++j;
+        } else if (ascii) {
+            ++col;
+            ++j;
+        } else {
+            int cp;
+            j += utf8Decode(&s[j], len - j, &cp);
+            col += utf8Width(cp);
+        }
+    }
+    return col;
+}
+
+// Width of the chunk for each tab phase it may start at, in one pass: text
+// between tabs is as wide in every phase, only the tabs differ.
+void editorChunkWidths(struct rowChunk *ch) {
+    int col[CEREAL_TAB_STOP];
+    int p;
+    for (p = 0; p < CEREAL_TAB_STOP; ++p) {
+        col[p] = p;
+    }
+
+    int ascii = utf8IsAscii(ch->s, ch->len);
+    int run = 0;
+    for (int j = 0; j < ch->len;) {
+        if (ch->s[j] == '\t') {
+            for (p = 0; p < CEREAL_TAB_STOP; ++p) {
+                col[p] += run;
+                col[p] += CEREAL_TAB_STOP - (col[p] % CEREAL_TAB_STOP);
             }
+            run = 0;
+            ++j;
+        } else if (ascii) {
+            ++run;
+            ++j;
+        } else {
+            int cp;
+            j += utf8Decode(&ch->s[j], ch->len - j, &cp);
+            run += utf8Width(cp);
         }
-        close(fd);
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    for (p = 0; p < CEREAL_TAB_STOP; ++p) {
+        ch->width[p] = col[p] + run - p;
+    }
 }
 
-/*** search ***/
+// Characters that can change the highlighter state beyond themselves.
+int editorIsHlDelimiter(char c) {
+    if (E.buf->syntax == NULL || c == '\0') return 0;
+    char *scs = E.buf->syntax->singleline_comment_start;
+    char *mcs = E.buf->syntax->multiline_comment_start;
+    char *mce = E.buf->syntax->multiline_comment_end;
+    return strchr("\"'\\", c) || (scs && strchr(scs, c)) ||
+        (mcs && strchr(mcs, c)) || (mce && strchr(mce, c));
+}
 
-void editorSearchCallback(char *query, int key){
-   static int last_match = -1;
-   static int direction = 1;
+// Picks where to cut s near at: never inside a UTF-8 sequence and, when
+// possible, not next to a delimiter so tokens rarely straddle chunks.
+int editorChunkSplitPoint(const char *s, int at) {
+    for (int j = at; j > at - 64 && j > 1; --j) {
+        if ((s[j] & 0xc0) != 0x80 && !editorIsHlDelimiter(s[j]) &&
+            !editorIsHlDelimiter(s[j - 1])) {
+            return j;
+        }
+    }
+    while (at > 1 && (s[at] & 0xc0) == 0x80) --at;
+    return at;
+}
 
-   static int saved_hl_line;
-   static char *saved_hl = NULL;
+// Inserts an empty chunk at index k.
+struct rowChunk *editorChunkInsertAt(struct rowChunks *cs, int k, int cap) {
+    if (cs->n == cs->cap) {
+        cs->cap = cs->cap ? cs->cap * 2 : 16;
+        cs->c = realloc(cs->c, sizeof(struct rowChunk) * cs->cap);
+    }
+    memmove(&cs->c[k + 1], &cs->c[k], sizeof(struct rowChunk) * (cs->n - k));
+    ++cs->n;
+
+    struct rowChunk *ch = &cs->c[k];
+    memset(ch, 0, sizeof(*ch));
+    ch->mark.skip = -1; // start state unknown until the next rescan
+    ch->cap = cap;
+    ch->s = memAlloc(MEM_CHARS, cap);
+    return ch;
+}
 
-   if (saved_hl) {
-       memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-       free(saved_hl);
-       saved_hl = NULL;
-   }
+// Cuts chunk k in two once it has grown past twice the chunk size.
+void editorChunkSplit(struct rowChunks *cs, int k) {
+    struct rowChunk *ch = &cs->c[k];
+    int at = editorChunkSplitPoint(ch->s, ch->len / 2);
+    int rest = ch->len - at;
+
+    struct rowChunk *next = editorChunkInsertAt(cs, k + 1, rest + CEREAL_CHUNK_SIZE / 4);
+    ch = &cs->c[k];
+    memcpy(next->s, ch->s + at, rest);
+    next->len = rest;
+    ch->len = at;
+    editorChunkWidths(ch);
+    editorChunkWidths(next);
+}
 
-    if (key == '\r' || key == '\x1b' || key == CTRL_KEY('g')){
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN ||
-               key == CTRL_KEY('n') || key == CTRL_KEY('s')){
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP ||
-               key == CTRL_KEY('p') || key == CTRL_KEY('r')){
-        direction = -1;
+// Switches a row to chunked storage. Done once, when a long row is first
+// edited; the row stays chunked until something needs it flat.
+void editorRowChunk(erow *row) {
+    struct rowChunks *cs = calloc(1, sizeof(struct rowChunks));
+
+    // an empty row about to get a long append still needs its one chunk
+    int off = 0;
+    do {
+        int len = row->size - off;
+        if (len > CEREAL_CHUNK_SIZE + CEREAL_CHUNK_SIZE / 2) {
+            len = editorChunkSplitPoint(row->chars + off, CEREAL_CHUNK_SIZE);
+        }
+        struct rowChunk *ch = editorChunkInsertAt(cs, cs->n, len + CEREAL_CHUNK_SIZE / 4);
+        memcpy(ch->s, row->chars + off, len);
+        ch->len = len;
+        editorChunkWidths(ch);
+        off += len;
+    } while (off < row->size);
+
+    memFree(MEM_CHARS, row->chars);
+    memFree(MEM_RENDER, row->render);
+    memFree(MEM_HL, row->hl);
+    row->chars = row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+    row->chunks = cs;
+    editorChunkRescan(row, 0);
+    editorBracketRow(row);
+}
+
+void editorRowFreeChunks(erow *row) {
+    memFree(MEM_CHARS, row->chunks->text);
+    for (int k = 0; k < row->chunks->n; ++k) {
+        memFree(MEM_CHARS, row->chunks->c[k].s);
+    }
+    free(row->chunks->c);
+    free(row->chunks);
+    row->chunks = NULL;
+}
+
+// Back to a plain row with a full render, for code that needs row->chars.
+void editorRowFlatten(erow *row) {
+    if (!row->chunks) return;
+
+    row->chars = memAlloc(MEM_CHARS, row->size + 1);
+    int off = 0;
+    for (int k = 0; k < row->chunks->n; ++k) {
+        memcpy(row->chars + off, row->chunks->c[k].s, row->chunks->c[k].len);
+        off += row->chunks->c[k].len;
+    }
+    row->chars[row->size] = '\0';
+    editorRowFreeChunks(row);
+    editorUpdateRow(row);
+}
+
+// Re-runs the highlighter from chunk from on to refresh the start state
+// stored with each later chunk, stopping as soon as a chunk's state comes
+// out unchanged. Typing ordinary characters never needs this. Returns 1 if
+// hl_open_comment changed.
+int editorChunkRescan(erow *row, int from) {
+    struct rowChunks *cs = row->chunks;
+    if (E.buf->syntax == NULL) return 0;
+
+    struct hlState st = { 0, 0, 1, 0 };
+    int skip = 0;
+    unsigned char skip_hl = HL_NORMAL;
+    if (from == 0) {
+        st.in_comment = (row->idx > 0 && E.buf->row[row->idx - 1].hl_open_comment);
+        cs->c[0].mark.st = st;
+        cs->c[0].mark.skip = 0;
+        cs->c[0].mark.skip_hl = HL_NORMAL;
     } else {
-        last_match = -1;
-        direction = 1;
+        st = cs->c[from].mark.st;
+        skip = cs->c[from].mark.skip;
+        skip_hl = cs->c[from].mark.skip_hl;
     }
 
-    if (last_match == -1){
-        direction = 1;
+    char *text = NULL;
+    unsigned char *hl = NULL;
+    int cap = 0;
+    for (int k = from; k < cs->n; ++k) {
+        struct rowChunk *ch = &cs->c[k];
+        struct hlMark mark = { 0, st, 0, HL_NORMAL };
+        if (st.in_line_comment) {
+            // nothing left to scan on this row
+        } else if (skip >= ch->len) {
+            // a token runs through the whole chunk
+            mark.skip = skip - ch->len;
+            mark.skip_hl = skip_hl;
+        } else {
+            // the chunk past the skipped bytes, plus enough of the next ones
+            // for delimiters and keywords that straddle the boundary
+            int len = ch->len - skip;
+            int total = len;
+            for (int j = k + 1; j < cs->n && total - len < 64; ++j) {
+                total += cs->c[j].len;
+            }
+            if (total + 1 > cap) {
+                cap = total + 1;
+                text = realloc(text, cap);
+                hl = realloc(hl, cap);
+            }
+            memcpy(text, ch->s + skip, len);
+            int off = len;
+            for (int j = k + 1; off < total; ++j) {
+                memcpy(text + off, cs->c[j].s, cs->c[j].len);
+                off += cs->c[j].len;
+            }
+            text[total] = '\0';
+            memset(hl, HL_NORMAL, total);
+
+            struct hlState scan = st;
+            mark.at = len;
+            editorHighlight(E.buf->syntax, text, hl, total, &scan, &mark, 1);
+        }
+
+        if (k + 1 < cs->n) {
+            struct hlMark *old = &cs->c[k + 1].mark;
+            int same = old->skip == mark.skip &&
+                old->st.in_comment == mark.st.in_comment &&
+                old->st.in_string == mark.st.in_string &&
+                old->st.prev_sep == mark.st.prev_sep &&
+                old->st.in_line_comment == mark.st.in_line_comment;
+            *old = mark;
+            if (same) {
+                free(text);
+                free(hl);
+                return 0;
+            }
+        }
+        st = mark.st;
+        skip = mark.skip;
+        skip_hl = mark.skip_hl;
     }
-    int current = last_match;
-    for (int i = 0; i < E.numrows; ++i){
-        current += direction;
-        if (current == -1) {
-            current = E.numrows - 1;
-        } else if (current == E.numrows) {
-            current = 0;
+    free(text);
+    free(hl);
+
+    int changed = (row->hl_open_comment != st.in_comment);
+    row->hl_open_comment = st.in_comment;
+    return changed;
+}
+
+// Rescans from chunk k and carries a changed comment state to later rows.
+void editorChunkUpdateSyntax(erow *row, int k) {
+    if (editorChunkRescan(row, k) && row->idx + 1 < E.buf->numrows) {
+        erow *next = &E.buf->row[row->idx + 1];
+        editorRowThawText(next);
+        editorUpdateSyntax(next);
+    }
+}
+
+// Finds the chunk holding byte cx; *off is cx relative to it. cx == size
+// maps to the end of the last chunk.
+int editorChunkLocate(erow *row, int cx, int *off) {
+    struct rowChunks *cs = row->chunks;
+    int k = 0;
+    while (k < cs->n - 1 && cx >= cs->c[k].len) {
+        cx -= cs->c[k].len;
+        ++k;
+    }
+    *off = cx;
+    return k;
+}
+
+int editorChunkCxToRx(erow *row, int cx) {
+    struct rowChunks *cs = row->chunks;
+    int col = 0;
+    for (int k = 0; k < cs->n; ++k) {
+        struct rowChunk *ch = &cs->c[k];
+        if (cx < ch->len) {
+            return editorTextWidth(ch->s, cx, col);
         }
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if(match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+        col += ch->width[col % CEREAL_TAB_STOP];
+        cx -= ch->len;
+    }
+    return col;
+}
+
+int editorChunkRxToCx(erow *row, int rx) {
+    struct rowChunks *cs = row->chunks;
+    int col = 0, base = 0;
+    for (int k = 0; k < cs->n; ++k) {
+        struct rowChunk *ch = &cs->c[k];
+        int width = ch->width[col % CEREAL_TAB_STOP];
+        if (col + width > rx) {
+            for (int j = 0; j < ch->len;) {
+                int w, len = 1;
+                if (ch->s[j] == '\t') {
+                    w = CEREAL_TAB_STOP - (col % CEREAL_TAB_STOP);
+                } else {
+                    int cp;
+                    len = utf8Decode(&ch->s[j], ch->len - j, &cp);
+                    w = utf8Width(cp);
+                }
+                if (col + w > rx) return base + j;
+                col += w;
+                j += len;
+            }
         }
+        col += width;
+        base += ch->len;
     }
+    return base;
 }
 
-void editorSearch() {
-    int orig_cx = E.cx;
-    int orig_cy = E.cy;
-    int orig_coloff = E.coloff;
-    int orig_rowoff = E.rowoff;
+// Codepoints never straddle chunks, see editorChunkSplitPoint.
+int editorChunkNextCx(erow *row, int cx) {
+    if (cx >= row->size) return row->size;
+    int off;
+    struct rowChunk *ch = &row->chunks->c[editorChunkLocate(row, cx, &off)];
+    int cp;
+    int next = off + utf8Decode(&ch->s[off], ch->len - off, &cp);
+    while (next < ch->len) {
+        int len = utf8Decode(&ch->s[next], ch->len - next, &cp);
+        if (utf8Width(cp) != 0) break;
+        next += len;
+    }
+    return cx + (next - off);
+}
 
-    char *query = editorPrompt("Search: %s (ESC or C-g to Cancel | C-s to Search Forward | C-r to Search Backward)", editorSearchCallback);
+int editorChunkPrevCx(erow *row, int cx) {
+    if (cx <= 0) return 0;
+    int off;
+    struct rowChunk *ch = &row->chunks->c[editorChunkLocate(row, cx - 1, &off)];
+    int base = cx - off - 1;
+    off += 1;
+    while (off > 0) {
+        int start = off - 1;
+        while (start > 0 && start > off - 4 && (ch->s[start] & 0xc0) == 0x80) {
+            --start;
+        }
+        int cp;
+        if (start + utf8Decode(&ch->s[start], ch->len - start, &cp) != off) {
+            start = off - 1;
+            cp = -1;
+        }
+        off = start;
+        if (utf8Width(cp) != 0) break;
+    }
+    return base + off;
+}
 
-    if (query){
-        free(query);
+// Whether an edit of chunk k at off may have moved a token boundary, so
+// that the start states of later chunks must be recomputed.
+int editorChunkNeedsRescan(struct rowChunk *ch, int off, const char *s, int len) {
+    if (E.buf->syntax == NULL) return 0;
+    if (off <= 1 || off >= ch->len - 1) return 1;
+    if (editorIsHlDelimiter(ch->s[off - 1]) || editorIsHlDelimiter(ch->s[off])) {
+        return 1;
+    }
+    for (int j = 0; j < len; ++j) {
+        if (editorIsHlDelimiter(s[j])) return 1;
+    }
+    return 0;
+}
+
+// Inserts s[0..len) at cx. Only the touched chunk is re-measured.
+void editorChunkInsert(erow *row, int cx, const char *s, int len) {
+    struct rowChunks *cs = row->chunks;
+    memFree(MEM_CHARS, cs->text);
+    cs->text = NULL;
+    int off;
+    int k = editorChunkLocate(row, cx, &off);
+    if (off == 0 && k > 0 && (s[0] & 0xc0) == 0x80) {
+        // typed UTF-8 arrives a byte at a time; keep it with its lead byte
+        --k;
+        off = cs->c[k].len;
+    }
+    struct rowChunk *ch = &cs->c[k];
+
+    if (ch->len + len > ch->cap) {
+        ch->cap = ch->len + len + CEREAL_CHUNK_SIZE / 4;
+        ch->s = memRealloc(MEM_CHARS, ch->s, ch->cap);
+    }
+    memmove(&ch->s[off + len], &ch->s[off], ch->len - off);
+    memcpy(&ch->s[off], s, len);
+    ch->len += len;
+    row->size += len;
+
+    int rescan = editorChunkNeedsRescan(ch, off, s, len);
+    if (ch->len > 2 * CEREAL_CHUNK_SIZE) {
+        int last = k;
+        while (cs->c[last].len > 2 * CEREAL_CHUNK_SIZE) {
+            editorChunkSplit(cs, last);
+            ++last;
+        }
+        rescan = 1;
     } else {
-        // cancel search
-        E.cx = orig_cx;
-        E.cy = orig_cy;
-        E.coloff = orig_coloff;
-        E.rowoff = orig_rowoff;
+        editorChunkWidths(ch);
+    }
+    if (rescan) {
+        editorChunkUpdateSyntax(row, k);
     }
 }
 
-/*** append buffer ***/
+// Deletes len bytes at cx, all within one chunk.
+void editorChunkDelete(erow *row, int cx, int len) {
+    struct rowChunks *cs = row->chunks;
+    memFree(MEM_CHARS, cs->text);
+    cs->text = NULL;
+    int off;
+    int k = editorChunkLocate(row, cx, &off);
+    struct rowChunk *ch = &cs->c[k];
+    if (off + len > ch->len) len = ch->len - off;
+
+    char deleted[4];
+    int dlen = len < 4 ? len : 4;
+    memcpy(deleted, &ch->s[off], dlen);
+    memmove(&ch->s[off], &ch->s[off + len], ch->len - off - len);
+    ch->len -= len;
+    row->size -= len;
+
+    int rescan = editorChunkNeedsRescan(ch, off, deleted, dlen);
+    if (ch->len == 0 && cs->n > 1) {
+        memFree(MEM_CHARS, ch->s);
+        memmove(&cs->c[k], &cs->c[k + 1], sizeof(struct rowChunk) * (cs->n - k - 1));
+        --cs->n;
+        if (k > 0) --k;
+        rescan = 1;
+    } else {
+        editorChunkWidths(ch);
+    }
+    if (rescan) {
+        editorChunkUpdateSyntax(row, k);
+    }
+}
 
-struct abuf {
-    char *b;
-    int len;
-};
+// Renders and highlights just the chunks covering the visible columns.
+void editorChunkRender(erow *row) {
+    struct rowChunks *cs = row->chunks;
+    int col = 0;
+    int k = 0;
+    while (k < cs->n - 1 && col + cs->c[k].width[col % CEREAL_TAB_STOP] <= E.buf->coloff) {
+        col += cs->c[k].width[col % CEREAL_TAB_STOP];
+        ++k;
+    }
+    cs->render_col = col;
+
+    int first = k;
+    int len = 0;
+    int end = col;
+    while (k < cs->n && (k == first || end < E.buf->coloff + editorTextCols())) {
+        len += cs->c[k].len;
+        end += cs->c[k].width[end % CEREAL_TAB_STOP];
+        ++k;
+    }
 
-#define ABUF_INIT                               \
-    { NULL, 0 }
+    // tabs expand to at most CEREAL_TAB_STOP spaces
+    memFree(MEM_RENDER, row->render);
+    row->render = memAlloc(MEM_RENDER, len * CEREAL_TAB_STOP + 1);
+    struct hlMark *mk = &cs->c[first].mark;
+    int idx = 0;
+    int skip = -1; // render offset of the first mk->skip bytes
+    int base = 0;
+    for (int j = first; j < k; base += cs->c[j].len, ++j) {
+        struct rowChunk *ch = &cs->c[j];
+        for (int i = 0; i < ch->len;) {
+            if (skip < 0 && base + i >= mk->skip) skip = idx;
+            if (ch->s[i] == '\t') {
+                do {
+                    row->render[idx++] = ' ';
+                } while (++col % CEREAL_TAB_STOP != 0);
+                ++i;
+            } else {
+                int cp;
+                int n = utf8Decode(&ch->s[i], ch->len - i, &cp);
+                memcpy(&row->render[idx], &ch->s[i], n);
+                idx += n;
+                i += n;
+                col += utf8Width(cp);
+            }
+        }
+    }
+    if (skip < 0) skip = idx;
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    row->ascii = utf8IsAscii(row->render, row->rsize);
 
-// append buffer ab
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+    row->hl = memRealloc(MEM_HL, row->hl, row->rsize ? row->rsize : 1);
+    memset(row->hl, HL_NORMAL, row->rsize);
+    if (E.buf->syntax == NULL) return;
 
-    if (new == NULL) {
+    struct hlState st = mk->st;
+    if (st.in_line_comment) {
+        memset(row->hl, HL_COMMENT, row->rsize);
         return;
     }
+    // a string or comment running on from the chunk before may hold tabs
+    memset(row->hl, mk->skip_hl, skip);
+    editorHighlight(E.buf->syntax, row->render + skip, row->hl + skip,
+                    row->rsize - skip, &st, NULL, 0);
+}
 
-    // copy from s to new
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+/*** brackets ***/
+
+// Brackets outside strings and comments are indexed for matching and for
+// moving by block. Every row sums up its own in erow.brk, refreshed as it
+// is highlighted and kept while it is cold, and a segment tree over the
+// rows of the buffer combines them. The depth at any row, and the next or
+// previous row at which it drops to a given level, are then found in
+// O(log n) without reading the rows in between. Inserting or deleting rows
+// only marks the leaves from there on stale, to be refreshed from the rows
+// at the next lookup. Long rows are left out, as in the search overlay.
+
+// 1 for an opening bracket, -1 for a closing one, 0 for anything else or
+// a bracket inside a string or comment.
+int editorBracketDir(char c, unsigned char hl) {
+    if (hl == HL_COMMENT || hl == HL_MLCOMMENT || hl == HL_STRING) return 0;
+    if (c == '(' || c == '[' || c == '{') return 1;
+    if (c == ')' || c == ']' || c == '}') return -1;
+    return 0;
+}
+
+void bracketJoin(struct bracketSum *s, const struct bracketSum *a,
+                 const struct bracketSum *b) {
+    int lo = a->net + b->lo;
+    int lo_after = a->net + b->lo_after;
+    s->net = a->net + b->net;
+    s->lo = a->lo < lo ? a->lo : lo;
+    s->lo_after = a->lo_after < lo_after ? a->lo_after : lo_after;
+}
+
+// Recomputes the leaf of row at and the nodes above it.
+void editorBracketUpdate(int at) {
+    struct editorBuffer *b = E.buf;
+    if (at >= b->brk_valid) return; // refreshed at the next lookup anyway
+
+    int i = b->brk_cap + at;
+    b->brk[i] = b->row[at].brk;
+    for (i /= 2; i >= 1; i /= 2) {
+        bracketJoin(&b->brk[i], &b->brk[2 * i], &b->brk[2 * i + 1]);
+    }
+}
+
+// Sums up the brackets of a freshly highlighted row.
+void editorBracketRow(erow *row) {
+    struct bracketSum s = { 0, BRACKET_NONE, BRACKET_NONE };
+    for (int j = 0; !row->chunks && j < row->rsize; ++j) {
+        int dir = editorBracketDir(row->render[j], row->hl[j]);
+        if (!dir) continue;
+        if (s.net < s.lo) s.lo = s.net;
+        s.net += dir;
+        if (s.net < s.lo_after) s.lo_after = s.net;
+    }
+    if (s.net != row->brk.net || s.lo != row->brk.lo ||
+        s.lo_after != row->brk.lo_after) {
+        row->brk = s;
+        editorBracketUpdate(row->idx);
+    }
+}
+
+// Brings the tree up to date with the rows of the buffer.
+void editorBracketIndex() {
+    editorUpdateStaleRows();
+    struct editorBuffer *b = E.buf;
+    struct bracketSum none = { 0, BRACKET_NONE, BRACKET_NONE };
+    if (b->numrows > b->brk_cap) {
+        int cap = b->brk_cap ? b->brk_cap : 64;
+        while (cap < b->numrows) cap *= 2;
+        b->brk = realloc(b->brk, sizeof(b->brk[0]) * 2 * cap);
+        for (int i = 0; i < 2 * cap; ++i) {
+            b->brk[i] = none;
+        }
+        b->brk_cap = cap;
+        b->brk_rows = b->brk_valid = 0;
+    }
+
+    int lo = b->brk_valid < b->numrows ? b->brk_valid : b->numrows;
+    int hi = b->brk_rows > b->numrows ? b->brk_rows : b->numrows;
+    if (lo < hi) {
+        for (int j = lo; j < hi; ++j) {
+            b->brk[b->brk_cap + j] = j < b->numrows ? b->row[j].brk : none;
+        }
+        lo = (b->brk_cap + lo) / 2;
+        hi = (b->brk_cap + hi - 1) / 2;
+        for (; lo >= 1; lo /= 2, hi /= 2) {
+            for (int i = lo; i <= hi; ++i) {
+                bracketJoin(&b->brk[i], &b->brk[2 * i], &b->brk[2 * i + 1]);
+            }
+        }
+    }
+    b->brk_rows = b->brk_valid = b->numrows;
+}
+
+// The nesting depth at the start of row at.
+int editorBracketDepth(int at) {
+    int depth = 0;
+    for (int i = E.buf->brk_cap + at; i > 1; i /= 2) {
+        if (i & 1) depth += E.buf->brk[i - 1].net;
+    }
+    return depth;
+}
+
+// The first row from `from` on (or with back, the last one up to `from`)
+// with a bracket at which the depth, just after it with after or just
+// before it otherwise, is t or less. Node i spans width rows from nlo and
+// the depth at its start is depth. Returns -1 if there is none.
+int bracketSearch(int i, int nlo, int width, int depth, int from, int back,
+                  int after, int t) {
+    struct bracketSum *s = &E.buf->brk[i];
+    int inside = back ? nlo + width - 1 <= from : nlo >= from;
+    if (back ? nlo > from : nlo + width <= from) return -1;
+    if (inside && depth + (after ? s->lo_after : s->lo) > t) return -1;
+    if (width == 1) return nlo;
+
+    int half = width / 2;
+    int mid = depth + E.buf->brk[2 * i].net;
+    int found;
+    if (back) {
+        found = bracketSearch(2 * i + 1, nlo + half, half, mid, from, back, after, t);
+        if (found == -1) {
+            found = bracketSearch(2 * i, nlo, half, depth, from, back, after, t);
+        }
+    } else {
+        found = bracketSearch(2 * i, nlo, half, depth, from, back, after, t);
+        if (found == -1) {
+            found = bracketSearch(2 * i + 1, nlo + half, half, mid, from, back, after, t);
+        }
+    }
+    return found;
+}
+
+// Lists the brackets of row that count, as offsets into chars; the caller
+// frees *out.
+int editorRowBrackets(erow *row, int **out) {
+    editorRowThaw(row);
+    editorUpdateStaleRows();
+    *out = NULL;
+    if (row->chunks) return 0;
+
+    int n = 0, cap = 0;
+    int rx = 0, rb = 0;
+    for (int j = 0; j < row->size;) {
+        char c = row->chars[j];
+        if (c == '\t') {
+            int spaces = CEREAL_TAB_STOP - (rx % CEREAL_TAB_STOP);
+            rx += spaces;
+            rb += spaces;
+            ++j;
+            continue;
+        }
+        if (editorBracketDir(c, row->hl[rb])) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 16;
+                *out = realloc(*out, sizeof(int) * cap);
+            }
+            (*out)[n++] = j;
+        }
+        int len = 1;
+        if ((unsigned char)c < 0x80) {
+            ++rx;
+        } else {
+            int cp;
+            len = utf8Decode(&row->chars[j], row->size - j, &cp);
+            rx += utf8Width(cp);
+        }
+        rb += len;
+        j += len;
+    }
+    return n;
+}
+
+// Finds the first bracket at or after (y, x), or with back the last one
+// before it, at which the depth, just after it with after or just before
+// it otherwise, is t or less. Returns 0 if there is none.
+int editorBracketFind(int y, int x, int back, int after, int t, int *fy, int *fx) {
+    editorBracketIndex();
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            // on to the nearest other row that has one
+            if (back ? y == 0 : y + 1 >= E.buf->numrows) return 0;
+            y = bracketSearch(1, 0, E.buf->brk_cap, 0, back ? y - 1 : y + 1,
+                              back, after, t);
+            if (y == -1) return 0;
+            x = back ? INT_MAX : 0;
+        }
+        if (y >= E.buf->numrows) continue;
+
+        erow *row = &E.buf->row[y];
+        int *cxs;
+        int n = editorRowBrackets(row, &cxs);
+        int depth = editorBracketDepth(y);
+        int found = -1;
+        for (int k = 0; k < n && (!back || cxs[k] < x); ++k) {
+            int next = depth + (row->chars[cxs[k]] == '(' ||
+                                row->chars[cxs[k]] == '[' ||
+                                row->chars[cxs[k]] == '{' ? 1 : -1);
+            if ((back || cxs[k] >= x) && (after ? next : depth) <= t) {
+                found = cxs[k];
+                if (!back) break;
+            }
+            depth = next;
+        }
+        free(cxs);
+        if (found != -1) {
+            *fy = y;
+            *fx = found;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The depth just before (y, x).
+int editorBracketDepthAt(int y, int x) {
+    editorBracketIndex();
+    if (y >= E.buf->numrows) return E.buf->brk_cap ? E.buf->brk[1].net : 0;
+    int *cxs;
+    int n = editorRowBrackets(&E.buf->row[y], &cxs);
+    int depth = editorBracketDepth(y);
+    for (int k = 0; k < n && cxs[k] < x; ++k) {
+        depth += editorBracketDir(E.buf->row[y].chars[cxs[k]], HL_NORMAL);
+    }
+    free(cxs);
+    return depth;
+}
+
+// Whether the character at (y, x) is a bracket that counts, and which way.
+int editorBracketDirAt(int y, int x) {
+    if (y >= E.buf->numrows) return 0;
+    erow *row = &E.buf->row[y];
+    editorRowThaw(row);
+    editorUpdateStaleRows();
+    if (row->chunks || x >= row->size) return 0;
+    return editorBracketDir(row->chars[x], row->hl[editorRowCxToRb(row, x)]);
+}
+
+void editorBracketGoto(int y, int x) {
+    E.buf->cy = y;
+    E.buf->cx = x;
+}
+
+// Jumps from the bracket under the cursor, or else the one just before
+// it, to its match.
+void editorMatchBracket() {
+    int y = E.buf->cy, x = E.buf->cx;
+    int dir = editorBracketDirAt(y, x);
+    if (!dir && x > 0) {
+        x = editorRowPrevCx(&E.buf->row[y], x);
+        dir = editorBracketDirAt(y, x);
+    }
+    if (!dir) {
+        editorSetStatusMessage("No bracket here");
+        return;
+    }
+
+    int depth = editorBracketDepthAt(y, x);
+    int fy, fx;
+    int found = dir > 0 ? editorBracketFind(y, x + 1, 0, 1, depth, &fy, &fx)
+                        : editorBracketFind(y, x, 1, 0, depth - 1, &fy, &fx);
+    if (!found) {
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    const char *pairs = "()[]{}";
+    char c = E.buf->row[y].chars[x];
+    char m = E.buf->row[fy].chars[fx];
+    if ((strchr(pairs, c) - pairs) / 2 != (strchr(pairs, m) - pairs) / 2) {
+        editorSetStatusMessage("Mismatched bracket");
+    }
+    editorBracketGoto(fy, fx);
+}
+
+// Moves to the opening bracket of the block around the cursor.
+void editorBracketUp() {
+    int depth = editorBracketDepthAt(E.buf->cy, E.buf->cx);
+    int fy, fx;
+    if (!editorBracketFind(E.buf->cy, E.buf->cx, 1, 0, depth - 1, &fy, &fx)) {
+        editorSetStatusMessage("At top level");
+        return;
+    }
+    editorBracketGoto(fy, fx);
+}
+
+// Moves to the start of the next block at the cursor's level, skipping
+// the one it is on.
+void editorBracketNext() {
+    int y = E.buf->cy, x = E.buf->cx;
+    int depth = editorBracketDepthAt(y, x);
+    int fy, fx;
+    if (!editorBracketFind(y, x + 1, 0, 0, depth, &fy, &fx) ||
+        editorBracketDirAt(fy, fx) < 0) {
+        editorSetStatusMessage("No next block");
+        return;
+    }
+    editorBracketGoto(fy, fx);
+}
+
+// Moves to the start of the previous block at the cursor's level.
+void editorBracketPrev() {
+    int y = E.buf->cy, x = E.buf->cx;
+    int depth = editorBracketDepthAt(y, x);
+    int fy, fx;
+    if (!editorBracketFind(y, x, 1, 1, depth, &fy, &fx) ||
+        editorBracketDirAt(fy, fx) > 0 ||
+        !editorBracketFind(fy, fx, 1, 0, depth, &fy, &fx)) {
+        editorSetStatusMessage("No previous block");
+        return;
+    }
+    editorBracketGoto(fy, fx);
+}
+
+// Moves to the top-level '{' opening the function around the cursor, or
+// else the one before it.
+void editorBeginningOfDefun() {
+    int y = E.buf->cy, x = E.buf->cx;
+    while (editorBracketFind(y, x, 1, 0, 0, &y, &x)) {
+        if (E.buf->row[y].chars[x] == '{') {
+            editorBracketGoto(y, x);
+            return;
+        }
+    }
+    editorSetStatusMessage("No function before this");
+}
+
+// Moves to the top-level '}' closing the function around the cursor, or
+// else the next one.
+void editorEndOfDefun() {
+    int y = E.buf->cy, x = E.buf->cx + 1;
+    while (editorBracketFind(y, x, 0, 1, 0, &y, &x)) {
+        if (E.buf->row[y].chars[x] == '}') {
+            editorBracketGoto(y, x);
+            return;
+        }
+        ++x;
+    }
+    editorSetStatusMessage("No function after this");
+}
+
+/*** folding ***/
+
+// C-x z folds the brace block opened on the cursor's row, or else the run
+// of comment rows it starts, or else the rows indented deeper below it;
+// on a row heading a fold it unfolds it. Folded rows are never drawn, so
+// they are never thawed, rendered or highlighted for display. Screen lines
+// map to rows through struct foldIndex: its two Fenwick trees find the
+// row on a line, the line of a row, and the fold an edit lands in, all in
+// O(log n) folds, so edits move no folds but the one they touch.
+
+void fenwickAdd(int *t, int n, int i, int v) {
+    for (++i; i <= n; i += i & -i) {
+        t[i] += v;
+    }
+}
+
+// Sum of the first i entries.
+int fenwickSum(const int *t, int i) {
+    int sum = 0;
+    for (; i > 0; i -= i & -i) {
+        sum += t[i];
+    }
+    return sum;
+}
+
+// The largest i whose first i entries sum to k or less; entries are >= 0.
+int fenwickSearch(const int *t, int n, int k) {
+    int i = 0;
+    int step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step; step /= 2) {
+        if (i + step <= n && t[i + step] <= k) {
+            i += step;
+            k -= t[i];
+        }
+    }
+    return i;
+}
+
+void fenwickBuild(int *t, const int *a, const int *b, int n) {
+    for (int i = 1; i <= n; ++i) {
+        t[i] = a[i - 1] + (b ? b[i - 1] : 0);
+    }
+    for (int i = 1; i <= n; ++i) {
+        int j = i + (i & -i);
+        if (j <= n) t[j] += t[i];
+    }
+}
+
+void foldRebuild(struct foldIndex *f) {
+    fenwickBuild(f->fgap, f->gap, NULL, f->n);
+    fenwickBuild(f->fall, f->gap, f->len, f->n);
+}
+
+// Rows [*lo, *hi) that fold i hides.
+void foldBounds(struct foldIndex *f, int i, int *lo, int *hi) {
+    *lo = fenwickSum(f->fall, i) + f->gap[i];
+    *hi = *lo + f->len[i];
+}
+
+// The fold hiding row r, or -1.
+int editorFoldAt(int r) {
+    struct foldIndex *f = &E.buf->folds;
+    int i = fenwickSearch(f->fall, f->n, r); // folds ending at or before r
+    if (i == f->n) return -1;
+    int lo, hi;
+    foldBounds(f, i, &lo, &hi);
+    return r >= lo ? i : -1;
+}
+
+// The line of row r counting only rows not folded; a folded row counts as
+// the row after its fold.
+int editorVisibleIndex(int r) {
+    struct foldIndex *f = &E.buf->folds;
+    if (f->n == 0) return r;
+    int i = fenwickSearch(f->fall, f->n, r);
+    int all = fenwickSum(f->fall, i);
+    int gaps = fenwickSum(f->fgap, i);
+    if (i < f->n && r >= all + f->gap[i]) {
+        // folded: from the end of its fold on
+        return gaps + f->gap[i];
+    }
+    return r - (all - gaps);
+}
+
+// The row on line k counting only rows not folded, numrows or more past
+// the last.
+int editorVisibleRow(int k) {
+    struct foldIndex *f = &E.buf->folds;
+    if (f->n == 0) return k;
+    int i = fenwickSearch(f->fgap, f->n, k); // folds starting before it
+    return k + fenwickSum(f->fall, i) - fenwickSum(f->fgap, i);
+}
+
+// Replaces the folds by the runs [lo[j], hi[j]), ascending and disjoint.
+void editorFoldSet(const int *lo, const int *hi, int n) {
+    struct foldIndex *f = &E.buf->folds;
+    if (n > f->cap) {
+        f->cap = n;
+        f->gap = realloc(f->gap, sizeof(int) * n);
+        f->len = realloc(f->len, sizeof(int) * n);
+        f->fgap = realloc(f->fgap, sizeof(int) * (n + 1));
+        f->fall = realloc(f->fall, sizeof(int) * (n + 1));
+    }
+    for (int j = 0; j < n; ++j) {
+        f->gap[j] = lo[j] - (j ? hi[j - 1] : 0);
+        f->len[j] = hi[j] - lo[j];
+    }
+    f->n = n;
+    foldRebuild(f);
+    E.frame_valid = 0;
+}
+
+// The folds as runs, minus any meeting [drop_lo, drop_hi), and with
+// [add_lo, add_hi) merged in when that isn't empty. O(folds).
+void editorFoldEdit(int drop_lo, int drop_hi, int add_lo, int add_hi) {
+    struct foldIndex *f = &E.buf->folds;
+    int *lo = malloc(sizeof(int) * (f->n + 1));
+    int *hi = malloc(sizeof(int) * (f->n + 1));
+    int n = 0, pos = 0, added = add_lo >= add_hi;
+    for (int j = 0; j < f->n; ++j) {
+        int a = pos + f->gap[j], b = a + f->len[j];
+        pos = b;
+        if (a < drop_hi && b > drop_lo) continue;
+        if (!added && a < add_hi && b > add_lo) {
+            // overlaps the new fold: merge the two
+            if (a < add_lo) add_lo = a;
+            if (b > add_hi) add_hi = b;
+            continue;
+        }
+        if (!added && a >= add_hi) {
+            lo[n] = add_lo;
+            hi[n++] = add_hi;
+            added = 1;
+        }
+        lo[n] = a;
+        hi[n++] = b;
+    }
+    if (!added) {
+        lo[n] = add_lo;
+        hi[n++] = add_hi;
+    }
+    editorFoldSet(lo, hi, n);
+    free(lo);
+    free(hi);
+}
+
+// Rows were inserted at at (d > 0): the fold or gap they landed in grows.
+void editorFoldShift(int at, int d) {
+    struct foldIndex *f = &E.buf->folds;
+    int i = fenwickSearch(f->fall, f->n, at);
+    if (i == f->n) return;
+    int lo = fenwickSum(f->fall, i) + f->gap[i];
+    if (at <= lo) {
+        f->gap[i] += d;
+        fenwickAdd(f->fgap, f->n, i, d);
+    } else {
+        f->len[i] += d;
+    }
+    fenwickAdd(f->fall, f->n, i, d);
+}
+
+// Rows [at, at + n) were deleted: the folds and gaps they came from shrink,
+// and folds left with nothing to hide go.
+void editorFoldDelete(int at, int n) {
+    struct foldIndex *f = &E.buf->folds;
+    int end = at + n;
+    int i = fenwickSearch(f->fall, f->n, at);
+    int pos = fenwickSum(f->fall, i); // where the gap of fold i starts
+    int emptied = 0;
+    for (; i < f->n && pos < end; ++i) {
+        int a = pos + f->gap[i], b = a + f->len[i];
+        int in_gap = (end < a ? end : a) - (at > pos ? at : pos);
+        int in_fold = (end < b ? end : b) - (at > a ? at : a);
+        if (in_gap > 0) {
+            f->gap[i] -= in_gap;
+            fenwickAdd(f->fgap, f->n, i, -in_gap);
+            fenwickAdd(f->fall, f->n, i, -in_gap);
+        }
+        if (in_fold > 0) {
+            f->len[i] -= in_fold;
+            fenwickAdd(f->fall, f->n, i, -in_fold);
+            if (f->len[i] == 0) emptied = 1;
+        }
+        pos = b;
+    }
+    if (emptied) {
+        // drop them, handing their gaps on to the folds after them
+        int w = 0, carry = 0;
+        for (int j = 0; j < f->n; ++j) {
+            if (f->len[j] == 0) {
+                carry += f->gap[j];
+                continue;
+            }
+            f->gap[w] = f->gap[j] + carry;
+            f->len[w++] = f->len[j];
+            carry = 0;
+        }
+        f->n = w;
+        foldRebuild(f);
+    }
+}
+
+// Unfolds whatever meets rows [lo, hi), as before rows there are reordered.
+void editorFoldRelease(int lo, int hi) {
+    struct foldIndex *f = &E.buf->folds;
+    if (f->n == 0) return;
+    int i = fenwickSearch(f->fall, f->n, lo);
+    int a, b;
+    if (i == f->n) return;
+    foldBounds(f, i, &a, &b);
+    if (a >= hi) return;
+    editorFoldEdit(lo, hi, 0, 0);
+}
+
+void editorFoldClear(struct editorBuffer *b) {
+    free(b->folds.gap);
+    free(b->folds.len);
+    free(b->folds.fgap);
+    free(b->folds.fall);
+    memset(&b->folds, 0, sizeof(b->folds));
+}
+
+// Display width of the indentation of a row, or -1 for a blank one.
+int editorRowIndent(erow *row) {
+    const char *text = editorRowText(row);
+    int col = 0;
+    for (int j = 0; j < row->size; ++j) {
+        if (text[j] == '\t') {
+            col += CEREAL_TAB_STOP - (col % CEREAL_TAB_STOP);
+        } else if (text[j] == ' ') {
+            ++col;
+        } else {
+            return col;
+        }
+    }
+    return -1;
+}
+
+// Whether row y is blank but for a comment.
+int editorRowIsComment(int y) {
+    erow *row = &E.buf->row[y];
+    editorRowThaw(row);
+    editorUpdateStaleRows();
+    if (row->chunks) return 0;
+    int j = 0;
+    while (j < row->size && (row->chars[j] == ' ' || row->chars[j] == '\t')) ++j;
+    if (j == row->size) return 0;
+    unsigned char hl = row->hl[editorRowCxToRb(row, j)];
+    return hl == HL_COMMENT || hl == HL_MLCOMMENT;
+}
+
+// The end of the fold headed by row y: past the row closing the last block
+// y leaves open, past the comment rows after a comment row, or past the
+// rows below it indented deeper. Returns y + 1 for nothing to fold.
+int editorFoldEnd(int y) {
+    int *cxs;
+    int n = editorRowBrackets(&E.buf->row[y], &cxs);
+    int depth = 0, low = 0, open = -1;
+    for (int k = 0; k < n; ++k) {
+        depth += editorBracketDir(E.buf->row[y].chars[cxs[k]], HL_NORMAL);
+        if (depth <= low) {
+            low = depth;
+            open = -1;
+        } else if (open < 0) {
+            open = cxs[k];
+        }
+    }
+    free(cxs);
+    if (open >= 0) {
+        int t = editorBracketDepthAt(y, open);
+        int fy, fx;
+        if (editorBracketFind(y, open + 1, 0, 1, t, &fy, &fx)) return fy;
+        return E.buf->numrows;
+    }
+
+    int end = y + 1;
+    if (editorRowIsComment(y)) {
+        while (end < E.buf->numrows && editorRowIsComment(end)) ++end;
+        return end;
+    }
+    int indent = editorRowIndent(&E.buf->row[y]);
+    if (indent < 0) return end;
+    for (int j = y + 1; j < E.buf->numrows; ++j) {
+        int in = editorRowIndent(&E.buf->row[j]);
+        if (in >= 0 && in <= indent) break;
+        if (in >= 0) end = j + 1; // blank rows only count inside the run
+    }
+    return end;
+}
+
+// C-x z: unfolds the fold the cursor's row heads, or else folds what it
+// heads, see editorFoldEnd.
+void editorToggleFold() {
+    int y = E.buf->cy;
+    if (y >= E.buf->numrows || E.buf->occur) return;
+    int i = editorFoldAt(y + 1);
+    int lo, hi;
+    if (i >= 0 && (foldBounds(&E.buf->folds, i, &lo, &hi), lo == y + 1)) {
+        editorFoldEdit(lo, hi, 0, 0);
+        editorSetStatusMessage("Unfolded %d lines", hi - lo);
+        return;
+    }
+    int end = editorFoldEnd(y);
+    if (end <= y + 1) {
+        editorSetStatusMessage("Nothing to fold");
+        return;
+    }
+    editorFoldEdit(0, 0, y + 1, end);
+    editorSetStatusMessage("Folded %d lines", end - y - 1);
+}
+
+// Folds every top-level brace block of more than one row.
+void editorFoldAll() {
+    int n = 0, cap = 0;
+    int *lo = NULL, *hi = NULL;
+    int y = 0, x = 0, fy, fx;
+    // each opening bracket at depth 0, then the one closing it
+    while (editorBracketFind(y, x, 0, 0, 0, &fy, &fx)) {
+        y = fy;
+        x = fx + 1;
+        if (editorBracketDirAt(fy, fx) < 0) continue;
+        if (!editorBracketFind(fy, fx + 1, 0, 1, 0, &y, &x)) break;
+        if (y > fy + 1) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                lo = realloc(lo, sizeof(int) * cap);
+                hi = realloc(hi, sizeof(int) * cap);
+            }
+            lo[n] = fy + 1;
+            hi[n++] = y;
+        }
+        ++x;
+    }
+    editorFoldSet(lo, hi, n);
+    free(lo);
+    free(hi);
+    editorSetStatusMessage("%d folds", n);
+}
+
+void editorUnfoldAll() {
+    editorFoldSet(NULL, NULL, 0);
+    editorSetStatusMessage("Unfolded everything");
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    if (E.buf->cy == E.buf->numrows) {
+        editorInsertRow(E.buf->numrows, "", 0);
+    }
+    editorRowInsertChar(&E.buf->row[E.buf->cy], E.buf->cx, c);
+    ++E.buf->cx;
+}
+
+void editorDelChar(){
+    if(E.buf->cy == E.buf->numrows) return;
+    if(E.buf->cx == 0 && E.buf->cy == 0) return;
+
+    erow *row = &E.buf->row[E.buf->cy];
+    if(E.buf->cx > 0){
+        editorRowThaw(row);
+        int prev = editorRowPrevCx(row, E.buf->cx);
+        editorRowDelChars(row, prev, E.buf->cx - prev);
+        E.buf->cx = prev;
+    } else {
+        // joined in one go, so a comment the row above opens doesn't
+        // cascade through the row on its way out
+        editorJoinRows(&E.buf->cy, 1, &E.buf->cx);
+        --E.buf->cy;
+    }
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(int *buflen) {
+    int totlen = 0;
+    int j;
+    for (j = 0; j < E.buf->numrows; ++j) {
+        totlen += E.buf->row[j].size + 1;
+    }
+    *buflen = totlen;
+
+    char *buf = malloc(totlen);
+    char *p = buf;
+    for (j = 0; j < E.buf->numrows; ++j) {
+        struct rowChunks *cs = E.buf->row[j].chunks;
+        if (cs) {
+            for (int k = 0; k < cs->n; ++k) {
+                memcpy(p, cs->c[k].s, cs->c[k].len);
+                p += cs->c[k].len;
+            }
+        } else {
+            memcpy(p, editorRowText(&E.buf->row[j]), E.buf->row[j].size);
+            p += E.buf->row[j].size;
+        }
+        *p = '\n';
+        ++p;
+    }
+
+    return buf;
+}
+
+// Remembers the size and mtime of the file just read or written, to tell
+// later whether it changed on disk.
+void editorNoteFileStat(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        E.buf->file_mtime = st.st_mtim;
+        E.buf->file_size = st.st_size;
+    }
+}
+
+void editorOpen(char *filename) {
+    free(E.buf->filename);
+    E.buf->filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        die("fopen");
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && st.st_size > 0 &&
+        editorIsBinary(fileno(fp)) && editorHexOpen(fileno(fp), &st)) {
+        editorNoteFileStat(fileno(fp));
+        fclose(fp);
+        E.buf->dirty = 0;
+        return;
+    }
+    if (fstat(fileno(fp), &st) == 0 && editorOpenIndexed(filename, fileno(fp), &st)) {
+        editorNoteFileStat(fileno(fp));
+        fclose(fp);
+        E.buf->dirty = 0;
+        return;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    uint64_t *offsets = NULL; // of each row in the file, for the index
+    int offcap = 0;
+    editorDiffReset(0);
+    E.buf->follow_off = 0;
+    E.buf->follow_partial = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (E.buf->numrows == offcap) {
+            offcap = offcap ? offcap * 2 : 1024;
+            offsets = realloc(offsets, sizeof(offsets[0]) * offcap);
+        }
+        offsets[E.buf->numrows] = E.buf->follow_off;
+        E.buf->follow_off += linelen;
+        E.buf->follow_partial = (line[linelen - 1] != '\n');
+        while (linelen > 0 &&
+               (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+            --linelen;
+        }
+        editorInsertRow(E.buf->numrows, line, linelen);
+        editorDiffSetBase(&E.buf->row[E.buf->numrows - 1]);
+        editorFreezeColdRows();
+    }
+    free(line);
+    editorNoteFileStat(fileno(fp));
+    fclose(fp);
+    E.buf->dirty = 0;
+
+    // a file still growing as it was read gets no index
+    if (E.buf->follow_off >= CEREAL_INDEX_MIN_SIZE &&
+        E.buf->follow_off == E.buf->file_size) {
+        editorWriteIndex(offsets);
+    }
+    free(offsets);
+}
+
+// Empties the buffer and forgets its file, ready for editorOpen.
+void editorCloseFile() {
+    editorFollowStop();
+    editorMapClose();
+    for (int j = 0; j < E.buf->numrows; ++j) {
+        editorFreeRow(&E.buf->row[j]);
+    }
+    E.buf->numrows = 0;
+    free(E.buf->filename);
+    E.buf->filename = NULL;
+    E.buf->cx = E.buf->cy = E.buf->rx = 0;
+    E.buf->rowoff = E.buf->coloff = 0;
+    E.buf->mark_active = 0;
+    E.buf->dirty = 0;
+    E.buf->warm_lo = E.buf->warm_hi = 0;
+    E.buf->warm_count = 0;
+    E.buf->ws_lo = E.buf->ws_hi = 0;
+    editorOutlineReset();
+    editorOccurClose(E.buf);
+    editorFoldClear(E.buf);
+    editorDiffReset(0);
+    editorCursorsClear(E.buf);
+    editorHexClose();
+}
+
+void editorSave() {
+    if (E.buf->hex) {
+        editorHexSave();
+        return;
+    }
+    // new file
+    if(E.buf->filename == NULL) {
+        E.buf->filename = editorPrompt("Save as : %s (ESC or C-g to cancel)", NULL, 0);
+        if (E.buf->filename == NULL){
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    int len;
+    char *buf = editorRowsToString(&len);
+    editorUnmapRows(INT_MAX); // the file is about to change under the mapping
+    // create a new file if it doesn't already exist (O_CREAT),
+    //  then open it for reading and writing (O_RDWR)
+    // 0644 is the standard permission for text files needed due to O_CREAT flag
+    int fd = open(E.buf->filename, O_RDWR | O_CREAT, 0644);
+    if(fd != -1){
+        if(ftruncate(fd, len) != -1){ // sets the file size to len
+            if (write(fd, buf, len) == len) {
+                editorNoteFileStat(fd);
+                close(fd);
+                editorDiffRebase(buf);
+                free(buf);
+                E.buf->dirty = 0;
+                if (len >= CEREAL_INDEX_MIN_SIZE) {
+                    editorWriteIndex(NULL);
+                }
+                editorSetStatusMessage("%d bytes written to disk", len);
+                return;
+            }
+        }
+        close(fd);
+    }
+    free(buf);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** index cache ***/
+
+// Reopening a big file needn't read it. After a file of at least
+// CEREAL_INDEX_MIN_SIZE is loaded or saved, an index goes to
+// $XDG_CACHE_HOME/cereal (~/.cache/cereal by default), named after a hash
+// of the file's path: where each row starts, its length, its brackets,
+// whether it ends inside a multi-line comment, and the syntax in use. While the file's
+// size, mtime and inode still match, editorOpen maps the file and starts
+// every row cold, pointing into the mapping. Rows are then read and
+// highlighted only as they are shown.
+
+#define CEREAL_INDEX_MAGIC "CEREALIX"
+#define CEREAL_INDEX_VERSION 2
+
+struct indexHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t syntax; // into HLDB, -1 for none
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t numrows;
+    uint32_t partial; // the last row has no newline
+    uint32_t pad;
+    // then uint64_t offsets[numrows], uint32_t lengths[numrows],
+    // struct bracketSum brackets[numrows] and one hl_open_comment bit per row
+};
+
+#define INDEX_BYTES(n) (sizeof(struct indexHeader) + \
+                        (n) * (12 + sizeof(struct bracketSum)) + ((n) + 7) / 8)
+
+// Gets the index file for filename; with create, makes its directory.
+int editorIndexPath(const char *filename, char *path, size_t size, int create) {
+    char real[PATH_MAX];
+    if (!realpath(filename, real)) return -1;
+
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+    if (cache && *cache) {
+        len = snprintf(path, size, "%s", cache);
+    } else if (home && *home) {
+        len = snprintf(path, size, "%s/.cache", home);
+    } else {
+        return -1;
+    }
+    if (create && len < (int)size) {
+        mkdir(path, 0700);
+    }
+    len += snprintf(path + len, size - len, "/cereal");
+    if (len >= (int)size) return -1;
+    if (create && mkdir(path, 0700) == -1 && errno != EEXIST) return -1;
+
+    len += snprintf(path + len, size - len, "/%016llx.idx",
+                    (unsigned long long)editorHashLine(real, strlen(real)));
+    return len < (int)size ? 0 : -1;
+}
+
+// Loads the rows of the file open at fd from its index, if it has a valid
+// one. Returns 0, leaving the buffer alone, if not.
+int editorOpenIndexed(const char *filename, int fd, struct stat *st) {
+    char path[PATH_MAX];
+    if (st->st_size == 0 || st->st_size > INT_MAX ||
+        editorIndexPath(filename, path, sizeof(path), 0) == -1) {
+        return 0;
+    }
+    int ifd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ifd == -1) return 0;
+    struct stat ist;
+    char *idx = MAP_FAILED;
+    if (fstat(ifd, &ist) == 0 && ist.st_size >= (off_t)sizeof(struct indexHeader)) {
+        idx = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, ifd, 0);
+    }
+    close(ifd);
+    if (idx == MAP_FAILED) return 0;
+
+    struct indexHeader *h = (struct indexHeader *)idx;
+    uint64_t n = h->numrows;
+    if (memcmp(h->magic, CEREAL_INDEX_MAGIC, 8) ||
+        h->version != CEREAL_INDEX_VERSION ||
+        h->syntax < -1 || h->syntax >= (int32_t)HLDB_ENTRIES ||
+        h->size != (uint64_t)st->st_size || h->ino != (uint64_t)st->st_ino ||
+        h->dev != (uint64_t)st->st_dev ||
+        h->mtime_sec != st->st_mtim.tv_sec ||
+        h->mtime_nsec != st->st_mtim.tv_nsec ||
+        n == 0 || n > (uint64_t)st->st_size ||
+        (uint64_t)ist.st_size != INDEX_BYTES(n)) {
+        munmap(idx, ist.st_size);
+        return 0;
+    }
+    const uint64_t *offsets = (const uint64_t *)(idx + sizeof(*h));
+    const uint32_t *lengths = (const uint32_t *)(offsets + n);
+    const struct bracketSum *brackets = (const struct bracketSum *)(lengths + n);
+    const unsigned char *open_comment = (const unsigned char *)(brackets + n);
+    for (uint64_t j = 0; j < n; ++j) {
+        if (offsets[j] + lengths[j] > h->size) {
+            munmap(idx, ist.st_size);
+            return 0;
+        }
+    }
+
+    char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int map_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (map == MAP_FAILED || map_fd == -1) {
+        if (map != MAP_FAILED) munmap(map, st->st_size);
+        if (map_fd != -1) close(map_fd);
+        munmap(idx, ist.st_size);
+        return 0;
+    }
+    struct rowBlock *blk = calloc(1, sizeof(struct rowBlock));
+    blk->refs = n;
+    blk->len = st->st_size;
+    blk->plain = map;
+    blk->mapped = 1;
+
+    if (E.buf->rowcap < (int)n) {
+        E.buf->rowcap = n;
+        E.buf->row = memRealloc(MEM_ROWS, E.buf->row, sizeof(erow) * n);
+    }
+    for (uint64_t j = 0; j < n; ++j) {
+        erow *row = &E.buf->row[j];
+        memset(row, 0, sizeof(*row));
+        row->idx = j;
+        row->orig = j;
+        row->size = lengths[j];
+        row->hl_open_comment = (open_comment[j / 8] >> (j % 8)) & 1;
+        row->ascii = 1;
+        row->blk = blk;
+        row->blkoff = offsets[j];
+        row->brk = brackets[j];
+    }
+    E.buf->numrows = n;
+    E.buf->mapped = 1;
+    E.buf->map_fd = map_fd;
+    E.buf->brk_valid = 0;
+    editorDiffReset(-1); // hashed from the file when first needed
+    editorOutlineReset();
+    E.buf->syntax = h->syntax >= 0 ? &HLDB[h->syntax] : NULL;
+    E.buf->follow_off = st->st_size;
+    E.buf->follow_partial = h->partial;
+    munmap(idx, ist.st_size);
+    return 1;
+}
+
+// Writes the index of the buffer's file as it is on disk now, given where
+// each row starts in it; NULL means the rows were just saved, one per line.
+void editorWriteIndex(const uint64_t *offsets) {
+    struct stat st;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    if (!E.buf->filename || stat(E.buf->filename, &st) == -1 ||
+        st.st_size != E.buf->file_size ||
+        st.st_mtim.tv_sec != E.buf->file_mtime.tv_sec ||
+        st.st_mtim.tv_nsec != E.buf->file_mtime.tv_nsec ||
+        editorIndexPath(E.buf->filename, path, sizeof(path), 1) == -1) {
+        return;
+    }
+    editorUpdateStaleRows();
+
+    uint64_t n = E.buf->numrows;
+    size_t bytes = INDEX_BYTES(n);
+    char *idx = calloc(1, bytes);
+    struct indexHeader *h = (struct indexHeader *)idx;
+    memcpy(h->magic, CEREAL_INDEX_MAGIC, 8);
+    h->version = CEREAL_INDEX_VERSION;
+    h->syntax = E.buf->syntax ? E.buf->syntax - HLDB : -1;
+    h->size = st.st_size;
+    h->ino = st.st_ino;
+    h->dev = st.st_dev;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    h->numrows = n;
+    h->partial = offsets ? E.buf->follow_partial : 0;
+    uint64_t *offs = (uint64_t *)(idx + sizeof(*h));
+    uint32_t *lengths = (uint32_t *)(offs + n);
+    struct bracketSum *brackets = (struct bracketSum *)(lengths + n);
+    unsigned char *open_comment = (unsigned char *)(brackets + n);
+    uint64_t off = 0;
+    for (uint64_t j = 0; j < n; ++j) {
+        erow *row = &E.buf->row[j];
+        offs[j] = offsets ? offsets[j] : off;
+        lengths[j] = row->size;
+        brackets[j] = row->brk;
+        open_comment[j / 8] |= (row->hl_open_comment != 0) << (j % 8);
+        off += row->size + 1;
+    }
+
+    // write aside, then rename, so readers never see half an index
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        int ok = write(fd, idx, bytes) == (ssize_t)bytes;
+        close(fd);
+        if (!ok || rename(tmp, path) == -1) {
+            unlink(tmp);
+        }
+    }
+    free(idx);
+}
+
+// Moves about max rows still reading from a mapped file into compressed
+// blocks of their own, so the file can be rewritten under them. Returns 1 if
+// some are left.
+int editorUnmapRows(int max) {
+    int run = 0;
+    for (int j = 0; j <= E.buf->numrows; ++j) {
+        int mapped = j < E.buf->numrows && E.buf->row[j].blk &&
+            E.buf->row[j].blk->mapped;
+        if (mapped && run < CEREAL_BLOCK_ROWS) {
+            ++run;
+            continue;
+        }
+        if (run > 0) {
+            editorFreezeRows(j - run, run);
+            max -= run;
+        }
+        if (mapped && max <= 0) return 1;
+        run = mapped ? 1 : 0;
+    }
+    editorMapClose();
+    return 0;
+}
+
+void editorMapClose() {
+    if (!E.buf->mapped) return;
+    close(E.buf->map_fd);
+    E.buf->mapped = 0;
+}
+
+// Whether the file changed since its mapping was taken. A followed file
+// that only grew was appended to, which leaves the mapped bytes alone.
+int editorMapChanged() {
+    struct stat st;
+    if (fstat(E.buf->map_fd, &st) == -1) return 1;
+    if (st.st_size == E.buf->file_size &&
+        st.st_mtim.tv_sec == E.buf->file_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == E.buf->file_mtime.tv_nsec) {
+        return 0;
+    }
+    return !(E.buf->follow && st.st_size > E.buf->file_size);
+}
+
+// The file was rewritten under rows still read from its mapping: their text
+// is gone, and past the new end of file reading it would fault. A clean
+// buffer is reloaded; a dirty one keeps what the file holds now.
+void editorMapLost() {
+    if (!E.buf->dirty && E.buf->follow) {
+        editorFollowReset();
+        editorFollowRead();
+        editorSetStatusMessage("File changed on disk, reloaded");
+        return;
+    }
+    if (!E.buf->dirty && access(E.buf->filename, R_OK) == 0) {
+        char *filename = strdup(E.buf->filename);
+        int cy = E.buf->cy, rowoff = E.buf->rowoff;
+        editorCloseFile();
+        editorOpen(filename);
+        free(filename);
+        E.buf->cy = cy < E.buf->numrows ? cy : 0;
+        E.buf->rowoff = rowoff <= E.buf->cy ? rowoff : E.buf->cy;
+        editorSetStatusMessage("File changed on disk, reloaded");
+        return;
+    }
+
+    struct stat st;
+    off_t size = fstat(E.buf->map_fd, &st) == 0 ? st.st_size : 0;
+    for (int j = 0; j < E.buf->numrows; ++j) {
+        erow *row = &E.buf->row[j];
+        if (!row->blk || !row->blk->mapped) continue;
+        if (row->blkoff >= size) {
+            row->size = 0;
+        } else if (row->blkoff + row->size > size) {
+            row->size = size - row->blkoff;
+        }
+    }
+    editorUnmapRows(INT_MAX);
+    E.buf->brk_valid = 0;
+    editorSetStatusMessage("File changed on disk: unedited lines show its new contents");
+}
+
+// Checks the mapping of the current buffer's file before its rows are read
+// again, and copies a slice of them out. Called from the idle loop and for
+// each key; returns 1 if the screen needs a refresh.
+int editorMapPoll(int max) {
+    if (!E.buf->mapped) return 0;
+    if (editorMapChanged()) {
+        editorMapLost();
+        return 1;
+    }
+    if (max > 0) {
+        editorUnmapRows(max);
+    }
+    return 0;
+}
+
+/*** buffers ***/
+
+// Makes a new empty buffer current.
+void editorNewBuffer() {
+    struct editorBuffer *b = calloc(1, sizeof(*b));
+    E.bufs = realloc(E.bufs, sizeof(E.bufs[0]) * (E.nbufs + 1));
+    memmove(&E.bufs[1], &E.bufs[0], sizeof(E.bufs[0]) * E.nbufs);
+    E.bufs[0] = b;
+    ++E.nbufs;
+    E.buf = b;
+}
+
+// Shows E.bufs[j]. Its rows keep their render and hl, and its view its
+// scroll position, so switching costs no more than a repaint.
+void editorSwitchToBuffer(int j) {
+    struct editorBuffer *b = E.bufs[j];
+    memmove(&E.bufs[1], &E.bufs[0], sizeof(E.bufs[0]) * j);
+    E.bufs[0] = b;
+    E.buf = b;
+    E.frame_valid = 0;
+}
+
+const char *editorBufferName(struct editorBuffer *b) {
+    if (b->name) return b->name;
+    if (!b->filename) return "[No Name]";
+    const char *slash = strrchr(b->filename, '/');
+    return slash && slash[1] ? slash + 1 : b->filename;
+}
+
+// Finds the buffer visiting path, comparing files rather than names so
+// "a.c" and "./a.c" are the same. Returns its index in E.bufs, or -1.
+int editorFindBuffer(const char *path) {
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    for (int j = 0; j < E.nbufs; ++j) {
+        const char *name = E.bufs[j]->filename;
+        if (!name) continue;
+        struct stat bst;
+        if (exists ? (stat(name, &bst) == 0 && bst.st_dev == st.st_dev &&
+                      bst.st_ino == st.st_ino)
+                   : !strcmp(name, path)) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// Shows a buffer visiting path: the one already open if there is one,
+// reloaded only if the file changed on disk and the buffer has no edits.
+void editorVisitFile(const char *path) {
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    if (exists && access(path, R_OK) == -1) {
+        editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    int j = editorFindBuffer(path);
+    if (j != -1) {
+        editorSwitchToBuffer(j);
+        if (E.buf->dirty || !exists ||
+            (st.st_size == E.buf->file_size &&
+             st.st_mtim.tv_sec == E.buf->file_mtime.tv_sec &&
+             st.st_mtim.tv_nsec == E.buf->file_mtime.tv_nsec)) {
+            return;
+        }
+        editorCloseFile();
+    } else if (E.buf->filename || E.buf->numrows || E.buf->follow) {
+        editorNewBuffer();
+    }
+    E.frame_valid = 0;
+
+    if (exists) {
+        editorOpen((char *)path);
+    } else {
+        E.buf->filename = strdup(path);
+        editorSelectSyntaxHighlight();
+        editorSetStatusMessage("(New file)");
+    }
+}
+
+void editorFindFile() {
+    char *path = editorPrompt("Find file: %s", NULL, 0);
+    if (!path) return;
+    editorVisitFile(path);
+    free(path);
+}
+
+// Prompts for a buffer by name (a unique prefix will do), defaulting to
+// the one shown before the current one.
+void editorSelectBuffer() {
+    if (E.nbufs < 2) {
+        editorSetStatusMessage("No other buffer");
+        return;
+    }
+    char name_quoted[48], prompt[96];
+    editorPromptQuote(name_quoted, sizeof(name_quoted), editorBufferName(E.bufs[1]));
+    snprintf(prompt, sizeof(prompt), "Switch to buffer (default %s): %%s", name_quoted);
+    char *name = editorPrompt(prompt, NULL, 1);
+    if (!name) return;
+
+    int found = name[0] ? -1 : 1;
+    int matches = name[0] ? 0 : 1;
+    for (int j = 0; name[0] && j < E.nbufs; ++j) {
+        const char *bname = editorBufferName(E.bufs[j]);
+        if (!strcmp(bname, name)) {
+            found = j;
+            matches = 1;
+            break;
+        }
+        if (!strncmp(bname, name, strlen(name))) {
+            found = j;
+            ++matches;
+        }
+    }
+
+    if (matches == 1) {
+        editorSwitchToBuffer(found);
+    } else {
+        editorSetStatusMessage("%s: %s", matches ? "Ambiguous" : "No buffer", name);
+    }
+    free(name);
+}
+
+int editorDirtyBuffers() {
+    int n = 0;
+    for (int j = 0; j < E.nbufs; ++j) {
+        n += E.bufs[j]->dirty != 0;
+    }
+    return n;
+}
+
+// Closes the current buffer, asking first if it has unsaved changes.
+void editorKillBuffer() {
+    if (E.buf->dirty) {
+        char *answer = editorPrompt("Buffer modified; kill anyway? (yes or no) %s", NULL, 0);
+        int yes = answer && !strcmp(answer, "yes");
+        free(answer);
+        if (!yes) return;
+    }
+    editorGrepStop(E.buf);
+    editorOutlineStop(E.buf);
+    editorCloseFile();
+    memFree(MEM_ROWS, E.buf->row);
+    free(E.buf->brk);
+    free(E.buf->syms);
+    free(E.buf->sympool);
+    free(E.buf->name);
+    if (E.yank_buf == E.buf) E.yank_buf = NULL;
+    free(E.buf);
+
+    --E.nbufs;
+    memmove(&E.bufs[0], &E.bufs[1], sizeof(E.bufs[0]) * E.nbufs);
+    if (E.nbufs == 0) {
+        editorNewBuffer();
+    }
+    editorSwitchToBuffer(0);
+}
+
+/*** follow ***/
+
+// Appends a chunk of newly arrived bytes. Only the rows created here (and the
+// previously partial last row) are rendered and highlighted.
+void editorFollowAppend(char *buf, size_t len) {
+    int saved_dirty = E.buf->dirty;
+    int at_end = (E.buf->cy >= E.buf->numrows - 1);
+
+    char *p = buf;
+    char *end = buf + len;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        size_t linelen = (nl ? nl : end) - p;
+        if (nl && linelen > 0 && p[linelen - 1] == '\r') {
+            --linelen;
+        }
+
+        if (E.buf->follow_partial && E.buf->numrows > 0) {
+            erow *row = &E.buf->row[E.buf->numrows - 1];
+            editorRowThaw(row);
+            if (nl && linelen == 0) {
+                editorRowFlatten(row);
+            }
+            if (nl && linelen == 0 && row->size > 0 &&
+                row->chars[row->size - 1] == '\r') {
+                // \r\n split across two reads
+                row->chars[--row->size] = '\0';
+                editorUpdateRow(row);
+            } else if (linelen > 0) {
+                editorRowAppendString(row, p, linelen);
+            }
+        } else {
+            editorInsertRow(E.buf->numrows, p, linelen);
+            editorFreezeColdRows();
+        }
+        // what arrives is on disk already
+        editorDiffSetBase(&E.buf->row[E.buf->numrows - 1]);
+        E.buf->follow_partial = (nl == NULL);
+        p = nl ? nl + 1 : end;
+    }
+
+    E.buf->dirty = saved_dirty;
+    // auto-scroll only when the cursor sits on the last line
+    if (at_end && E.buf->numrows > 0) {
+        E.buf->cy = E.buf->numrows - 1;
+        E.buf->cx = 0;
+    }
+}
+
+// Reads everything past E.buf->follow_off. Returns 1 if rows were appended.
+int editorFollowRead() {
+    char buf[CEREAL_FOLLOW_CHUNK];
+    size_t total = 0;
+
+    // cap a single tick so a burst of output can't freeze the UI
+    while (total < CEREAL_FOLLOW_MAX) {
+        ssize_t n;
+        if (E.buf->follow_stream) {
+            n = read(E.buf->follow_fd, buf, sizeof(buf));
+        } else {
+            n = pread(E.buf->follow_fd, buf, sizeof(buf), E.buf->follow_off);
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0 && E.buf->follow_stream) {
+                editorFollowStop();
+                editorSetStatusMessage("Stream closed");
+            }
+            break;
+        }
+        E.buf->follow_off += n;
+        total += n;
+        editorFollowAppend(buf, n);
+
+        int keep = sizeof(E.buf->follow_tail);
+        if (n >= keep) {
+            memcpy(E.buf->follow_tail, buf + n - keep, keep);
+            E.buf->follow_taillen = keep;
+        } else {
+            int old = E.buf->follow_taillen + n > keep ? keep - n : E.buf->follow_taillen;
+            memmove(E.buf->follow_tail, E.buf->follow_tail + E.buf->follow_taillen - old, old);
+            memcpy(E.buf->follow_tail + old, buf, n);
+            E.buf->follow_taillen = old + n;
+        }
+    }
+    return total > 0;
+}
+
+void editorFollowReset() {
+    for (int j = 0; j < E.buf->numrows; ++j) {
+        editorFreeRow(&E.buf->row[j]);
+    }
+    editorOccurSplice(0, E.buf->numrows, 0);
+    editorFoldClear(E.buf);
+    editorDiffReset(0);
+    editorCursorsClear(E.buf);
+    E.buf->numrows = 0;
+    E.buf->cx = E.buf->cy = 0;
+    E.buf->rowoff = E.buf->coloff = 0;
+    E.buf->follow_off = 0;
+    E.buf->follow_partial = 0;
+    E.buf->follow_taillen = 0;
+    editorMapClose();
+    editorOutlineReset();
+}
+
+// A file that was truncated and quickly written again may already be longer
+// than follow_off, so also check that the bytes we last read are still there.
+int editorFollowTruncated() {
+    struct stat st;
+    if (fstat(E.buf->follow_fd, &st) == -1) return 0;
+    if (st.st_size < E.buf->follow_off) return 1;
+
+    char tail[sizeof(E.buf->follow_tail)];
+    int len = E.buf->follow_taillen;
+    return len > 0 &&
+        (pread(E.buf->follow_fd, tail, len, E.buf->follow_off - len) != len ||
+         memcmp(tail, E.buf->follow_tail, len) != 0);
+}
+
+// Called from the editorReadKey idle loop. Returns 1 if the screen needs a
+// refresh.
+int editorFollowPoll() {
+    if (!E.buf->follow) return 0;
+
+    int changed = 0;
+    int pending = (E.buf->follow_inotify == -1); // no inotify: poll every tick
+
+    if (E.buf->follow_inotify != -1) {
+        char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while ((n = read(E.buf->follow_inotify, ev, sizeof(ev))) > 0) {
+            for (char *p = ev; p < ev + n;) {
+                struct inotify_event *e = (struct inotify_event *)p;
+                if (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    E.buf->follow_rotated = 1;
+                }
+                p += sizeof(struct inotify_event) + e->len;
+            }
+            pending = 1;
+        }
+    }
+
+    if (pending && !E.buf->follow_stream && editorFollowTruncated()) {
+        // reloading would throw away unsaved edits
+        if (E.buf->dirty) {
+            editorFollowStop();
+            editorSetStatusMessage("File truncated, follow stopped: buffer has unsaved changes");
+            return 1;
+        }
+        editorFollowReset();
+        editorSetStatusMessage("File truncated, reloaded");
+        changed = 1;
+    }
+    if (pending) {
+        changed |= editorFollowRead();
+    }
+
+    // after a rotation keep draining the old file, then switch to the new
+    // one as soon as it shows up under the same name
+    if (E.buf->follow_rotated) {
+        struct stat st;
+        if (stat(E.buf->filename, &st) == 0 && st.st_ino != E.buf->follow_ino) {
+            int fd = open(E.buf->filename, O_RDONLY);
+            if (fd != -1) {
+                changed |= editorFollowRead();
+                close(E.buf->follow_fd);
+                E.buf->follow_fd = fd;
+                E.buf->follow_ino = st.st_ino;
+                E.buf->follow_off = 0;
+                E.buf->follow_partial = 0;
+                E.buf->follow_taillen = 0;
+                E.buf->follow_rotated = 0;
+                if (E.buf->follow_inotify != -1) {
+                    inotify_add_watch(E.buf->follow_inotify, E.buf->filename,
+                                      IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+                }
+                changed |= editorFollowRead();
+                editorSetStatusMessage("File rotated, following new file");
+            }
+        }
+    }
+    return changed;
+}
+
+// Follows an already open fd: a pipe (stdin) or the file being edited.
+void editorFollowStart(int fd, int stream) {
+    E.buf->follow = 1;
+    E.buf->follow_fd = fd;
+    E.buf->follow_stream = stream;
+    E.buf->follow_rotated = 0;
+    E.buf->follow_inotify = -1;
+    E.buf->follow_taillen = 0;
+
+    if (stream) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            E.buf->follow_ino = st.st_ino;
+        }
+        int len = E.buf->follow_off < (off_t)sizeof(E.buf->follow_tail) ?
+            E.buf->follow_off : (off_t)sizeof(E.buf->follow_tail);
+        if (pread(fd, E.buf->follow_tail, len, E.buf->follow_off - len) == len) {
+            E.buf->follow_taillen = len;
+        }
+        E.buf->follow_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E.buf->follow_inotify != -1 &&
+            inotify_add_watch(E.buf->follow_inotify, E.buf->filename,
+                              IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+            close(E.buf->follow_inotify);
+            E.buf->follow_inotify = -1;
+        }
+    }
+    editorFollowRead();
+}
+
+void editorFollowStop() {
+    if (!E.buf->follow) return;
+    close(E.buf->follow_fd);
+    if (E.buf->follow_inotify != -1) {
+        close(E.buf->follow_inotify);
+    }
+    E.buf->follow = 0;
+}
+
+void editorToggleFollow() {
+    if (E.buf->follow) {
+        editorFollowStop();
+        editorSetStatusMessage("Follow mode off");
+        return;
+    }
+    if (E.buf->filename == NULL) {
+        editorSetStatusMessage("Follow mode needs a file");
+        return;
+    }
+    if (E.buf->hex) {
+        editorSetStatusMessage("Follow mode needs a text file");
+        return;
+    }
+    int fd = open(E.buf->filename, O_RDONLY);
+    if (fd == -1) {
+        editorSetStatusMessage("Can't follow: %s", strerror(errno));
+        return;
+    }
+    editorFollowStart(fd, 0);
+    editorSetStatusMessage("Follow mode on");
+}
+
+/*** regex ***/
+
+// Search patterns compile to a Thompson NFA which is run as a lazily built
+// DFA, so matching is linear in the text for every pattern: there is no
+// backtracking. Supports . [] [^] \d \w \s \D \W \S * + ? {m,n} | () ^ $,
+// with . and classes matching whole UTF-8 codepoints. Matches are
+// leftmost-longest.
+
+#define RE_MAX_INSTS 20000
+#define RE_MAX_DEPTH 256
+#define RE_MAX_REPEAT 1000
+#define RE_MAX_STATES 1024
+#define RE_MAX_FLUSHES 8
+#define RE_MAX_PREFIX 64
+
+enum reNodeType { RN_BYTES, RN_CAT, RN_ALT, RN_REPEAT, RN_BOL, RN_EOL, RN_EMPTY };
+
+struct reNode {
+    int type;
+    int a, b;     // children
+    int min, max; // RN_REPEAT, max -1 for unbounded
+    unsigned char set[32];
+};
+
+struct reRange {
+    int lo, hi;
+};
+
+struct reParser {
+    const char *p;
+    struct reNode *node;
+    int n, cap;
+    int depth;
+    const char *err;
+};
+
+enum reOp { RE_BYTES, RE_SPLIT, RE_JMP, RE_BOL, RE_EOL, RE_MATCH };
+
+struct reInst {
+    int op;
+    int x, y; // RE_SPLIT goes to both, RE_JMP to x, the others fall through
+    unsigned char set[32];
+};
+
+struct reProg {
+    struct reInst *inst;
+    int n, cap;
+};
+
+#define RS_MATCH 1     // the state matches here
+#define RS_END_KNOWN 2 // RS_END_MATCH below has been computed
+#define RS_END_MATCH 4 // the state matches if this is the end of the row
+
+// A DFA state is a set of NFA instructions; next[] is filled in as bytes
+// are seen, -1 until then. Two extra states after the cache serve the NFA
+// simulation, see reNext.
+struct reState {
+    int *set;
+    int n;
+    int flags;
+    int next[256];
+};
+
+struct reDfa {
+    struct reProg *prog;
+    int unanchored;     // restart the NFA at every byte
+    struct reState *st;
+    int nst;
+    int *table;         // open-addressed hash of states, by set
+    int start[2];       // start state by whether at the beginning of the row
+    int flushes;
+    int flip;           // which scratch state the NFA simulation fills next
+    int *mark;          // scratch for closures
+    int gen;
+    int *stack;
+    int *buf;
+};
+
+struct regex {
+    struct reProg fwd; // the pattern
+    struct reProg rev; // the pattern reversed, for finding match starts
+    struct reDfa search;  // forward, unanchored
+    struct reDfa longest; // forward, anchored
+    struct reDfa starts;  // reverse, unanchored
+    char prefix[RE_MAX_PREFIX]; // every match starts with this
+    int prefixlen;
+    int literal;  // the pattern is just prefix
+    int anchored; // the pattern starts with ^
+    // the match starts in swept[sweptlo..sweptlen], one bit per position,
+    // kept for regexSearchNext
+    unsigned char *at;
+    int atcap;
+    const char *swept;
+    int sweptlen;
+    int sweptlo;
+};
+
+int reNew(struct reParser *ps, int type, int a, int b) {
+    if (ps->n == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 64;
+        ps->node = realloc(ps->node, sizeof(struct reNode) * ps->cap);
+    }
+    struct reNode *nd = &ps->node[ps->n];
+    memset(nd, 0, sizeof(*nd));
+    nd->type = type;
+    nd->a = a;
+    nd->b = b;
+    return ps->n++;
+}
+
+int reBytes(struct reParser *ps, int lo, int hi) {
+    int i = reNew(ps, RN_BYTES, -1, -1);
+    for (int c = lo; c <= hi; ++c) {
+        ps->node[i].set[c >> 3] |= 1 << (c & 7);
+    }
+    return i;
+}
+
+// Appends b to a, either possibly -1 for nothing yet.
+int reCat(struct reParser *ps, int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return reNew(ps, RN_CAT, a, b);
+}
+
+int reAlt(struct reParser *ps, int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return reNew(ps, RN_ALT, a, b);
+}
+
+int reEncode(int cp, unsigned char *b) {
+    if (cp < 0x80) {
+        b[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        b[0] = 0xc0 | (cp >> 6);
+        b[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        b[0] = 0xe0 | (cp >> 12);
+        b[1] = 0x80 | ((cp >> 6) & 0x3f);
+        b[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    b[0] = 0xf0 | (cp >> 18);
+    b[1] = 0x80 | ((cp >> 12) & 0x3f);
+    b[2] = 0x80 | ((cp >> 6) & 0x3f);
+    b[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+// Adds the codepoints lo..hi to *alt as byte sequences, splitting the range
+// until every byte position of the encoding is a contiguous byte range.
+void reUtf8Range(struct reParser *ps, int lo, int hi, int *alt) {
+    static const int last[] = { 0x7f, 0x7ff, 0xffff };
+    for (int k = 0; k < 3; ++k) {
+        if (lo <= last[k] && hi > last[k]) {
+            reUtf8Range(ps, lo, last[k], alt);
+            reUtf8Range(ps, last[k] + 1, hi, alt);
+            return;
+        }
+    }
+
+    unsigned char a[4], b[4];
+    int n = reEncode(lo, a);
+    reEncode(hi, b);
+    for (int i = 1; i < n; ++i) {
+        int m = (1 << (6 * i)) - 1;
+        if ((lo & ~m) != (hi & ~m)) {
+            if ((lo & m) != 0) {
+                reUtf8Range(ps, lo, lo | m, alt);
+                reUtf8Range(ps, (lo | m) + 1, hi, alt);
+                return;
+            }
+            if ((hi & m) != m) {
+                reUtf8Range(ps, lo, (hi & ~m) - 1, alt);
+                reUtf8Range(ps, hi & ~m, hi, alt);
+                return;
+            }
+        }
+    }
+
+    int seq = -1;
+    for (int i = 0; i < n; ++i) {
+        seq = reCat(ps, seq, reBytes(ps, a[i], b[i]));
+    }
+    *alt = reAlt(ps, *alt, seq);
+}
+
+int reRangeCmp(const void *a, const void *b) {
+    return ((const struct reRange *)a)->lo - ((const struct reRange *)b)->lo;
+}
+
+// Builds the node matching one codepoint from r[0..n), or from everything
+// else when negate is set. r must have room for n + 1 ranges.
+int reClass(struct reParser *ps, struct reRange *r, int n, int negate) {
+    qsort(r, n, sizeof(struct reRange), reRangeCmp);
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        if (m > 0 && r[i].lo <= r[m - 1].hi + 1) {
+            if (r[i].hi > r[m - 1].hi) r[m - 1].hi = r[i].hi;
+        } else {
+            r[m++] = r[i];
+        }
+    }
+    n = m;
+
+    if (negate) {
+        int lo = 0;
+        m = 0;
+        for (int i = 0; i < n; ++i) {
+            struct reRange cur = r[i]; // r[m] may overwrite it
+            if (cur.lo > lo) {
+                r[m].lo = lo;
+                r[m++].hi = cur.lo - 1;
+            }
+            lo = cur.hi + 1;
+        }
+        if (lo <= 0x10ffff) {
+            r[m].lo = lo;
+            r[m++].hi = 0x10ffff;
+        }
+        n = m;
+    }
+
+    // all of ASCII in one byte set, the rest as UTF-8 sequences
+    int ascii = reNew(ps, RN_BYTES, -1, -1);
+    int any_ascii = 0;
+    int alt = -1;
+    for (int i = 0; i < n; ++i) {
+        int lo = r[i].lo;
+        for (; lo <= r[i].hi && lo < 0x80; ++lo) {
+            ps->node[ascii].set[lo >> 3] |= 1 << (lo & 7);
+            any_ascii = 1;
+        }
+        if (lo <= r[i].hi) {
+            reUtf8Range(ps, lo, r[i].hi, &alt);
+        }
+    }
+    if (any_ascii || alt < 0) {
+        alt = reAlt(ps, ascii, alt);
+    }
+    return alt;
+}
+
+// Ranges for \d \w \s, in order; returns how many were added to r, 0 if c
+// is not one of those. *negate is set for the capitals.
+int reClassEscape(char c, struct reRange *r, int *negate) {
+    *negate = isupper((unsigned char)c);
+    switch (tolower((unsigned char)c)) {
+    case 'd':
+        r[0] = (struct reRange){ '0', '9' };
+        return 1;
+    case 'w':
+        r[0] = (struct reRange){ '0', '9' };
+        r[1] = (struct reRange){ 'A', 'Z' };
+        r[2] = (struct reRange){ '_', '_' };
+        r[3] = (struct reRange){ 'a', 'z' };
+        return 4;
+    case 's':
+        r[0] = (struct reRange){ '\t', '\r' };
+        r[1] = (struct reRange){ ' ', ' ' };
+        return 2;
+    }
+    return 0;
+}
+
+int reEscapeChar(char c) {
+    switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    }
+    return (unsigned char)c;
+}
+
+// Reads one codepoint of the pattern.
+int reNextCodepoint(struct reParser *ps) {
+    int cp;
+    int len = utf8Decode(ps->p, strnlen(ps->p, 4), &cp);
+    if (cp < 0) cp = (unsigned char)*ps->p;
+    ps->p += len;
+    return cp;
+}
+
+int reParseClass(struct reParser *ps) {
+    int cap = 16, n = 0;
+    struct reRange *r = malloc(sizeof(struct reRange) * cap);
+    int negate = 0;
+
+    if (*ps->p == '^') {
+        negate = 1;
+        ++ps->p;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        if (n + 8 > cap) {
+            cap *= 2;
+            r = realloc(r, sizeof(struct reRange) * cap);
+        }
+
+        int lo;
+        if (*ps->p == '\\' && ps->p[1]) {
+            int neg;
+            struct reRange esc[4];
+            int k = reClassEscape(ps->p[1], esc, &neg);
+            if (k) {
+                ps->p += 2;
+                if (neg) {
+                    // complement of a few ASCII ranges, added piecewise
+                    int from = 0;
+                    for (int i = 0; i < k; ++i) {
+                        if (esc[i].lo > from) {
+                            r[n++] = (struct reRange){ from, esc[i].lo - 1 };
+                        }
+                        from = esc[i].hi + 1;
+                    }
+                    r[n++] = (struct reRange){ from, 0x10ffff };
+                } else {
+                    memcpy(&r[n], esc, sizeof(struct reRange) * k);
+                    n += k;
+                }
+                continue;
+            }
+            lo = reEscapeChar(ps->p[1]);
+            ps->p += 2;
+        } else {
+            lo = reNextCodepoint(ps);
+        }
+
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            ++ps->p;
+            if (*ps->p == '\\' && ps->p[1]) {
+                hi = reEscapeChar(ps->p[1]);
+                ps->p += 2;
+            } else {
+                hi = reNextCodepoint(ps);
+            }
+            if (hi < lo) {
+                ps->err = "Bad range in []";
+                free(r);
+                return -1;
+            }
+        }
+        r[n++] = (struct reRange){ lo, hi };
+    }
+    if (*ps->p != ']') {
+        ps->err = "Missing ]";
+        free(r);
+        return -1;
+    }
+    ++ps->p;
+
+    int node = reClass(ps, r, n, negate);
+    free(r);
+    return node;
+}
+
+int reParseAlt(struct reParser *ps);
+
+int reParseAtom(struct reParser *ps) {
+    char c = *ps->p;
+    struct reRange r[5];
+    int neg, k;
+
+    switch (c) {
+    case '(': {
+        if (++ps->depth > RE_MAX_DEPTH) {
+            ps->err = "Nested too deep";
+            return -1;
+        }
+        ++ps->p;
+        int node = reParseAlt(ps);
+        if (ps->err) return -1;
+        if (*ps->p != ')') {
+            ps->err = "Missing )";
+            return -1;
+        }
+        ++ps->p;
+        --ps->depth;
+        return node < 0 ? reNew(ps, RN_EMPTY, -1, -1) : node;
+    }
+    case '[':
+        ++ps->p;
+        return reParseClass(ps);
+    case '.':
+        ++ps->p;
+        r[0] = (struct reRange){ '\n', '\n' };
+        return reClass(ps, r, 1, 1);
+    case '^':
+        ++ps->p;
+        return reNew(ps, RN_BOL, -1, -1);
+    case '$':
+        ++ps->p;
+        return reNew(ps, RN_EOL, -1, -1);
+    case '*': case '+': case '?':
+        ps->err = "Nothing to repeat";
+        return -1;
+    case '\\':
+        if (!ps->p[1]) {
+            ps->err = "Trailing \\";
+            return -1;
+        }
+        k = reClassEscape(ps->p[1], r, &neg);
+        if (k) {
+            ps->p += 2;
+            return reClass(ps, r, k, neg);
+        }
+        c = reEscapeChar(ps->p[1]);
+        ps->p += 2;
+        return reBytes(ps, (unsigned char)c, (unsigned char)c);
+    }
+
+    // a literal codepoint, as its bytes
+    int cp;
+    int len = utf8Decode(ps->p, strnlen(ps->p, 4), &cp);
+    ps->p += len;
+    if (cp < 0) {
+        return reBytes(ps, (unsigned char)c, (unsigned char)c);
+    }
+    unsigned char b[4];
+    int n = reEncode(cp, b);
+    int node = -1;
+    for (int i = 0; i < n; ++i) {
+        node = reCat(ps, node, reBytes(ps, b[i], b[i]));
+    }
+    return node;
+}
+
+// Parses {m}, {m,} or {m,n}; leaves p alone and returns 0 if it isn't one,
+// so that a stray { is literal.
+int reParseBraces(struct reParser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    if (!isdigit((unsigned char)*p)) return 0;
+    *min = strtol(p, (char **)&p, 10);
+    *max = *min;
+    if (*p == ',') {
+        ++p;
+        *max = -1;
+        if (isdigit((unsigned char)*p)) {
+            *max = strtol(p, (char **)&p, 10);
+        }
+    }
+    if (*p != '}') return 0;
+    ps->p = p + 1;
+    return 1;
+}
+
+int reParseRepeat(struct reParser *ps) {
+    int node = reParseAtom(ps);
+    if (ps->err) return -1;
+
+    for (;;) {
+        int min = 0, max = -1;
+        if (*ps->p == '*') {
+            ++ps->p;
+        } else if (*ps->p == '+') {
+            min = 1;
+            ++ps->p;
+        } else if (*ps->p == '?') {
+            max = 1;
+            ++ps->p;
+        } else if (*ps->p == '{' && reParseBraces(ps, &min, &max)) {
+            if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT ||
+                (max >= 0 && max < min)) {
+                ps->err = "Bad {m,n}";
+                return -1;
+            }
+        } else {
+            return node;
+        }
+        int rep = reNew(ps, RN_REPEAT, node, -1);
+        ps->node[rep].min = min;
+        ps->node[rep].max = max;
+        node = rep;
+    }
+}
+
+int reParseCat(struct reParser *ps) {
+    int node = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int atom = reParseRepeat(ps);
+        if (ps->err) return -1;
+        node = reCat(ps, node, atom);
+    }
+    return node < 0 ? reNew(ps, RN_EMPTY, -1, -1) : node;
+}
+
+int reParseAlt(struct reParser *ps) {
+    int node = reParseCat(ps);
+    while (!ps->err && *ps->p == '|') {
+        ++ps->p;
+        node = reNew(ps, RN_ALT, node, reParseCat(ps));
+    }
+    return node;
+}
+
+int reEmitInst(struct reProg *prog, int op) {
+    if (prog->n == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 64;
+        prog->inst = realloc(prog->inst, sizeof(struct reInst) * prog->cap);
+    }
+    struct reInst *in = &prog->inst[prog->n];
+    in->op = op;
+    in->x = in->y = -1;
+    return prog->n++;
+}
+
+// Appends the code for node i, falling through to whatever comes next.
+// reverse builds the program for matching the text backwards. Returns -1
+// once the program grows too large.
+int reEmit(struct reProg *prog, struct reNode *nd, int i, int reverse) {
+    if (prog->n > RE_MAX_INSTS) return -1;
+
+    int k, at, j;
+    switch (nd[i].type) {
+    case RN_BYTES:
+        at = reEmitInst(prog, RE_BYTES);
+        memcpy(prog->inst[at].set, nd[i].set, 32);
+        break;
+    case RN_BOL:
+        reEmitInst(prog, reverse ? RE_EOL : RE_BOL);
+        break;
+    case RN_EOL:
+        reEmitInst(prog, reverse ? RE_BOL : RE_EOL);
+        break;
+    case RN_EMPTY:
+        break;
+    case RN_CAT:
+        if (reEmit(prog, nd, reverse ? nd[i].b : nd[i].a, reverse) < 0) return -1;
+        if (reEmit(prog, nd, reverse ? nd[i].a : nd[i].b, reverse) < 0) return -1;
+        break;
+    case RN_ALT:
+        at = reEmitInst(prog, RE_SPLIT);
+        prog->inst[at].x = prog->n;
+        if (reEmit(prog, nd, nd[i].a, reverse) < 0) return -1;
+        j = reEmitInst(prog, RE_JMP);
+        prog->inst[at].y = prog->n;
+        if (reEmit(prog, nd, nd[i].b, reverse) < 0) return -1;
+        prog->inst[j].x = prog->n;
+        break;
+    case RN_REPEAT:
+        for (k = 0; k < nd[i].min; ++k) {
+            if (reEmit(prog, nd, nd[i].a, reverse) < 0) return -1;
+        }
+        if (nd[i].max < 0) {
+            at = reEmitInst(prog, RE_SPLIT);
+            prog->inst[at].x = prog->n;
+            if (reEmit(prog, nd, nd[i].a, reverse) < 0) return -1;
+            j = reEmitInst(prog, RE_JMP);
+            prog->inst[j].x = at;
+            prog->inst[at].y = prog->n;
+        } else {
+            // x{0,n}: n optional copies that can each skip to the end
+            int first = prog->n;
+            for (k = nd[i].min; k < nd[i].max; ++k) {
+                at = reEmitInst(prog, RE_SPLIT);
+                prog->inst[at].x = prog->n;
+                if (reEmit(prog, nd, nd[i].a, reverse) < 0) return -1;
+            }
+            for (k = first; k < prog->n; ++k) {
+                if (prog->inst[k].op == RE_SPLIT && prog->inst[k].y == -1) {
+                    prog->inst[k].y = prog->n;
+                }
+            }
+        }
+        break;
+    }
+    return prog->n > RE_MAX_INSTS ? -1 : 0;
+}
+
+// Collects the literal bytes every match of node i starts with. Returns 1
+// if the whole node was literal, so the caller may keep collecting.
+int rePrefix(struct regex *re, struct reNode *nd, int i) {
+    int c, k;
+    switch (nd[i].type) {
+    case RN_BYTES:
+        c = -1;
+        for (k = 0; k < 256; ++k) {
+            if (nd[i].set[k >> 3] & (1 << (k & 7))) {
+                if (c >= 0) return 0;
+                c = k;
+            }
+        }
+        if (c < 0 || re->prefixlen == RE_MAX_PREFIX) return 0;
+        re->prefix[re->prefixlen++] = c;
+        return 1;
+    case RN_CAT:
+        return rePrefix(re, nd, nd[i].a) && rePrefix(re, nd, nd[i].b);
+    case RN_REPEAT:
+        if (nd[i].min == 0) return 0;
+        if (!rePrefix(re, nd, nd[i].a)) return 0;
+        return nd[i].min == 1 && nd[i].max == 1;
+    case RN_EMPTY:
+        return 1;
+    case RN_BOL:
+        if (re->prefixlen > 0) return 0;
+        re->anchored = 1;
+        return 1;
+    }
+    return 0;
+}
+
+void reDfaInit(struct reDfa *d, struct reProg *prog, int unanchored) {
+    memset(d, 0, sizeof(*d));
+    d->prog = prog;
+    d->unanchored = unanchored;
+    d->st = malloc(sizeof(struct reState) * (RE_MAX_STATES + 2));
+    for (int i = RE_MAX_STATES; i < RE_MAX_STATES + 2; ++i) {
+        d->st[i].set = malloc(sizeof(int) * (prog->n + 1));
+        memset(d->st[i].next, -1, sizeof(d->st[i].next));
+    }
+    d->table = malloc(sizeof(int) * RE_MAX_STATES * 2);
+    memset(d->table, -1, sizeof(int) * RE_MAX_STATES * 2);
+    d->start[0] = d->start[1] = -1;
+    d->mark = calloc(prog->n, sizeof(int));
+    d->stack = malloc(sizeof(int) * (prog->n * 2 + 2));
+    d->buf = malloc(sizeof(int) * prog->n);
+}
+
+void reDfaFlush(struct reDfa *d) {
+    for (int i = 0; i < d->nst; ++i) {
+        free(d->st[i].set);
+    }
+    d->nst = 0;
+    memset(d->table, -1, sizeof(int) * RE_MAX_STATES * 2);
+    d->start[0] = d->start[1] = -1;
+}
+
+void reDfaFree(struct reDfa *d) {
+    reDfaFlush(d);
+    free(d->st[RE_MAX_STATES].set);
+    free(d->st[RE_MAX_STATES + 1].set);
+    free(d->st);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+}
+
+// Adds instruction pc and everything reachable from it without consuming
+// a byte to d->buf[0..*n). Assertions that don't hold stay in the set so
+// that RS_END_MATCH can follow them later.
+void reClosure(struct reDfa *d, int pc, int *n, int bol, int eol) {
+    struct reInst *inst = d->prog->inst;
+    int sp = 0;
+    d->stack[sp++] = pc;
+    while (sp > 0) {
+        pc = d->stack[--sp];
+        if (pc >= d->prog->n || d->mark[pc] == d->gen) continue;
+        d->mark[pc] = d->gen;
+
+        switch (inst[pc].op) {
+        case RE_JMP:
+            d->stack[sp++] = inst[pc].x;
+            break;
+        case RE_SPLIT:
+            d->stack[sp++] = inst[pc].y;
+            d->stack[sp++] = inst[pc].x;
+            break;
+        case RE_BOL:
+        case RE_EOL:
+            if (inst[pc].op == RE_BOL ? bol : eol) {
+                d->stack[sp++] = pc + 1;
+            } else {
+                d->buf[(*n)++] = pc;
+            }
+            break;
+        default:
+            d->buf[(*n)++] = pc;
+        }
+    }
+}
+
+int reIntCmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Returns the state for the set in d->buf[0..n), adding it if new. The
+// cache is flushed when full and the scan goes on rebuilding states as it
+// needs them.
+int reIntern(struct reDfa *d, int n) {
+    qsort(d->buf, n, sizeof(int), reIntCmp);
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < n; ++i) {
+        h = (h ^ (uint64_t)d->buf[i]) * 1099511628211ULL;
+    }
+
+    int mask = RE_MAX_STATES * 2 - 1;
+    int slot = h & mask;
+    for (; d->table[slot] >= 0; slot = (slot + 1) & mask) {
+        struct reState *s = &d->st[d->table[slot]];
+        if (s->n == n && !memcmp(s->set, d->buf, sizeof(int) * n)) {
+            return d->table[slot];
+        }
+    }
+
+    if (d->nst == RE_MAX_STATES) {
+        reDfaFlush(d);
+        ++d->flushes;
+        return reIntern(d, n);
+    }
+    struct reState *s = &d->st[d->nst];
+    s->set = malloc(sizeof(int) * (n ? n : 1));
+    memcpy(s->set, d->buf, sizeof(int) * n);
+    s->n = n;
+    s->flags = 0;
+    for (int i = 0; i < n; ++i) {
+        if (d->prog->inst[d->buf[i]].op == RE_MATCH) s->flags |= RS_MATCH;
+    }
+    memset(s->next, -1, sizeof(s->next));
+    d->table[slot] = d->nst;
+    return d->nst++;
+}
+
+int reStartState(struct reDfa *d, int bol) {
+    if (d->start[bol] < 0) {
+        int n = 0;
+        ++d->gen;
+        reClosure(d, 0, &n, bol, 0);
+        d->start[bol] = reIntern(d, n);
+    }
+    return d->start[bol];
+}
+
+int reNext(struct reDfa *d, int s, unsigned char c) {
+    if (d->st[s].next[c] >= 0) return d->st[s].next[c];
+
+    struct reInst *inst = d->prog->inst;
+    struct reState *st = &d->st[s];
+    int n = 0;
+    ++d->gen;
+    for (int i = 0; i < st->n; ++i) {
+        int pc = st->set[i];
+        if (inst[pc].op == RE_BYTES && (inst[pc].set[c >> 3] & (1 << (c & 7)))) {
+            reClosure(d, pc + 1, &n, 0, 0);
+        }
+    }
+    if (d->unanchored) {
+        reClosure(d, 0, &n, 0, 0);
+    }
+
+    if (d->flushes >= RE_MAX_FLUSHES) {
+        // the DFA keeps outgrowing the cache: simulate the NFA instead, in
+        // the scratch state s isn't using
+        d->flip ^= 1;
+        struct reState *nx = &d->st[RE_MAX_STATES + d->flip];
+        memcpy(nx->set, d->buf, sizeof(int) * n);
+        nx->n = n;
+        nx->flags = 0;
+        for (int i = 0; i < n; ++i) {
+            if (inst[d->buf[i]].op == RE_MATCH) nx->flags |= RS_MATCH;
+        }
+        return RE_MAX_STATES + d->flip;
+    }
+
+    int nst = d->nst;
+    int next = reIntern(d, n);
+    if (d->nst >= nst) {
+        // not flushed, so s is still valid
+        d->st[s].next[c] = next;
+    }
+    return next;
+}
+
+int reEndMatch(struct reDfa *d, int s) {
+    struct reState *st = &d->st[s];
+    if (!(st->flags & RS_END_KNOWN)) {
+        struct reInst *inst = d->prog->inst;
+        int n = 0;
+        ++d->gen;
+        for (int i = 0; i < st->n; ++i) {
+            if (inst[st->set[i]].op == RE_EOL) {
+                reClosure(d, st->set[i] + 1, &n, 0, 1);
+            }
+        }
+        st->flags |= RS_END_KNOWN;
+        for (int i = 0; i < n; ++i) {
+            if (inst[d->buf[i]].op == RE_MATCH) st->flags |= RS_END_MATCH;
+        }
+    }
+    return (st->flags & (RS_MATCH | RS_END_MATCH)) != 0;
+}
+
+// The earliest position at or after pos where some match ends, or -1.
+int reEarliest(struct reDfa *d, const char *s, int len, int pos) {
+    const unsigned char *u = (const unsigned char *)s;
+    struct reState *states = d->st; // never moves, only flushed
+    int st = reStartState(d, pos == 0);
+    for (int i = pos;; ++i) {
+        if (states[st].flags & RS_MATCH) return i;
+        if (i == len) return reEndMatch(d, st) ? len : -1;
+        int next = states[st].next[u[i]];
+        st = next >= 0 ? next : reNext(d, st, u[i]);
+    }
+}
+
+// The end of the longest match starting at pos, or -1.
+int reLongest(struct reDfa *d, const char *s, int len, int pos) {
+    const unsigned char *u = (const unsigned char *)s;
+    struct reState *states = d->st;
+    int st = reStartState(d, pos == 0);
+    int best = -1;
+    for (int i = pos;; ++i) {
+        if (states[st].flags & RS_MATCH) best = i;
+        if (i == len) return reEndMatch(d, st) ? len : best;
+        int next = states[st].next[u[i]];
+        st = next >= 0 ? next : reNext(d, st, u[i]);
+        if (states[st].n == 0) return best;
+    }
+}
+
+// Marks in re->at every position from lo to len where some match starts,
+// by running the reversed pattern once from the end of the row.
+void reSweep(struct regex *re, const char *s, int len, int lo) {
+    struct reDfa *d = &re->starts;
+    if (len / 8 + 1 > re->atcap) {
+        re->atcap = len / 8 + 1;
+        re->at = realloc(re->at, re->atcap);
+    }
+    memset(re->at + lo / 8, 0, len / 8 - lo / 8 + 1);
+    re->swept = s;
+    re->sweptlen = len;
+    re->sweptlo = lo;
+
+    const unsigned char *u = (const unsigned char *)s;
+    struct reState *states = d->st;
+    int st = reStartState(d, 1);
+    if (states[st].flags & RS_MATCH) re->at[len / 8] |= 1 << (len % 8);
+    for (int i = len - 1; i >= lo; --i) {
+        int next = states[st].next[u[i]];
+        st = next >= 0 ? next : reNext(d, st, u[i]);
+        if (states[st].flags & RS_MATCH) re->at[i / 8] |= 1 << (i % 8);
+    }
+    if (lo == 0 && reEndMatch(d, st)) re->at[0] |= 1;
+}
+
+// The first position at or after lo where some match starts, or -1. The
+// sweep of the previous search is used if it covers lo in the same text.
+int reLeftmost(struct regex *re, const char *s, int len, int lo) {
+    if (s != re->swept || len != re->sweptlen || lo < re->sweptlo) {
+        if (reEarliest(&re->search, s, len, lo) < 0) {
+            re->swept = NULL;
+            return -1;
+        }
+        reSweep(re, s, len, lo);
+    }
+    for (int i = lo; i <= len; ++i) {
+        if (re->at[i / 8] & (1 << (i % 8))) return i;
+    }
+    return -1;
+}
+
+// Compiles pattern, or returns NULL with *err set.
+struct regex *regexCompile(const char *pattern, const char **err) {
+    struct reParser ps = { pattern, NULL, 0, 0, 0, NULL };
+    int root = reParseAlt(&ps);
+    if (!ps.err && *ps.p == ')') ps.err = "Unmatched )";
+    if (ps.err) {
+        *err = ps.err;
+        free(ps.node);
+        return NULL;
+    }
+
+    struct regex *re = calloc(1, sizeof(struct regex));
+    re->literal = rePrefix(re, ps.node, root) && !re->anchored;
+    if (reEmit(&re->fwd, ps.node, root, 0) < 0 ||
+        reEmit(&re->rev, ps.node, root, 1) < 0) {
+        *err = "Pattern too large";
+        free(re->fwd.inst);
+        free(re->rev.inst);
+        free(re);
+        free(ps.node);
+        return NULL;
+    }
+    free(ps.node);
+    reEmitInst(&re->fwd, RE_MATCH);
+    reEmitInst(&re->rev, RE_MATCH);
+
+    reDfaInit(&re->search, &re->fwd, 1);
+    reDfaInit(&re->longest, &re->fwd, 0);
+    reDfaInit(&re->starts, &re->rev, 1);
+    return re;
+}
+
+void regexFree(struct regex *re) {
+    if (!re) return;
+    reDfaFree(&re->search);
+    reDfaFree(&re->longest);
+    reDfaFree(&re->starts);
+    free(re->at);
+    free(re->fwd.inst);
+    free(re->rev.inst);
+    free(re);
+}
+
+// Like regexSearch, for the next match along the same, unchanged text as
+// the previous search: the match starts after a position only depend on
+// the text after it, so the reverse sweep is reused and walking every
+// match of a row costs one sweep rather than one per match.
+int regexSearchNext(struct regex *re, const char *text, int len, int from,
+                    int *start, int *end) {
+    if (from > len) return 0;
+
+    int lo = from;
+    if (re->prefixlen > 0) {
+        const char *p = memmem(text + from, len - from, re->prefix, re->prefixlen);
+        if (!p) return 0;
+        lo = p - text;
+    }
+    if (re->literal) {
+        *start = lo;
+        *end = lo + re->prefixlen;
+        return 1;
+    }
+
+    if (re->anchored) {
+        if (from > 0 || lo > 0) return 0;
+    } else {
+        lo = reLeftmost(re, text, len, lo);
+        if (lo < 0) return 0;
+    }
+    int e = reLongest(&re->longest, text, len, lo);
+    if (e < 0) return 0;
+    *start = lo;
+    *end = e;
+    return 1;
+}
+
+// Finds the leftmost-longest match in text[0..len) starting at or after
+// from. A memmem prefilter on the literal prefix skips text (and most
+// rows) that can't match before any DFA runs.
+int regexSearch(struct regex *re, const char *text, int len, int from,
+                int *start, int *end) {
+    re->swept = NULL;
+    return regexSearchNext(re, text, len, from, start, end);
+}
+
+/*** search ***/
+
+// Shows every visible match of re over the text, or none when re is NULL.
+void editorSetSearchHighlight(struct regex *re) {
+    E.search_re = re;
+    ++E.search_gen;
+}
+
+// Where to look for the next match after [start, end): empty matches step
+// over one codepoint so the scan always moves.
+int editorReplaceNext(const char *text, int size, int start, int end) {
+    if (end > start) return end;
+    if (start >= size) return start + 1;
+    int cp;
+    return start + utf8Decode(&text[start], size - start, &cp);
+}
+
+// Gets the spans of row matched by the search highlight, NULL when there is
+// none. Spans are cached per screen row and found again only when the row's
+// render or the search changes, so redraws and scrolling over rows already
+// scanned cost nothing. Long chunked rows aren't scanned.
+struct matchSpans *editorMatchOverlay(erow *row) {
+    if (!E.search_re || row->chunks) return NULL;
+    struct matchSpans *ov = &E.overlay[row->idx % E.screenrows];
+    if (ov->row == row->idx && ov->version == row->version &&
+        ov->gen == E.search_gen) {
+        return ov;
+    }
+    ov->row = row->idx;
+    ov->version = row->version;
+    ov->gen = E.search_gen;
+    ov->n = 0;
+    int start, end;
+    int found = regexSearch(E.search_re, row->chars, row->size, 0, &start, &end);
+    while (found) {
+        if (end > start) {
+            if (ov->n == ov->cap) {
+                ov->cap = ov->cap ? ov->cap * 2 : 8;
+                ov->rb = memRealloc(MEM_SEARCH, ov->rb, 2 * ov->cap * sizeof(int));
+            }
+            ov->rb[2 * ov->n] = editorRowCxToRb(row, start);
+            ov->rb[2 * ov->n + 1] = editorRowCxToRb(row, end);
+            ++ov->n;
+        }
+        int pos = editorReplaceNext(row->chars, row->size, start, end);
+        found = regexSearchNext(E.search_re, row->chars, row->size, pos, &start, &end);
+    }
+    return ov;
+}
+
+void editorSearchCallback(char *query, int key){
+   static int last_match = -1;
+   static int direction = 1;
+
+   static char *compiled = NULL; // the query re was compiled from
+   static struct regex *re = NULL;
+
+    if (key == '\r' || key == '\x1b' || key == CTRL_KEY('g')){
+        last_match = -1;
+        direction = 1;
+        editorSetSearchHighlight(NULL);
+        regexFree(re);
+        re = NULL;
+        free(compiled);
+        compiled = NULL;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN ||
+               key == CTRL_KEY('n') || key == CTRL_KEY('s')){
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP ||
+               key == CTRL_KEY('p') || key == CTRL_KEY('r')){
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    if (last_match == -1){
+        direction = 1;
+    }
+    if (!compiled || strcmp(compiled, query) != 0) {
+        const char *err;
+        regexFree(re);
+        free(compiled);
+        re = regexCompile(query, &err);
+        compiled = strdup(query);
+        editorSetSearchHighlight(re);
+    }
+    if (!re) return; // incomplete pattern, wait for more input
+
+    int current = last_match;
+    for (int i = 0; i < E.buf->numrows; ++i){
+        current += direction;
+        if (current == -1) {
+            current = E.buf->numrows - 1;
+        } else if (current == E.buf->numrows) {
+            current = 0;
+        }
+        // search the raw text so cold rows needn't be thawed to be scanned
+        erow *row = &E.buf->row[current];
+        const char *text = editorRowText(row);
+        int cx, end;
+        if (regexSearch(re, text, row->size, 0, &cx, &end)) {
+            editorRowThaw(row);
+            last_match = current;
+            E.buf->cy = current;
+            E.buf->cx = cx;
+            E.buf->rowoff = E.buf->numrows;
+            break;
+        }
+    }
+}
+
+void editorSearch() {
+    int orig_cx = E.buf->cx;
+    int orig_cy = E.buf->cy;
+    int orig_coloff = E.buf->coloff;
+    int orig_rowoff = E.buf->rowoff;
+
+    char *query = editorPrompt("Search (regex): %s (ESC or C-g to Cancel | C-s to Search Forward | C-r to Search Backward)", editorSearchCallback, 0);
+
+    if (query){
+        free(E.search_last);
+        E.search_last = query;
+    } else {
+        // cancel search
+        E.buf->cx = orig_cx;
+        E.buf->cy = orig_cy;
+        E.buf->coloff = orig_coloff;
+        E.buf->rowoff = orig_rowoff;
+    }
+}
+
+/*** occur ***/
+
+// M-x occur narrows the screen to the rows matching a regexp, like Emacs
+// occur or less's &pattern, but as a view of the buffer rather than a
+// copy of it: the cursor stays on real rows, so edits go straight to them.
+// The view keeps the matching rows in a sorted array that editorScroll and
+// editorDrawRows index into, found on all cores at first and then kept up
+// to date by editorOccurSplice as rows change. The cursor's row is shown
+// even when it doesn't match, so a row edited out of the view, or one a
+// search landed on, stays put until the cursor leaves it. Edits inside
+// long chunked rows are only seen by the next M-x occur.
+
+#define CEREAL_OCCUR_MIN_RUN 16384 // fewer rows than this per thread scan on one
+
+struct occurView {
+    char *pattern;
+    struct regex *re; // for scans on the main thread
+    int *rows; // the matching rows, ascending
+    int n, cap;
+    int top; // view position shown on the first screen line
+    int pos; // view position of the cursor's row
+    int extra; // the cursor's row is in the view only because of the cursor
+};
+
+struct occurTask {
+    erow *rows;
+    int lo, hi;
+    const char *pattern;
+    int *hits; // matching rows; -1 - j for a long row j, left to the caller
+    int n, cap;
+    pthread_t thread;
+};
+
+void occurPush(struct occurTask *t, int j) {
+    if (t->n == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 256;
+        t->hits = memRealloc(MEM_SEARCH, t->hits, sizeof(int) * t->cap);
+    }
+    t->hits[t->n++] = j;
+}
+
+// Scans rows [lo, hi) with its own copy of the regexp. Cold rows are read
+// from their block's plain text when it is decompressed already, or else
+// decompressed here, since the block LRU belongs to the main thread (which
+// waits for the scan, so nothing changes under it).
+void *occurWorker(void *arg) {
+    struct occurTask *t = arg;
+    const char *err;
+    struct regex *re = regexCompile(t->pattern, &err);
+    struct rowBlock *blk = NULL;
+    char *plain = NULL;
+    for (int j = t->lo; j < t->hi; ++j) {
+        erow *row = &t->rows[j];
+        const char *text = row->chars;
+        if (row->chunks) {
+            occurPush(t, -1 - j);
+            continue;
+        }
+        if (row->blk && row->blk->plain) {
+            text = row->blk->plain + row->blkoff;
+        } else if (row->blk) {
+            if (row->blk != blk) {
+                blk = row->blk;
+                plain = realloc(plain, blk->len ? blk->len : 1);
+                lzDecompress(blk->data, blk->clen, plain);
+            }
+            text = plain + row->blkoff;
+        }
+        int start, end;
+        if (regexSearch(re, text, row->size, 0, &start, &end)) occurPush(t, j);
+    }
+    free(plain);
+    regexFree(re);
+    return NULL;
+}
+
+// Finds the rows of [lo, hi) matching the view's regexp, in order, on as
+// many threads as there are cores and rows for. Returns how many, in *out.
+int editorOccurScan(struct occurView *v, int lo, int hi, int **out) {
+    struct occurTask tasks[64];
+    int ntasks = 1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    while (ntasks < ncpu && ntasks < 64 && (hi - lo) / (ntasks + 1) >= CEREAL_OCCUR_MIN_RUN) {
+        ++ntasks;
+    }
+
+    if (ntasks == 1) {
+        // few rows, as after an edit: no threads, and the view's regexp
+        struct occurTask t = { 0 };
+        for (int j = lo; j < hi; ++j) {
+            erow *row = &E.buf->row[j];
+            int start, end;
+            if (regexSearch(v->re, editorRowText(row), row->size, 0, &start, &end)) {
+                occurPush(&t, j);
+            }
+        }
+        *out = t.hits;
+        return t.n;
+    }
+
+    for (int j = 0; j < ntasks; ++j) {
+        struct occurTask *t = &tasks[j];
+        memset(t, 0, sizeof(*t));
+        t->rows = E.buf->row;
+        t->lo = lo + (long long)(hi - lo) * j / ntasks;
+        t->hi = lo + (long long)(hi - lo) * (j + 1) / ntasks;
+        t->pattern = v->pattern;
+    }
+    // the last task runs here rather than on a thread of its own
+    for (int j = 0; j < ntasks - 1; ++j) {
+        if (pthread_create(&tasks[j].thread, NULL, occurWorker, &tasks[j]) != 0) {
+            tasks[j].thread = pthread_self();
+            occurWorker(&tasks[j]);
+        }
+    }
+    occurWorker(&tasks[ntasks - 1]);
+    int n = 0;
+    for (int j = 0; j < ntasks; ++j) {
+        if (j < ntasks - 1 && !pthread_equal(tasks[j].thread, pthread_self())) {
+            pthread_join(tasks[j].thread, NULL);
+        }
+        n += tasks[j].n;
+    }
+
+    int *hits = memAlloc(MEM_SEARCH, sizeof(int) * (n ? n : 1));
+    n = 0;
+    for (int j = 0; j < ntasks; ++j) {
+        for (int k = 0; k < tasks[j].n; ++k) {
+            int r = tasks[j].hits[k];
+            if (r < 0) {
+                erow *row = &E.buf->row[-1 - r];
+                int start, end;
+                if (!regexSearch(v->re, editorRowText(row), row->size, 0, &start, &end)) continue;
+                r = -1 - r;
+            }
+            hits[n++] = r;
+        }
+        memFree(MEM_SEARCH, tasks[j].hits);
+    }
+    *out = hits;
+    return n;
+}
+
+// Index of the first of the view's rows not before row.
+int occurLowerBound(struct occurView *v, int row) {
+    int lo = 0, hi = v->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (v->rows[mid] < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Brings the view up to date after rows [lo, old_hi) became [lo, new_hi):
+// drops the entries of the old rows, moves those after them along and
+// scans the new ones, so an edited row costs a binary search and a move.
+void editorOccurSplice(int lo, int old_hi, int new_hi) {
+    struct occurView *v = E.buf->occur;
+    if (!v) return;
+    int a = occurLowerBound(v, lo);
+    int b = occurLowerBound(v, old_hi);
+    int *hits = NULL;
+    int nh = editorOccurScan(v, lo, new_hi, &hits);
+
+    int d = new_hi - old_hi;
+    if (d) {
+        for (int k = b; k < v->n; ++k) {
+            v->rows[k] += d;
+        }
+    }
+    int n = v->n - (b - a) + nh;
+    if (n > v->cap) {
+        while (n > v->cap) {
+            v->cap = v->cap ? v->cap * 2 : 256;
+        }
+        v->rows = memRealloc(MEM_SEARCH, v->rows, sizeof(int) * v->cap);
+    }
+    memmove(&v->rows[a + nh], &v->rows[b], sizeof(int) * (v->n - b));
+    if (nh) memcpy(&v->rows[a], hits, sizeof(int) * nh);
+    v->n = n;
+    memFree(MEM_SEARCH, hits);
+}
+
+// Works out where the cursor's row sits in the view, see struct occurView.
+void editorOccurCursor(struct occurView *v) {
+    v->pos = occurLowerBound(v, E.buf->cy);
+    v->extra = E.buf->cy < E.buf->numrows &&
+        (v->pos == v->n || v->rows[v->pos] != E.buf->cy);
+}
+
+// The row at view position k, as of the last editorOccurCursor, or numrows
+// past the end of the view.
+int editorOccurRow(struct occurView *v, int k) {
+    if (v->extra && k == v->pos) return E.buf->cy;
+    if (v->extra && k > v->pos) --k;
+    return k >= 0 && k < v->n ? v->rows[k] : E.buf->numrows;
+}
+
+void editorOccurClose(struct editorBuffer *b) {
+    struct occurView *v = b->occur;
+    if (!v) return;
+    free(v->pattern);
+    regexFree(v->re);
+    memFree(MEM_SEARCH, v->rows);
+    free(v);
+    b->occur = NULL;
+}
+
+// M-x occur: shows only the rows matching a regexp, or with an empty one,
+// all of them again.
+void editorOccur() {
+    if (E.buf->hex) {
+        editorSetStatusMessage("No occur view of a binary file");
+        return;
+    }
+    char *pattern = editorPrompt("Occur (regex, empty to show all lines): %s", NULL, 1);
+    if (!pattern) return;
+    editorOccurClose(E.buf);
+    if (!*pattern) {
+        free(pattern);
+        editorSetStatusMessage("Showing all lines");
+        return;
+    }
+    const char *err;
+    struct regex *re = regexCompile(pattern, &err);
+    if (!re) {
+        editorSetStatusMessage("Invalid regex: %s", err);
+        free(pattern);
+        return;
+    }
+
+    struct occurView *v = calloc(1, sizeof(*v));
+    v->pattern = pattern;
+    v->re = re;
+    v->n = v->cap = editorOccurScan(v, 0, E.buf->numrows, &v->rows);
+    E.buf->occur = v;
+    editorSetStatusMessage("%d matching line%s", v->n, v->n == 1 ? "" : "s");
+}
+
+/*** replace ***/
+
+struct replMatch {
+    int y;
+    int start, end;
+};
+
+// Gets the region in buffer order, clamped to the buffer. Returns 0 if
+// there is no active region.
+int editorRegion(int *y0, int *x0, int *y1, int *x1) {
+    if (!E.buf->mark_active) return 0;
+
+    int my = E.buf->marky, mx = E.buf->markx;
+    if (my > E.buf->numrows) my = E.buf->numrows;
+    if (my < E.buf->numrows && mx > E.buf->row[my].size) mx = E.buf->row[my].size;
+    if (my == E.buf->numrows) mx = 0;
+
+    if (my < E.buf->cy || (my == E.buf->cy && mx < E.buf->cx)) {
+        *y0 = my;
+        *x0 = mx;
+        *y1 = E.buf->cy;
+        *x1 = E.buf->cx;
+    } else {
+        *y0 = E.buf->cy;
+        *x0 = E.buf->cx;
+        *y1 = my;
+        *x1 = mx;
+    }
+    return 1;
+}
+
+// Length of rep once \& is expanded for a match of mlen bytes.
+int editorReplacementLen(const char *rep, int mlen) {
+    int len = 0;
+    for (const char *p = rep; *p; ++p) {
+        if (p[0] == '\\' && p[1]) {
+            ++p;
+            len += (*p == '&') ? mlen : 1;
+        } else {
+            ++len;
+        }
+    }
+    return len;
+}
+
+// Writes rep to dst with \& standing for the match and \\ for a backslash.
+char *editorExpandReplacement(char *dst, const char *rep, const char *match, int mlen) {
+    for (const char *p = rep; *p; ++p) {
+        if (p[0] == '\\' && p[1]) {
+            ++p;
+            if (*p == '&') {
+                memcpy(dst, match, mlen);
+                dst += mlen;
+                continue;
+            }
+        }
+        *dst++ = *p;
+    }
+    return dst;
+}
+
+// Replaces every match of re from (y0, x0) up to (y1, *x1) with rep. All
+// matches are found first; each affected row is then rebuilt once, and a
+// single highlighting sweep runs over the rebuilt rows at the end, carrying
+// comment state only as far as it changes. *x1 is moved by the change in
+// length of row y1, and (*lasty, *lastx) is set to the end of the last
+// replacement. Returns the number of replacements.
+int editorReplaceRange(struct regex *re, const char *rep, int y0, int x0,
+                       int y1, int *x1, int *lasty, int *lastx) {
+    struct replMatch *m = NULL;
+    int n = 0, cap = 0;
+
+    for (int y = y0; y <= y1 && y < E.buf->numrows; ++y) {
+        erow *row = &E.buf->row[y];
+        const char *text = editorRowText(row);
+        int pos = (y == y0) ? x0 : 0;
+        int limit = (y == y1) ? *x1 : row->size;
+        int start, end;
+        int found = pos <= limit && regexSearch(re, text, row->size, pos, &start, &end);
+        while (found && end <= limit) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                m = realloc(m, sizeof(struct replMatch) * cap);
+            }
+            m[n].y = y;
+            m[n].start = start;
+            m[n].end = end;
+            ++n;
+            pos = editorReplaceNext(text, row->size, start, end);
+            found = pos <= limit && regexSearchNext(re, text, row->size, pos, &start, &end);
+        }
+    }
+
+    int *touched = malloc(sizeof(int) * (n ? n : 1));
+    int ntouched = 0;
+    for (int i = 0; i < n;) {
+        int y = m[i].y;
+        int j = i;
+        erow *row = &E.buf->row[y];
+        const char *text = editorRowText(row);
+
+        int len = row->size;
+        for (j = i; j < n && m[j].y == y; ++j) {
+            len += editorReplacementLen(rep, m[j].end - m[j].start) -
+                (m[j].end - m[j].start);
+        }
+
+        char *chars = memAlloc(MEM_CHARS, len + 1);
+        char *p = chars;
+        int copied = 0;
+        for (int k = i; k < j; ++k) {
+            memcpy(p, text + copied, m[k].start - copied);
+            p += m[k].start - copied;
+            p = editorExpandReplacement(p, rep, text + m[k].start,
+                                        m[k].end - m[k].start);
+            copied = m[k].end;
+            if (k == n - 1) {
+                *lasty = y;
+                *lastx = p - chars;
+            }
+        }
+        memcpy(p, text + copied, row->size - copied);
+        chars[len] = '\0';
+        if (y == y1) {
+            *x1 += len - row->size;
+        }
+
+        // text may point into a cold block or a chunked row's copy: drop
+        // them only now
+        if (row->blk) {
+            rowBlockRelease(row->blk);
+            row->blk = NULL;
+            editorNoteWarm(y);
+        }
+        if (row->chunks) {
+            editorRowFreeChunks(row);
+        }
+        memFree(MEM_CHARS, row->chars);
+        row->chars = chars;
+        row->size = len;
+        editorRowEdited(row);
+        editorUpdateRender(row);
+        ++E.buf->dirty;
+
+        touched[ntouched++] = y;
+        i = j;
+    }
+
+    // highlight the rebuilt rows, and the rows after them for as long as
+    // the comment state they pass on keeps changing
+    int carry = 0;
+    int t = 0;
+    for (int y = ntouched ? touched[0] : E.buf->numrows; y < E.buf->numrows; ++y) {
+        if (t < ntouched && touched[t] == y) {
+            ++t;
+        } else if (!carry) {
+            if (t == ntouched) break;
+            y = touched[t] - 1;
+            continue;
+        }
+        erow *row = &E.buf->row[y];
+        editorRowThawText(row);
+        carry = editorHighlightRow(row);
+    }
+
+    free(touched);
+    free(m);
+    return n;
+}
+
+// Prompts for a pattern and a replacement; returns 0 if cancelled or the
+// pattern doesn't compile.
+int editorReplacePrompt(const char *what, struct regex **re, char **rep) {
+    char prompt[80];
+    snprintf(prompt, sizeof(prompt), "%s regexp: %%s", what);
+    char *query = editorPrompt(prompt, NULL, 0);
+    if (!query) return 0;
+
+    const char *err;
+    *re = regexCompile(query, &err);
+    free(query);
+    if (!*re) {
+        editorSetStatusMessage("Bad regexp: %s", err);
+        return 0;
+    }
+
+    snprintf(prompt, sizeof(prompt), "%s with: %%s", what);
+    *rep = editorPrompt(prompt, NULL, 1);
+    if (!*rep) {
+        regexFree(*re);
+        return 0;
+    }
+    return 1;
+}
+
+// Replaces all matches in the region, or in the whole buffer.
+void editorReplaceAll() {
+    struct regex *re;
+    char *rep;
+    if (!editorReplacePrompt("Replace", &re, &rep)) return;
+
+    int y0 = 0, x0 = 0, y1 = E.buf->numrows, x1 = 0;
+    editorRegion(&y0, &x0, &y1, &x1);
+    E.buf->mark_active = 0;
+
+    int lasty = E.buf->cy, lastx = E.buf->cx;
+    int n = editorReplaceRange(re, rep, y0, x0, y1, &x1, &lasty, &lastx);
+    if (n > 0) {
+        E.buf->cy = lasty;
+        E.buf->cx = lastx;
+    }
+    editorSetStatusMessage("Replaced %d occurrence%s", n, n == 1 ? "" : "s");
+    regexFree(re);
+    free(rep);
+}
+
+// Steps through the matches from the cursor to the end of the buffer (or
+// through the region), asking at each one.
+void editorQueryReplace() {
+    struct regex *re;
+    char *rep;
+    if (!editorReplacePrompt("Query replace", &re, &rep)) return;
+
+    int y = E.buf->cy, x = E.buf->cx, y1 = E.buf->numrows, x1 = 0;
+    editorRegion(&y, &x, &y1, &x1);
+    E.buf->mark_active = 0;
+    editorSetSearchHighlight(re);
+
+    int count = 0;
+    while (y <= y1 && y < E.buf->numrows) {
+        erow *row = &E.buf->row[y];
+        const char *text = editorRowText(row);
+        int limit = (y == y1) ? x1 : row->size;
+        int start, end;
+        if (x > limit || !regexSearch(re, text, row->size, x, &start, &end) ||
+            end > limit) {
+            ++y;
+            x = 0;
+            continue;
+        }
+
+        editorRowThaw(row);
+        E.buf->cy = y;
+        E.buf->cx = start;
+        editorSetStatusMessage("Query replacing: (y)es, (n)o, (!) all, (.) last, (q)uit");
+        editorRefreshScreen();
+        int key = editorReadKey();
+
+        int ly = y, lx = start;
+        if (key == '!') {
+            count += editorReplaceRange(re, rep, y, start, y1, &x1, &ly, &lx);
+            E.buf->cy = ly;
+            E.buf->cx = lx;
+            break;
+        } else if (key == 'y' || key == ' ' || key == '.') {
+            int e = end;
+            count += editorReplaceRange(re, rep, y, start, y, &e, &ly, &lx);
+            if (y == y1) x1 += e - end;
+            E.buf->cx = lx;
+            if (key == '.') break;
+            row = &E.buf->row[y];
+            x = (start == end) ? editorReplaceNext(editorRowText(row), row->size, lx, lx) : lx;
+        } else if (key == 'n' || key == BACKSPACE || key == DEL_KEY) {
+            x = editorReplaceNext(editorRowText(row), row->size, start, end);
+        } else if (key == 'q' || key == '\r' || key == '\x1b' ||
+                   key == CTRL_KEY('g')) {
+            break;
+        }
+    }
+
+    editorSetSearchHighlight(NULL);
+    editorSetStatusMessage("Replaced %d occurrence%s", count, count == 1 ? "" : "s");
+    regexFree(re);
+    free(rep);
+}
+
+/*** kill ring ***/
+
+// Copies the text from (y0, x0) to (y1, x1), rows joined by newlines.
+// Cold rows are read from their blocks, not thawed.
+char *editorRangeText(int y0, int x0, int y1, int x1, int *len) {
+    int total = 0;
+    for (int y = y0; y <= y1; ++y) {
+        total += E.buf->row[y].size + 1;
+    }
+    char *buf = malloc(total);
+    int n = 0;
+    for (int y = y0; y <= y1; ++y) {
+        erow *row = &E.buf->row[y];
+        int from = y == y0 ? x0 : 0;
+        int to = y == y1 ? x1 : row->size;
+        memcpy(buf + n, editorRowText(row) + from, to - from);
+        n += to - from;
+        if (y < y1) buf[n++] = '\n';
+    }
+    *len = n;
+    return buf;
+}
+
+// Deletes the text from (y0, x0) to (y1, x1): the rows in between go in
+// one editorDelRows, and the first and last rows are joined.
+void editorDelRange(int y0, int x0, int y1, int x1) {
+    if (y0 == y1) {
+        editorRowDelChars(&E.buf->row[y0], x0, x1 - x0);
+        return;
+    }
+    erow *last = &E.buf->row[y1];
+    int taillen = last->size - x1;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, editorRowText(last) + x1, taillen);
+    editorDelRows(y0 + 1, y1 - y0);
+
+    erow *row = &E.buf->row[y0];
+    editorRowThaw(row);
+    editorRowFlatten(row);
+    row->size = x0;
+    row->chars[x0] = '\0';
+    editorRowAppendString(row, tail, taillen);
+    free(tail);
+}
+
+// Inserts text at the cursor and leaves the cursor after it. The rows it
+// adds go in one editorInsertRows.
+void editorInsertText(const char *text, int len) {
+    if (E.buf->cy == E.buf->numrows) {
+        editorInsertRow(E.buf->numrows, "", 0);
+    }
+    erow *row = &E.buf->row[E.buf->cy];
+    editorRowThaw(row);
+    editorRowFlatten(row);
+    int taillen = row->size - E.buf->cx;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, row->chars + E.buf->cx, taillen);
+    row->size = E.buf->cx;
+    row->chars[row->size] = '\0';
+
+    const char *end = text + len;
+    const char *nl = memchr(text, '\n', len);
+    if (!nl) {
+        editorRowAppendString(row, (char *)text, len);
+        editorRowAppendString(&E.buf->row[E.buf->cy], tail, taillen);
+        E.buf->cx += len;
+        free(tail);
+        return;
+    }
+    editorRowAppendString(row, (char *)text, nl - text);
+
+    int n = 0, cap = 64;
+    char **lines = malloc(sizeof(char *) * cap);
+    int *lens = malloc(sizeof(int) * cap);
+    for (const char *p = nl + 1;; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if (n == cap) {
+            cap *= 2;
+            lines = realloc(lines, sizeof(char *) * cap);
+            lens = realloc(lens, sizeof(int) * cap);
+        }
+        lines[n] = (char *)p;
+        lens[n++] = (nl ? nl : end) - p;
+        if (!nl) break;
+    }
+
+    // the last line takes the rest of the row the text went into
+    int lastlen = lens[n - 1];
+    char *last = malloc(lastlen + taillen);
+    memcpy(last, lines[n - 1], lastlen);
+    memcpy(last + lastlen, tail, taillen);
+    lines[n - 1] = last;
+    lens[n - 1] = lastlen + taillen;
+    editorInsertRows(E.buf->cy + 1, lines, lens, n);
+
+    E.buf->cy += n;
+    E.buf->cx = lastlen;
+    free(last);
+    free(lines);
+    free(lens);
+    free(tail);
+}
+
+// Puts text at the front of the kill ring, dropping the oldest entry when
+// it is full. Entries are compressed like cold rows, so killing a large
+// block of a log costs a fraction of its size.
+void editorKillPush(const char *text, int len) {
+    if (E.nkills == CEREAL_KILL_RING) {
+        free(E.kills[E.nkills - 1].data);
+    } else {
+        ++E.nkills;
+    }
+    memmove(&E.kills[1], &E.kills[0], sizeof(E.kills[0]) * (E.nkills - 1));
+    struct killEntry *k = &E.kills[0];
+    k->len = len;
+    k->data = malloc(LZ_BOUND(len));
+    k->clen = lzCompress(text, len, k->data);
+    k->data = realloc(k->data, k->clen);
+}
+
+// Gets the region for C-w and M-w, with an end on the line past the last
+// row moved to the end of that row. Returns 0 if it is empty or unset.
+int editorKillRange(int *y0, int *x0, int *y1, int *x1) {
+    if (!editorRegion(y0, x0, y1, x1)) {
+        editorSetStatusMessage("The mark is not set now");
+        return 0;
+    }
+    E.buf->mark_active = 0;
+    if (*y0 == E.buf->numrows) return 0;
+    if (*y1 == E.buf->numrows) {
+        *y1 = E.buf->numrows - 1;
+        *x1 = E.buf->row[*y1].size;
+    }
+    return 1;
+}
+
+void editorCopyRegion() {
+    int y0, x0, y1, x1, len;
+    if (!editorKillRange(&y0, &x0, &y1, &x1)) return;
+    char *text = editorRangeText(y0, x0, y1, x1, &len);
+    editorKillPush(text, len);
+    free(text);
+}
+
+void editorKillRegion() {
+    int y0, x0, y1, x1, len;
+    if (!editorKillRange(&y0, &x0, &y1, &x1)) return;
+    char *text = editorRangeText(y0, x0, y1, x1, &len);
+    editorKillPush(text, len);
+    free(text);
+    editorDelRange(y0, x0, y1, x1);
+    E.buf->cy = y0;
+    E.buf->cx = x0;
+}
+
+// Inserts kill ring entry k at the cursor and remembers where, for M-y.
+void editorYankEntry(int k) {
+    struct killEntry *e = &E.kills[k];
+    char *text = malloc(e->len + 1);
+    lzDecompress(e->data, e->clen, text);
+    E.yank_y = E.buf->cy;
+    E.yank_x = E.buf->cx;
+    editorInsertText(text, e->len);
+    free(text);
+    E.yank_buf = E.buf;
+    E.yank_ey = E.buf->cy;
+    E.yank_ex = E.buf->cx;
+    E.yank_dirty = E.buf->dirty;
+    E.yank_idx = k;
+}
+
+void editorYank() {
+    if (E.nkills == 0) {
+        editorSetStatusMessage("Kill ring is empty");
+        return;
+    }
+    editorYankEntry(0);
+}
+
+// Replaces the text just yanked with the next older kill.
+void editorYankPop() {
+    if (E.yank_buf != E.buf || E.buf->dirty != E.yank_dirty ||
+        E.buf->cy != E.yank_ey || E.buf->cx != E.yank_ex) {
+        editorSetStatusMessage("Previous command was not a yank");
+        return;
+    }
+    editorDelRange(E.yank_y, E.yank_x, E.buf->cy, E.buf->cx);
+    E.buf->cy = E.yank_y;
+    E.buf->cx = E.yank_x;
+    editorYankEntry((E.yank_idx + 1) % E.nkills);
+}
+
+/*** sorting ***/
+
+// M-x sort-lines and friends reorder the erow structs themselves: the keys
+// (a pointer to each row's text) are sorted by a merge sort split across
+// threads, and the rows are then permuted in place, so no line is copied
+// and cold rows stay compressed. keep-lines, flush-lines and uniq-lines
+// drop rows in one compacting pass.
+
+#define CEREAL_SORT_MIN_RUN 65536 // fewer keys than this per thread sort on one
+#define CEREAL_SORT_INSERTION 16
+
+struct sortKey {
+    const char *s; // the text compared, up to the end of the row
+    int len;
+    int row; // relative to the first row sorted
+    uint64_t prefix; // the first 8 bytes, big-endian, to spare most memcmps
+    double num; // for numeric sorts
+};
+
+struct sortTask {
+    struct sortKey *keys;
+    struct sortKey *tmp;
+    int lo, mid, hi; // sorts [lo, hi), or merges its sorted halves if mid >= 0
+    int numeric;
+    pthread_t thread;
+};
+
+int sortCompare(const struct sortKey *a, const struct sortKey *b, int numeric) {
+    if (numeric) return a->num < b->num ? -1 : a->num > b->num;
+    if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+    int n = a->len < b->len ? a->len : b->len;
+    int c = memcmp(a->s, b->s, n);
+    return c ? c : a->len - b->len;
+}
+
+// Merges the sorted runs [lo, mid) and [mid, hi) through tmp. Ties take the
+// left run first, which keeps the sort stable.
+void sortMerge(struct sortKey *keys, struct sortKey *tmp, int lo, int mid,
+               int hi, int numeric) {
+    int i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) {
+        tmp[k++] = sortCompare(&keys[j], &keys[i], numeric) < 0 ? keys[j++] : keys[i++];
+    }
+    while (i < mid) tmp[k++] = keys[i++];
+    while (j < hi) tmp[k++] = keys[j++];
+    memcpy(keys + lo, tmp + lo, sizeof(keys[0]) * (hi - lo));
+}
+
+void sortRange(struct sortKey *keys, struct sortKey *tmp, int lo, int hi,
+               int numeric) {
+    if (hi - lo <= CEREAL_SORT_INSERTION) {
+        for (int i = lo + 1; i < hi; ++i) {
+            struct sortKey k = keys[i];
+            int j = i;
+            for (; j > lo && sortCompare(&k, &keys[j - 1], numeric) < 0; --j) {
+                keys[j] = keys[j - 1];
+            }
+            keys[j] = k;
+        }
+        return;
+    }
+    int mid = lo + (hi - lo) / 2;
+    sortRange(keys, tmp, lo, mid, numeric);
+    sortRange(keys, tmp, mid, hi, numeric);
+    if (sortCompare(&keys[mid], &keys[mid - 1], numeric) >= 0) return;
+    sortMerge(keys, tmp, lo, mid, hi, numeric);
+}
+
+void *sortWorker(void *arg) {
+    struct sortTask *t = arg;
+    if (t->mid < 0) {
+        sortRange(t->keys, t->tmp, t->lo, t->hi, t->numeric);
+    } else {
+        sortMerge(t->keys, t->tmp, t->lo, t->mid, t->hi, t->numeric);
+    }
+    return NULL;
+}
+
+// Sorts keys on a power of two number of threads: each sorts a run, then
+// rounds of merges pair the runs up until one is left.
+void sortKeys(struct sortKey *keys, int n, int numeric) {
+    struct sortKey *tmp = malloc(sizeof(keys[0]) * (n ? n : 1));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nruns = 1;
+    while (nruns * 2 <= ncpu && nruns < 64 && n / (nruns * 2) >= CEREAL_SORT_MIN_RUN) {
+        nruns *= 2;
+    }
+
+    struct sortTask tasks[64];
+    int bounds[65];
+    for (int j = 0; j <= nruns; ++j) {
+        bounds[j] = (long long)n * j / nruns;
+    }
+    for (int width = 1; width <= nruns; width *= 2) {
+        int ntasks = nruns / width;
+        for (int j = 0; j < ntasks; ++j) {
+            struct sortTask *t = &tasks[j];
+            t->keys = keys;
+            t->tmp = tmp;
+            t->lo = bounds[j * width];
+            t->hi = bounds[(j + 1) * width];
+            t->mid = width == 1 ? -1 : bounds[j * width + width / 2];
+            t->numeric = numeric;
+        }
+        // the last task runs here rather than on a thread of its own
+        for (int j = 0; j < ntasks - 1; ++j) {
+            if (pthread_create(&tasks[j].thread, NULL, sortWorker, &tasks[j]) != 0) {
+                tasks[j].thread = pthread_self();
+                sortWorker(&tasks[j]);
+            }
+        }
+        sortWorker(&tasks[ntasks - 1]);
+        for (int j = 0; j < ntasks - 1; ++j) {
+            if (!pthread_equal(tasks[j].thread, pthread_self())) {
+                pthread_join(tasks[j].thread, NULL);
+            }
+        }
+    }
+    free(tmp);
+}
+
+// Parses the number a numeric sort compares: an optional sign, digits and
+// a fraction, anything else counting as 0, like sort -n.
+double sortNumber(const char *s, int len) {
+    int i = 0, neg = 0;
+    if (i < len && (s[i] == '-' || s[i] == '+')) neg = s[i++] == '-';
+    double v = 0;
+    for (; i < len && isdigit((unsigned char)s[i]); ++i) {
+        v = v * 10 + (s[i] - '0');
+    }
+    if (i < len && s[i] == '.') {
+        double scale = 0.1;
+        for (++i; i < len && isdigit((unsigned char)s[i]); ++i) {
+            v += (s[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return neg ? -v : v;
+}
+
+// Gets the rows a sort or filter works on: those the region touches, not
+// counting a last row it ends at the start of, or else the whole buffer.
+void editorLineRange(int *y0, int *y1) {
+    int x0, x1;
+    *y0 = 0;
+    *y1 = E.buf->numrows;
+    if (editorRegion(y0, &x0, y1, &x1)) {
+        if (*y1 > *y0 && x1 == 0) --*y1;
+        ++*y1;
+        if (*y1 > E.buf->numrows) *y1 = E.buf->numrows;
+    }
+    E.buf->mark_active = 0;
+}
+
+// Fixes up what depends on the order of rows [y0, y1) once they have been
+// moved about or thinned out. entry[j - y0] is the multi-line comment state
+// row j used to start in, and handed what the rows used to hand on to row
+// y1; only rows starting in another state now are highlighted again.
+void editorRowsMoved(int y0, int y1, const unsigned char *entry, int handed) {
+    struct editorBuffer *b = E.buf;
+    for (int j = y0; j < y1; ++j) {
+        b->row[j].idx = j;
+    }
+    for (int j = y0; j < y1; ++j) {
+        erow *row = &b->row[j];
+        int in_comment = j > 0 && b->row[j - 1].hl_open_comment;
+        if (in_comment == entry[j - y0]) continue;
+        editorRowThawText(row);
+        editorHighlightRow(row);
+    }
+    int now = y1 > 0 && b->row[y1 - 1].hl_open_comment;
+    if (y1 < b->numrows && now != handed) {
+        editorRowThawText(&b->row[y1]);
+        editorUpdateSyntax(&b->row[y1]);
+    }
+
+    ++b->dirty;
+    if (y0 < b->brk_valid) b->brk_valid = y0;
+    if (y1 > y0) {
+        editorOutlineDirty(y0);
+        editorOutlineDirty(y1 - 1);
+        editorNoteWarm(y0);
+        editorNoteWarm(y1 - 1);
+    }
+    b->cy = y0 < b->numrows ? y0 : b->numrows;
+    b->cx = 0;
+}
+
+// The multi-line comment state each row of [y0, y1) starts in.
+unsigned char *editorRowEntries(int y0, int y1) {
+    unsigned char *entry = malloc(y1 - y0 + 1);
+    for (int j = y0; j < y1; ++j) {
+        entry[j - y0] = j > 0 && E.buf->row[j - 1].hl_open_comment;
+    }
+    return entry;
+}
+
+// Sorts rows [y0, y1) by field (1 for the whole row), as text or as numbers.
+void editorSortRows(int y0, int y1, int field, int numeric) {
+    struct editorBuffer *b = E.buf;
+    int n = y1 - y0;
+    if (n < 2) return;
+    editorUpdateStaleRows();
+
+    // warm rows and rows of a mapped file are read in place; other cold
+    // rows are copied out, since their blocks may be dropped from the LRU
+    size_t cold = 0;
+    for (int j = y0; j < y1; ++j) {
+        erow *row = &b->row[j];
+        if (row->blk && !row->blk->mapped) cold += row->size;
+    }
+    char *arena = malloc(cold ? cold : 1);
+    size_t used = 0;
+    struct sortKey *keys = malloc(sizeof(keys[0]) * n);
+    for (int j = 0; j < n; ++j) {
+        erow *row = &b->row[y0 + j];
+        const char *text = editorRowText(row);
+        if (row->blk && !row->blk->mapped) {
+            memcpy(arena + used, text, row->size);
+            text = arena + used;
+            used += row->size;
+        }
+        int i = 0;
+        for (int f = 1; f < field; ++f) {
+            while (i < row->size && isspace((unsigned char)text[i])) ++i;
+            while (i < row->size && !isspace((unsigned char)text[i])) ++i;
+        }
+        if (field > 1 || numeric) {
+            while (i < row->size && isspace((unsigned char)text[i])) ++i;
+        }
+        keys[j].s = text + i;
+        keys[j].len = row->size - i;
+        keys[j].row = j;
+        keys[j].prefix = 0;
+        for (int k = 0; k < 8; ++k) {
+            unsigned char c = k < keys[j].len ? keys[j].s[k] : 0;
+            keys[j].prefix = keys[j].prefix << 8 | c;
+        }
+        keys[j].num = numeric ? sortNumber(text + i, row->size - i) : 0;
+    }
+
+    sortKeys(keys, n, numeric);
+
+    int *perm = malloc(sizeof(int) * n);
+    for (int j = 0; j < n; ++j) {
+        perm[j] = keys[j].row;
+    }
+    free(keys);
+    free(arena);
+
+    unsigned char *old = editorRowEntries(y0, y1);
+    unsigned char *entry = malloc(n);
+    for (int j = 0; j < n; ++j) {
+        entry[j] = old[perm[j]];
+    }
+    int handed = b->row[y1 - 1].hl_open_comment;
+
+    // follow each cycle of the permutation, moving every row once
+    erow *rows = &b->row[y0];
+    for (int i = 0; i < n; ++i) {
+        if (perm[i] < 0 || perm[i] == i) continue;
+        erow first = rows[i];
+        int j = i;
+        for (;;) {
+            int k = perm[j];
+            perm[j] = -1;
+            if (k == i) {
+                rows[j] = first;
+                break;
+            }
+            rows[j] = rows[k];
+            j = k;
+        }
+    }
+
+    editorOccurSplice(y0, y1, y1);
+    editorFoldRelease(y0, y1);
+    editorRowsMoved(y0, y1, entry, handed);
+    free(perm);
+    free(old);
+    free(entry);
+}
+
+// Drops the rows of [y0, y1) whose keep[j - y0] is 0, compacting the rest
+// in one pass. Returns the number of rows dropped.
+int editorFilterRows(int y0, int y1, const unsigned char *keep) {
+    struct editorBuffer *b = E.buf;
+    editorUpdateStaleRows();
+    unsigned char *entry = malloc(y1 - y0 + 1);
+    int prev = y0 > 0 && b->row[y0 - 1].hl_open_comment;
+    int w = y0;
+    for (int j = y0; j < y1; ++j) {
+        int in_comment = prev;
+        prev = b->row[j].hl_open_comment;
+        if (keep[j - y0]) {
+            entry[w - y0] = in_comment;
+            b->row[w++] = b->row[j];
+        } else {
+            editorFreeRow(&b->row[j]);
+        }
+    }
+    int dropped = y1 - w;
+    if (dropped == 0) {
+        free(entry);
+        return 0;
+    }
+    memmove(&b->row[w], &b->row[y1], sizeof(erow) * (b->numrows - y1));
+    b->numrows -= dropped;
+    for (int j = y1 - dropped; j < b->numrows; ++j) {
+        b->row[j].idx = j;
+    }
+
+    editorOutlineShift(w, -dropped);
+    editorOccurSplice(y0, y1, w);
+    editorFoldRelease(y0, y1);
+    editorFoldDelete(w, dropped);
+    if (b->mark_active) b->marky = editorDelBound(b->marky, w, dropped);
+    b->warm_hi = editorDelBound(b->warm_hi, w, dropped);
+    b->stale_lo = editorDelBound(b->stale_lo, w, dropped);
+    b->stale_hi = editorDelBound(b->stale_hi, w, dropped);
+    b->ws_hi = editorDelBound(b->ws_hi, w, dropped);
+    editorRowsMoved(y0, w, entry, prev);
+    free(entry);
+    return dropped;
+}
+
+// Asks for the field a sort keys on, counting from 1. Returns 0 if cancelled.
+int editorSortField() {
+    char *s = editorPrompt("Sort on field: %s", NULL, 0);
+    if (!s) return 0;
+    char *end;
+    long f = strtol(s, &end, 10);
+    if (*end || f < 1 || f > INT_MAX) {
+        editorSetStatusMessage("Not a field: %s", s);
+        f = 0;
+    }
+    free(s);
+    return f;
+}
+
+void editorSortLinesBy(int field, int numeric) {
+    int y0, y1;
+    editorLineRange(&y0, &y1);
+    editorSortRows(y0, y1, field, numeric);
+    editorSetStatusMessage("Sorted %d lines", y1 - y0);
+}
+
+void editorSortLines() {
+    editorSortLinesBy(1, 0);
+}
+
+void editorSortFields() {
+    int field = editorSortField();
+    if (field) editorSortLinesBy(field, 0);
+}
+
+void editorSortNumericFields() {
+    int field = editorSortField();
+    if (field) editorSortLinesBy(field, 1);
+}
+
+// Drops each row that repeats the one before it, like uniq(1).
+void editorUniqLines() {
+    int y0, y1;
+    editorLineRange(&y0, &y1);
+    if (y1 - y0 < 2) return;
+    unsigned char *keep = malloc(y1 - y0);
+    keep[0] = 1;
+    // copied, as the next editorRowText may evict its block
+    int plen = E.buf->row[y0].size;
+    char *prev = malloc(plen + 1);
+    memcpy(prev, editorRowText(&E.buf->row[y0]), plen);
+    for (int j = y0 + 1; j < y1; ++j) {
+        erow *row = &E.buf->row[j];
+        const char *text = editorRowText(row);
+        keep[j - y0] = row->size != plen || memcmp(text, prev, plen);
+        if (keep[j - y0]) {
+            prev = realloc(prev, row->size + 1);
+            memcpy(prev, text, row->size);
+            plen = row->size;
+        }
+    }
+    free(prev);
+    int n = editorFilterRows(y0, y1, keep);
+    free(keep);
+    editorSetStatusMessage("Deleted %d duplicate line%s", n, n == 1 ? "" : "s");
+}
+
+// Keeps (or with flush, drops) the rows matching a regex.
+void editorFilterLines(int flush) {
+    char *pattern = editorPrompt(flush ? "Flush lines matching: %s" : "Keep lines matching: %s", NULL, 0);
+    if (!pattern) return;
+    const char *err;
+    struct regex *re = regexCompile(pattern, &err);
+    if (!re) {
+        editorSetStatusMessage("Bad regexp: %s", err);
+        free(pattern);
+        return;
+    }
+    free(pattern);
+
+    int y0, y1;
+    editorLineRange(&y0, &y1);
+    unsigned char *keep = malloc(y1 - y0 + 1);
+    for (int j = y0; j < y1; ++j) {
+        erow *row = &E.buf->row[j];
+        int start, end;
+        int match = regexSearch(re, editorRowText(row), row->size, 0, &start, &end);
+        keep[j - y0] = match != flush;
+    }
+    regexFree(re);
+    int n = editorFilterRows(y0, y1, keep);
+    free(keep);
+    editorSetStatusMessage("Deleted %d line%s", n, n == 1 ? "" : "s");
+}
+
+void editorKeepLines() {
+    editorFilterLines(0);
+}
+
+void editorFlushLines() {
+    editorFilterLines(1);
+}
+
+/*** multiple cursors ***/
+
+// Besides cx, cy a buffer can have extra cursors, added by M-x
+// add-cursor-at-next-match and add-cursors-in-column. A key that types,
+// deletes, breaks a line or moves is then applied at every cursor in row
+// order as one batch: row updates are deferred as during a macro replay
+// (see editorDeferRow), so a row is rendered and highlighted once however
+// many cursors are on it, and Enter or a join at the start of rows moves
+// the row array once (see editorSplitRows). Other keys act at cx, cy
+// alone, and once anything else edits the buffer the extra cursors go.
+
+int cursorCompare(const void *a, const void *b) {
+    const struct editorCursor *x = a, *y = b;
+    if (x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+    return (x->cx > y->cx) - (x->cx < y->cx);
+}
+
+void editorCursorsClear(struct editorBuffer *b) {
+    free(b->cursors);
+    b->cursors = NULL;
+    b->ncursors = b->cursorcap = 0;
+}
+
+// The extra cursors are still where they were put, or are dropped.
+int editorCursorsValid() {
+    if (E.buf->ncursors && E.buf->dirty != E.buf->cursors_dirty) {
+        editorCursorsClear(E.buf);
+    }
+    return E.buf->ncursors > 0;
+}
+
+void editorCursorAdd(int cx, int cy) {
+    struct editorBuffer *b = E.buf;
+    if (b->ncursors == b->cursorcap) {
+        b->cursorcap = b->cursorcap ? b->cursorcap * 2 : 16;
+        b->cursors = realloc(b->cursors, sizeof(b->cursors[0]) * b->cursorcap);
+    }
+    b->cursors[b->ncursors++] = (struct editorCursor){ cx, cy };
+}
+
+// Sorts the extra cursors, dropping any on top of another or of cx, cy.
+void editorCursorsTidy() {
+    struct editorBuffer *b = E.buf;
+    struct editorCursor self = { b->cx, b->cy };
+    qsort(b->cursors, b->ncursors, sizeof(b->cursors[0]), cursorCompare);
+    int n = 0;
+    for (int j = 0; j < b->ncursors; ++j) {
+        struct editorCursor *c = &b->cursors[j];
+        if (!cursorCompare(c, &self)) continue;
+        if (n > 0 && !cursorCompare(c, &b->cursors[n - 1])) continue;
+        b->cursors[n++] = *c;
+    }
+    b->ncursors = n;
+    b->cursors_dirty = b->dirty;
+}
+
+// The first extra cursor on row y or after it.
+int editorCursorsFrom(int y) {
+    int lo = 0, hi = E.buf->ncursors;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (E.buf->cursors[mid].cy < y) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Render bytes of row where extra cursors are drawn, in order, into *rb.
+// Returns how many.
+int editorCursorCells(erow *row, int **rb) {
+    struct editorBuffer *b = E.buf;
+    if (!b->ncursors || b->dirty != b->cursors_dirty || row->chunks) return 0;
+    int n = 0;
+    for (int j = editorCursorsFrom(row->idx); j < b->ncursors && b->cursors[j].cy == row->idx; ++j) {
+        *rb = realloc(*rb, sizeof(int) * (n + 1));
+        int cx = b->cursors[j].cx < row->size ? b->cursors[j].cx : row->size;
+        (*rb)[n++] = editorRowCxToRb(row, cx);
+    }
+    return n;
+}
+
+// Gets the highlight of render byte j with the cursors of rb drawn over
+// it, *k walking rb as j grows.
+unsigned char editorCursorHl(const int *rb, int n, int *k, int j, unsigned char hl) {
+    while (*k < n && rb[*k] < j) ++*k;
+    return *k < n && rb[*k] == j ? HL_CURSOR : hl;
+}
+
+// Drops cursors that are on top of another from all[0..*n), keeping track
+// of *self, the index of cx, cy.
+void cursorsUnique(struct editorCursor *all, int *n, int *self) {
+    int m = 0;
+    for (int j = 0; j < *n; ++j) {
+        if (m > 0 && !cursorCompare(&all[j], &all[m - 1])) {
+            if (j == *self) *self = m - 1;
+            continue;
+        }
+        if (j == *self) *self = m;
+        all[m++] = all[j];
+    }
+    *n = m;
+}
+
+// Moves every cursor in all[0..n) as key would move cx, cy.
+void cursorsMove(struct editorCursor *all, int n, int key) {
+    struct editorBuffer *b = E.buf;
+    for (int k = 0; k < n; ++k) {
+        b->cx = all[k].cx;
+        b->cy = all[k].cy;
+        if (key == HOME_KEY) {
+            b->cx = 0;
+        } else if (key == END_KEY) {
+            if (b->cy < b->numrows) b->cx = b->row[b->cy].size;
+        } else {
+            editorMoveCursor(key);
+        }
+        all[k] = (struct editorCursor){ b->cx, b->cy };
+    }
+}
+
+// Deletes the character before every cursor in all[0..n): within rows
+// first, then every join of a row onto the one before in one go.
+void cursorsDelete(struct editorCursor *all, int n) {
+    struct editorBuffer *b = E.buf;
+    int *ys = calloc(n, sizeof(int)), *offs = calloc(n, sizeof(int));
+    int njoin = 0, prev = -1, shift = 0;
+    for (int k = 0; k < n; ++k) {
+        struct editorCursor *c = &all[k];
+        if (c->cy != prev) {
+            prev = c->cy;
+            shift = 0;
+        }
+        c->cx += shift;
+        if (c->cy >= b->numrows) continue;
+        if (c->cx > 0) {
+            b->cx = c->cx;
+            b->cy = c->cy;
+            editorDelChar();
+            shift += b->cx - c->cx;
+            c->cx = b->cx;
+        } else if (c->cy > 0) {
+            ys[njoin++] = c->cy;
+        }
+    }
+    editorJoinRows(ys, njoin, offs);
+    for (int k = 0, j = 0; k < n; ++k) {
+        struct editorCursor *c = &all[k];
+        while (j < njoin && ys[j] < c->cy) ++j;
+        if (j < njoin && ys[j] == c->cy) {
+            c->cx += offs[j];
+            c->cy -= j + 1;
+        } else {
+            c->cy -= j;
+        }
+    }
+    free(ys);
+    free(offs);
+}
+
+// Breaks the line at every cursor in all[0..n).
+void cursorsNewline(struct editorCursor *all, int n) {
+    struct editorBuffer *b = E.buf;
+    int *ys = calloc(n, sizeof(int)), *xs = calloc(n, sizeof(int));
+    int nsplit = 0;
+    for (int k = 0; k < n; ++k) {
+        if (all[k].cy < b->numrows) {
+            ys[nsplit] = all[k].cy;
+            xs[nsplit++] = all[k].cx;
+        }
+    }
+    editorSplitRows(ys, xs, nsplit);
+    for (int k = 0; k < n; ++k) {
+        if (k < nsplit) {
+            all[k].cy += k + 1;
+            all[k].cx = 0;
+        } else {
+            // past the end, as editorInsertNewline would
+            editorInsertRow(b->numrows, "", 0);
+            all[k].cy = b->numrows;
+        }
+    }
+    free(ys);
+    free(xs);
+}
+
+// Types c at every cursor in all[0..n).
+void cursorsInsert(struct editorCursor *all, int n, int c) {
+    struct editorBuffer *b = E.buf;
+    int prev = -1, shift = 0;
+    for (int k = 0; k < n; ++k) {
+        if (all[k].cy != prev) {
+            prev = all[k].cy;
+            shift = 0;
+        }
+        b->cx = all[k].cx + shift;
+        b->cy = all[k].cy;
+        editorInsertChar(c);
+        shift = b->cx - all[k].cx;
+        all[k] = (struct editorCursor){ b->cx, b->cy };
+    }
+}
+
+// Applies key c at every cursor when there are extra ones. Returns 0 if c
+// is left to cx, cy alone.
+int editorCursorsKey(int c) {
+    struct editorBuffer *b = E.buf;
+    if (!editorCursorsValid()) return 0;
+    switch (c) {
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case HOME_KEY:
+    case END_KEY:
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DEL_KEY:
+        break;
+    case '\r':
+        if (b->enter) return 0;
+        break;
+    default:
+        if (c >= 256 || (iscntrl(c) && c != '\t')) return 0;
+    }
+
+    int n = b->ncursors + 1, self;
+    struct editorCursor *all = b->cursors;
+    b->cursors = malloc(sizeof(all[0]) * b->cursorcap);
+    all = realloc(all, sizeof(all[0]) * n);
+    all[n - 1] = (struct editorCursor){ b->cx, b->cy };
+    // the extra cursors are sorted, so cx, cy just goes in its place
+    for (self = n - 1; self > 0 && cursorCompare(&all[self - 1], &all[self]) > 0; --self) {
+        struct editorCursor t = all[self];
+        all[self] = all[self - 1];
+        all[self - 1] = t;
+    }
+
+    E.batch = 1;
+    if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) {
+        if (c == DEL_KEY) {
+            cursorsMove(all, n, ARROW_RIGHT);
+            cursorsUnique(all, &n, &self);
+        }
+        cursorsDelete(all, n);
+    } else if (c == '\r') {
+        cursorsNewline(all, n);
+    } else if (c < 256) {
+        cursorsInsert(all, n, c);
+    } else {
+        cursorsMove(all, n, c);
+    }
+    E.batch = 0;
+    if (E.macro_pos < 0) editorUpdateStaleRows();
+
+    b->cx = all[self].cx;
+    b->cy = all[self].cy;
+    b->ncursors = 0;
+    for (int k = 0; k < n; ++k) {
+        if (k != self) b->cursors[b->ncursors++] = all[k];
+    }
+    free(all);
+    editorCursorsTidy();
+    return 1;
+}
+
+// M-x add-cursor-at-next-match: adds a cursor at the next match of the last
+// search after the last cursor. The screen follows the new cursor, which
+// is the one keys that aren't applied at every cursor move.
+void editorAddCursorAtNextMatch() {
+    struct editorBuffer *b = E.buf;
+    if (!E.search_last) {
+        editorSetStatusMessage("No previous search");
+        return;
+    }
+    const char *err;
+    struct regex *re = regexCompile(E.search_last, &err);
+    if (!re) {
+        editorSetStatusMessage("Bad regexp: %s", err);
+        return;
+    }
+    struct editorCursor last = { b->cx, b->cy };
+    if (editorCursorsValid() && cursorCompare(&b->cursors[b->ncursors - 1], &last) > 0) {
+        last = b->cursors[b->ncursors - 1];
+    }
+
+    int found = 0, start = 0, end;
+    for (int y = last.cy; y < b->numrows && !found; ++y) {
+        erow *row = &b->row[y];
+        const char *text = editorRowText(row);
+        int pos = y == last.cy ? last.cx : 0;
+        int match = regexSearch(re, text, row->size, pos, &start, &end);
+        while (match) {
+            if (y > last.cy || start > last.cx) {
+                editorCursorAdd(b->cx, b->cy);
+                editorRowThaw(row);
+                b->cy = y;
+                b->cx = start;
+                found = 1;
+                break;
+            }
+            pos = editorReplaceNext(text, row->size, start, end);
+            match = regexSearchNext(re, text, row->size, pos, &start, &end);
+        }
+    }
+    regexFree(re);
+    if (!found) {
+        editorSetStatusMessage("No more matches for %s", E.search_last);
+        return;
+    }
+    editorCursorsTidy();
+    editorSetStatusMessage("%d cursors", b->ncursors + 1);
+}
+
+// M-x add-cursors-in-column: adds a cursor on every row from the mark to
+// the cursor, at the cursor's column or the end of rows short of it.
+void editorAddCursorsInColumn() {
+    struct editorBuffer *b = E.buf;
+    if (!b->mark_active) {
+        editorSetStatusMessage("The mark is not set");
+        return;
+    }
+    editorCursorsValid();
+    int rx = 0;
+    if (b->cy < b->numrows) {
+        editorRowThaw(&b->row[b->cy]);
+        rx = editorRowCxToRx(&b->row[b->cy], b->cx);
+    }
+    int y0 = b->marky < b->cy ? b->marky : b->cy;
+    int y1 = b->marky < b->cy ? b->cy : b->marky;
+    if (y1 >= b->numrows) y1 = b->numrows - 1;
+    for (int y = y0; y <= y1; ++y) {
+        if (y == b->cy) continue;
+        erow *row = &b->row[y];
+        editorRowThaw(row);
+        editorCursorAdd(editorRowRxToCx(row, rx), y);
+    }
+    b->mark_active = 0;
+    editorCursorsTidy();
+    editorSetStatusMessage("%d cursors", b->ncursors + 1);
+}
+
+/*** append buffer ***/
+
+struct abuf {
+    char *b;
+    int len;
+};
+
+#define ABUF_INIT                               \
+    { NULL, 0 }
+
+// append buffer ab
+void abAppend(struct abuf *ab, const char *s, int len) {
+    char *new = memRealloc(MEM_OUTPUT, ab->b, ab->len + len);
+
+    if (new == NULL) {
+        return;
+    }
+
+    // copy from s to new
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab) { memFree(MEM_OUTPUT, ab->b); }
+
+/*** hex view ***/
+
+// A file with a NUL in its first CEREAL_BINARY_PROBE bytes opens in a hex
+// view instead of as rows of text. The file is mmapped and only the lines
+// on screen are formatted, 16 bytes each, so the kernel pages in just
+// what is looked at. Typing hex digits (or, after Tab, characters in the
+// right-hand column) overwrites bytes in place; the new values are kept
+// aside, by offset, until C-x C-s writes each run of them back with
+// pwrite. Enter asks for an offset to jump to.
+
+#define CEREAL_BINARY_PROBE 8192
+
+struct hexEdit {
+    off_t off;
+    unsigned char val;
+};
+
+struct hexView {
+    unsigned char *map; // the file as last saved
+    off_t size;
+    int digits; // of the offsets shown
+    struct hexEdit *edits; // bytes overwritten since, by offset
+    int nedits, editcap;
+    int nibble; // the low half of the byte at the cursor is next
+    int ascii; // typing goes to the character column
+};
+
+// Whether s[0..len) holds a NUL byte.
+int editorHasNul(const char *s, size_t len) {
+    size_t j = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 64 <= len; j += 64) {
+        __m128i v = _mm_min_epu8(
+            _mm_min_epu8(_mm_loadu_si128((const __m128i *)(s + j)),
+                         _mm_loadu_si128((const __m128i *)(s + j + 16))),
+            _mm_min_epu8(_mm_loadu_si128((const __m128i *)(s + j + 32)),
+                         _mm_loadu_si128((const __m128i *)(s + j + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) return 1;
+    }
+    for (; j + 16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) return 1;
+    }
+#endif
+    for (; j < len; ++j) {
+        if (s[j] == '\0') return 1;
+    }
+    return 0;
+}
+
+// Whether the file open at fd looks binary.
+int editorIsBinary(int fd) {
+    char probe[CEREAL_BINARY_PROBE];
+    ssize_t n = pread(fd, probe, sizeof(probe), 0);
+    return n > 0 && editorHasNul(probe, n);
+}
+
+// The index in h->edits of the first edit at or after off.
+int editorHexFindEdit(struct hexView *h, off_t off) {
+    int lo = 0, hi = h->nedits;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (h->edits[mid].off < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+unsigned char editorHexByte(struct hexView *h, off_t off) {
+    int k = editorHexFindEdit(h, off);
+    if (k < h->nedits && h->edits[k].off == off) return h->edits[k].val;
+    return h->map[off];
+}
+
+void editorHexSetByte(struct hexView *h, off_t off, unsigned char val) {
+    int k = editorHexFindEdit(h, off);
+    if (k == h->nedits || h->edits[k].off != off) {
+        if (h->nedits == h->editcap) {
+            h->editcap = h->editcap ? h->editcap * 2 : 64;
+            h->edits = realloc(h->edits, sizeof(h->edits[0]) * h->editcap);
+        }
+        memmove(&h->edits[k + 1], &h->edits[k], sizeof(h->edits[0]) * (h->nedits - k));
+        ++h->nedits;
+        h->edits[k].off = off;
+    }
+    h->edits[k].val = val;
+    ++E.buf->dirty;
+}
+
+int editorHexLines(struct hexView *h) {
+    return (h->size + 15) / 16;
+}
+
+// Screen column of the cursor: on the nibble being typed in the hex
+// column, or on the character in the right-hand one.
+int editorHexColumn(struct hexView *h) {
+    int base = h->digits + 2;
+    if (h->ascii) return base + 16 * 3 + 3 + E.buf->cx;
+    return base + E.buf->cx * 3 + (E.buf->cx >= 8) + h->nibble;
+}
+
+// Shows the file open at fd, of size st->st_size, in a hex view.
+// Returns 0 if it can't be mapped.
+int editorHexOpen(int fd, struct stat *st) {
+    void *map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return 0;
+
+    struct hexView *h = calloc(1, sizeof(*h));
+    h->map = map;
+    h->size = st->st_size;
+    h->digits = 8;
+    while (h->digits < 16 && ((uint64_t)(h->size - 1) >> (4 * h->digits))) {
+        ++h->digits;
+    }
+    E.buf->hex = h;
+    E.buf->syntax = NULL;
+    E.buf->enter = editorHexGotoOffset;
+    return 1;
+}
+
+void editorHexClose() {
+    struct hexView *h = E.buf->hex;
+    if (!h) return;
+    munmap(h->map, h->size);
+    free(h->edits);
+    free(h);
+    E.buf->hex = NULL;
+    E.buf->enter = NULL;
+}
+
+// Writes the overwritten bytes back, one pwrite per run of adjacent ones.
+void editorHexSave() {
+    struct hexView *h = E.buf->hex;
+    int fd = open(E.buf->filename, O_WRONLY);
+    if (fd == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+    unsigned char run[4096];
+    int written = 0;
+    for (int k = 0; k < h->nedits;) {
+        int n = 0;
+        off_t start = h->edits[k].off;
+        while (k < h->nedits && n < (int)sizeof(run) && h->edits[k].off == start + n) {
+            run[n++] = h->edits[k++].val;
+        }
+        if (pwrite(fd, run, n, start) != n) {
+            editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+            close(fd);
+            return;
+        }
+        written += n;
+    }
+    editorNoteFileStat(fd);
+    close(fd);
+    // the shared mapping now shows the new bytes itself
+    h->nedits = 0;
+    E.buf->dirty = 0;
+    editorSetStatusMessage("%d bytes written to disk", written);
+}
+
+void editorHexGotoOffset() {
+    struct hexView *h = E.buf->hex;
+    char *s = editorPrompt("Goto offset (hex): %s", NULL, 0);
+    if (!s) return;
+    char *end;
+    unsigned long long off = strtoull(s, &end, 16);
+    if (*end != '\0' || off >= (unsigned long long)h->size) {
+        editorSetStatusMessage("Bad offset: %s", s);
+    } else {
+        E.buf->cy = off / 16;
+        E.buf->cx = off % 16;
+        h->nibble = 0;
+        E.buf->rowoff = E.buf->cy > E.screenrows / 2 ? E.buf->cy - E.screenrows / 2 : 0;
+    }
+    free(s);
+}
+
+// Draws line y of the screen: an offset, 16 bytes in hex and the same as
+// characters, overwritten ones in red.
+void editorHexDrawRow(struct abuf *ab, int y) {
+    struct hexView *h = E.buf->hex;
+    int line = E.buf->rowoff + y;
+    if (line >= editorHexLines(h)) {
+        abAppend(ab, "~", 1);
+        return;
+    }
+    off_t start = (off_t)line * 16;
+    int n = h->size - start < 16 ? h->size - start : 16;
+    unsigned char bytes[16];
+    unsigned char edited[16] = { 0 };
+    memcpy(bytes, h->map + start, n);
+    for (int k = editorHexFindEdit(h, start); k < h->nedits && h->edits[k].off < start + n; ++k) {
+        bytes[h->edits[k].off - start] = h->edits[k].val;
+        edited[h->edits[k].off - start] = 1;
+    }
+
+    char buf[256];
+    int hexat[16]; // column of the hex of each byte
+    int len = snprintf(buf, sizeof(buf), "%0*llx  ", h->digits, (unsigned long long)start);
+    for (int j = 0; j < 16; ++j) {
+        hexat[j] = len;
+        if (j < n) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%02x ", bytes[j]);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len, "   ");
+        }
+        if (j == 7) buf[len++] = ' ';
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, " |");
+    for (int j = 0; j < n; ++j) {
+        buf[len++] = isprint(bytes[j]) ? bytes[j] : '.';
+    }
+    buf[len++] = '|';
+
+    // clipped to the screen like text rows; colors go around the hex of
+    // overwritten bytes
+    int cols = len < E.screencols ? len : E.screencols;
+    int pos = 0;
+    for (int j = 0; j < n && hexat[j] < cols; ++j) {
+        if (!edited[j]) continue;
+        int end = hexat[j] + 2 < cols ? hexat[j] + 2 : cols;
+        char color[16];
+        int clen = snprintf(color, sizeof(color), "\x1b[%dm", editorSyntaxToColor(HL_NUMBER));
+        abAppend(ab, buf + pos, hexat[j] - pos);
+        abAppend(ab, color, clen);
+        abAppend(ab, buf + hexat[j], end - hexat[j]);
+        abAppend(ab, "\x1b[39m", 5);
+        pos = end;
+    }
+    abAppend(ab, buf + pos, cols - pos);
+}
+
+// Handles key c in a hex view; returns 0 for keys that mean the same as
+// anywhere else.
+int editorHexProcessKey(int c) {
+    struct hexView *h = E.buf->hex;
+    int lines = editorHexLines(h);
+    int last = (h->size - 1) % 16; // column of the last byte, on the last line
+
+    switch (c) {
+    case CTRL_KEY('q'):
+    case CTRL_KEY('x'):
+    case CTRL_KEY('l'):
+    case CTRL_KEY('g'):
+    case META_KEY('x'):
+        return 0;
+
+    case '\t':
+        h->ascii = !h->ascii;
+        h->nibble = 0;
+        break;
+
+    case ARROW_LEFT:
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+        if (h->nibble) {
+            h->nibble = 0;
+        } else if (E.buf->cx > 0) {
+            --E.buf->cx;
+        } else if (E.buf->cy > 0) {
+            --E.buf->cy;
+            E.buf->cx = 15;
+        }
+        break;
+    case ARROW_RIGHT:
+        h->nibble = 0;
+        if (E.buf->cx < 15) {
+            ++E.buf->cx;
+        } else if (E.buf->cy + 1 < lines) {
+            ++E.buf->cy;
+            E.buf->cx = 0;
+        }
+        break;
+    case ARROW_UP:
+        if (E.buf->cy > 0) --E.buf->cy;
+        break;
+    case ARROW_DOWN:
+        if (E.buf->cy + 1 < lines) ++E.buf->cy;
+        break;
+    case PAGE_UP:
+        E.buf->cy = E.buf->cy > E.screenrows ? E.buf->cy - E.screenrows : 0;
+        break;
+    case PAGE_DOWN:
+        E.buf->cy = E.buf->cy + E.screenrows < lines ? E.buf->cy + E.screenrows : lines - 1;
+        break;
+    case HOME_KEY:
+        E.buf->cx = 0;
+        h->nibble = 0;
+        break;
+    case END_KEY:
+        E.buf->cx = 15;
+        h->nibble = 0;
+        break;
+
+    default: {
+        off_t off = (off_t)E.buf->cy * 16 + E.buf->cx;
+        if (c >= 256 || off >= h->size) break;
+        if (h->ascii) {
+            if (!isprint(c)) break;
+            editorHexSetByte(h, off, c);
+            editorHexProcessKey(ARROW_RIGHT);
+        } else if (isxdigit(c)) {
+            int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+            unsigned char b = editorHexByte(h, off);
+            b = h->nibble ? (b & 0xf0) | v : (b & 0x0f) | (v << 4);
+            editorHexSetByte(h, off, b);
+            if (h->nibble) {
+                editorHexProcessKey(ARROW_RIGHT);
+            } else {
+                h->nibble = 1;
+            }
+        }
+        break;
+    }
+    }
+
+    // the last line may be short
+    if (E.buf->cy == lines - 1 && E.buf->cx > last) {
+        E.buf->cx = last;
+        h->nibble = 0;
+    }
+    return 1;
+}
+
+/*** grep ***/
+
+// M-x grep searches every file under a directory. A pool of threads walks
+// the tree: each works from the bottom of its own deque of paths and, once
+// that is empty, steals from the top of the others'. Files with a NUL in
+// their first CEREAL_GREP_PROBE bytes count as binary and are skipped; the
+// rest are mmapped and scanned, jumping between occurrences of the
+// pattern's literal prefix when it has one. Matching lines stream into a
+// *grep* buffer as path:line:text, added a batch at a time from the key
+// read loop so the editor stays responsive, and Enter there visits one.
+
+#define CEREAL_GREP_PROBE 8192
+#define CEREAL_GREP_BATCH 10000 // rows added to *grep* per tick
+#define CEREAL_GREP_TEXT 512 // bytes of a matching line shown
+#define CEREAL_GREP_MMAP_MIN (256 * 1024) // smaller files are just read
+
+struct grepItem {
+    char *path;
+    int dir;
+};
+
+struct grepDeque {
+    pthread_mutex_t lock;
+    struct grepItem *items; // [head, tail); the owner pushes and pops at tail
+    int head, tail, cap;
+};
+
+struct grepJob;
+
+struct grepWorker {
+    struct grepJob *job;
+    int id;
+    struct regex *re; // its own: a regex's DFA caches can't be shared
+    char *buf; // for files too small to be worth mapping
+    size_t bufcap;
+    pthread_t thread;
+};
+
+struct grepJob {
+    int nworkers;
+    struct grepWorker *workers;
+    struct grepDeque *deques; // one per worker
+    atomic_int pending; // paths queued or being searched
+    atomic_int running; // workers not yet done
+    atomic_int cancel;
+    atomic_long files;
+    atomic_long matches;
+
+    pthread_mutex_t out_lock;
+    char *out; // result lines, each ending in \n, not yet in buf
+    size_t out_len, out_cap;
+
+    struct editorBuffer *buf;
+};
+
+void grepPush(struct grepDeque *d, char *path, int dir) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        memmove(d->items, d->items + d->head, sizeof(d->items[0]) * (d->tail - d->head));
+        d->tail -= d->head;
+        d->head = 0;
+        if (d->tail == d->cap) {
+            d->cap = d->cap ? d->cap * 2 : 64;
+            d->items = realloc(d->items, sizeof(d->items[0]) * d->cap);
+        }
+    }
+    d->items[d->tail].path = path;
+    d->items[d->tail].dir = dir;
+    ++d->tail;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Takes a path from the owner's end of d, or with steal from the other.
+int grepPop(struct grepDeque *d, struct grepItem *it, int steal) {
+    pthread_mutex_lock(&d->lock);
+    int ok = d->head < d->tail;
+    if (ok) {
+        *it = steal ? d->items[d->head++] : d->items[--d->tail];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+long grepCountNewlines(const char *s, size_t len) {
+    long n = 0;
+    size_t j = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; j + 16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+#endif
+    for (; j < len; ++j) {
+        n += s[j] == '\n';
+    }
+    return n;
+}
+
+// Queues the entries of directory path, skipping hidden ones (.git and
+// the like) and anything that is neither a directory nor a regular file.
+void grepDir(struct grepWorker *w, const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    size_t plen = strlen(path);
+    int slash = plen > 0 && path[plen - 1] == '/';
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.') continue;
+        char *child = malloc(plen + strlen(de->d_name) + 2);
+        sprintf(child, "%s%s%s", path, slash ? "" : "/", de->d_name);
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            type = lstat(child, &st) == -1 ? DT_UNKNOWN :
+                S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG) {
+            free(child);
+            continue;
+        }
+        atomic_fetch_add(&w->job->pending, 1);
+        grepPush(&w->job->deques[w->id], child, type == DT_DIR);
+    }
+    closedir(dir);
+}
+
+// Appends the matching lines of file path to out.
+void grepFile(struct grepWorker *w, const char *path, struct abuf *out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    char *map;
+    int mapped = size >= CEREAL_GREP_MMAP_MIN;
+    if (mapped) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return;
+    } else {
+        // a read costs less than setting up and tearing down a mapping
+        if (w->bufcap < size) {
+            w->bufcap = size * 2 > CEREAL_GREP_MMAP_MIN ? size * 2 : CEREAL_GREP_MMAP_MIN;
+            w->buf = realloc(w->buf, w->bufcap);
+        }
+        ssize_t n = read(fd, w->buf, size);
+        close(fd);
+        if (n <= 0) return;
+        map = w->buf;
+        size = n;
+    }
+    if (editorHasNul(map, size < CEREAL_GREP_PROBE ? size : CEREAL_GREP_PROBE)) {
+        if (mapped) munmap(map, size);
+        return;
+    }
+    atomic_fetch_add(&w->job->files, 1);
+
+    struct regex *re = w->re;
+    const char *name = strncmp(path, "./", 2) ? path : path + 2;
+    const char *end = map + size;
+    const char *p = map;
+    const char *counted = map; // newlines before here are in lineno
+    long lineno = 1;
+    while (p < end) {
+        const char *line = p;
+        if (re->prefixlen > 0) {
+            const char *hit = memmem(p, end - p, re->prefix, re->prefixlen);
+            if (!hit) break;
+            const char *nl = memrchr(p, '\n', hit - p);
+            line = nl ? nl + 1 : p;
+        }
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        int start, stop;
+        if (eol - line <= INT_MAX &&
+            regexSearch(re, line, eol - line, 0, &start, &stop)) {
+            lineno += grepCountNewlines(counted, line - counted);
+            counted = line;
+            int len = eol - line;
+            if (len > 0 && line[len - 1] == '\r') --len;
+            if (len > CEREAL_GREP_TEXT) len = CEREAL_GREP_TEXT;
+            char head[32];
+            int hlen = snprintf(head, sizeof(head), ":%ld:", lineno);
+            abAppend(out, name, strlen(name));
+            abAppend(out, head, hlen);
+            abAppend(out, line, len);
+            abAppend(out, "\n", 1);
+            atomic_fetch_add(&w->job->matches, 1);
+        }
+        p = eol + 1;
+    }
+    if (mapped) munmap(map, size);
+}
+
+void *grepWorker(void *arg) {
+    struct grepWorker *w = arg;
+    struct grepJob *job = w->job;
+    struct abuf out = ABUF_INIT;
+
+    while (!atomic_load(&job->cancel)) {
+        struct grepItem it;
+        int got = grepPop(&job->deques[w->id], &it, 0);
+        for (int k = 1; !got && k < job->nworkers; ++k) {
+            got = grepPop(&job->deques[(w->id + k) % job->nworkers], &it, 1);
+        }
+        if (!got) {
+            // everything is queued or being searched by someone else
+            if (atomic_load(&job->pending) == 0) break;
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        if (it.dir) {
+            grepDir(w, it.path);
+        } else {
+            grepFile(w, it.path, &out);
+        }
+        free(it.path);
+
+        if (out.len > 0) {
+            pthread_mutex_lock(&job->out_lock);
+            if (job->out_len + out.len > job->out_cap) {
+                job->out_cap = (job->out_len + out.len) * 2;
+                job->out = realloc(job->out, job->out_cap);
+            }
+            memcpy(job->out + job->out_len, out.b, out.len);
+            job->out_len += out.len;
+            pthread_mutex_unlock(&job->out_lock);
+            out.len = 0;
+        }
+        atomic_fetch_sub(&job->pending, 1);
+    }
+    abFree(&out);
+    atomic_fetch_sub(&job->running, 1);
+    return NULL;
+}
+
+// Waits for the workers of E.grep to finish and frees it.
+void editorGrepFree() {
+    struct grepJob *job = E.grep;
+    for (int j = 0; j < job->nworkers; ++j) {
+        pthread_join(job->workers[j].thread, NULL);
+        regexFree(job->workers[j].re);
+        free(job->workers[j].buf);
+        struct grepDeque *d = &job->deques[j];
+        for (int k = d->head; k < d->tail; ++k) {
+            free(d->items[k].path);
+        }
+        free(d->items);
+        pthread_mutex_destroy(&d->lock);
+    }
+    pthread_mutex_destroy(&job->out_lock);
+    free(job->out);
+    free(job->workers);
+    free(job->deques);
+    free(job);
+    E.grep = NULL;
+}
+
+// Stops the grep in progress if its results go to b, or with b NULL in any
+// case.
+void editorGrepStop(struct editorBuffer *b) {
+    if (!E.grep || (b && E.grep->buf != b)) return;
+    atomic_store(&E.grep->cancel, 1);
+    editorGrepFree();
+}
+
+// Moves up to CEREAL_GREP_BATCH new results into the *grep* buffer.
+// Returns 1 if the screen needs redrawing.
+int editorGrepPoll() {
+    struct grepJob *job = E.grep;
+    if (!job) return 0;
+    int done = atomic_load(&job->running) == 0;
+
+    pthread_mutex_lock(&job->out_lock);
+    size_t len = 0;
+    int rows = 0;
+    while (len < job->out_len && rows < CEREAL_GREP_BATCH) {
+        len = (char *)memchr(job->out + len, '\n', job->out_len - len) - job->out + 1;
+        ++rows;
+    }
+    char *chunk = NULL;
+    if (len > 0) {
+        chunk = malloc(len);
+        memcpy(chunk, job->out, len);
+        memmove(job->out, job->out + len, job->out_len - len);
+        job->out_len -= len;
+    }
+    int more = job->out_len > 0;
+    pthread_mutex_unlock(&job->out_lock);
+
+    struct editorBuffer *cur = E.buf;
+    E.buf = job->buf;
+    for (char *p = chunk; p < chunk + len;) {
+        char *nl = memchr(p, '\n', chunk + len - p);
+        editorInsertRow(E.buf->numrows, p, nl - p);
+        p = nl + 1;
+    }
+    E.buf->dirty = 0;
+    E.buf = cur;
+    free(chunk);
+
+    if (done && !more) {
+        editorSetStatusMessage("Grep finished: %ld matches in %ld files",
+                               (long)atomic_load(&job->matches),
+                               (long)atomic_load(&job->files));
+        editorGrepFree();
+        return 1;
+    }
+    return rows > 0 && job->buf == E.buf;
+}
+
+// Enter in *grep*: visits the file and line of the result under the cursor.
+void editorGrepVisit() {
+    if (E.buf->cy >= E.buf->numrows) return;
+    erow *row = &E.buf->row[E.buf->cy];
+    char *text = strndup(editorRowText(row), row->size);
+
+    // path:line:text; the first :digits: ends the path
+    char *sep = text;
+    long line = 0;
+    while ((sep = strchr(sep, ':'))) {
+        char *endp;
+        line = strtol(sep + 1, &endp, 10);
+        if (endp > sep + 1 && *endp == ':' && isdigit((unsigned char)sep[1])) break;
+        ++sep;
+    }
+    if (!sep || line < 1) {
+        editorSetStatusMessage("No match on this line");
+        free(text);
+        return;
+    }
+    *sep = '\0';
+
+    struct editorBuffer *results = E.buf;
+    editorVisitFile(text);
+    free(text);
+    if (E.buf == results) return; // couldn't open it
+
+    E.buf->cy = line - 1 < E.buf->numrows ? line - 1 : E.buf->numrows;
+    E.buf->cx = 0;
+    E.buf->rowoff = E.buf->cy > E.screenrows / 2 ? E.buf->cy - E.screenrows / 2 : 0;
+}
+
+// Starts searching the files under root (a directory if dir, else a
+// regular file) for pattern, a valid regex, into the *grep* buffer. Takes
+// root.
+void editorGrepStart(const char *pattern, char *root, int dir) {
+    editorGrepStop(NULL);
+    int j;
+    for (j = 0; j < E.nbufs && !(E.bufs[j]->name && !strcmp(E.bufs[j]->name, "*grep*")); ++j);
+    if (j < E.nbufs) {
+        editorSwitchToBuffer(j);
+        editorCloseFile();
+    } else {
+        editorNewBuffer();
+        E.buf->name = strdup("*grep*");
+        E.buf->enter = editorGrepVisit;
+    }
+    E.frame_valid = 0;
+
+    struct grepJob *job = calloc(1, sizeof(*job));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    job->nworkers = ncpu < 1 ? 1 : ncpu > 64 ? 64 : ncpu;
+    job->workers = calloc(job->nworkers, sizeof(job->workers[0]));
+    job->deques = calloc(job->nworkers, sizeof(job->deques[0]));
+    job->buf = E.buf;
+    pthread_mutex_init(&job->out_lock, NULL);
+    atomic_store(&job->pending, 1);
+    atomic_store(&job->running, job->nworkers);
+    for (j = 0; j < job->nworkers; ++j) {
+        const char *err;
+        pthread_mutex_init(&job->deques[j].lock, NULL);
+        job->workers[j].job = job;
+        job->workers[j].id = j;
+        job->workers[j].re = regexCompile(pattern, &err);
+    }
+    editorSetStatusMessage("Grepping for %s in %s...", pattern, root);
+    grepPush(&job->deques[0], root, dir);
+    E.grep = job;
+    for (j = 0; j < job->nworkers; ++j) {
+        pthread_create(&job->workers[j].thread, NULL, grepWorker, &job->workers[j]);
+    }
+}
+
+void editorGrep() {
+    char *pattern = editorPrompt("Grep (regex): %s", NULL, 0);
+    if (!pattern) return;
+    const char *err;
+    struct regex *re = regexCompile(pattern, &err);
+    if (!re) {
+        editorSetStatusMessage("Invalid regex: %s", err);
+        free(pattern);
+        return;
+    }
+    regexFree(re);
+
+    // default to the directory of the file being edited
+    char def[PATH_MAX] = ".";
+    if (E.buf->filename && strrchr(E.buf->filename, '/')) {
+        snprintf(def, sizeof(def), "%.*s",
+                 (int)(strrchr(E.buf->filename, '/') - E.buf->filename + 1),
+                 E.buf->filename);
+    }
+    char quoted[2 * PATH_MAX];
+    char prompt[2 * PATH_MAX + 32];
+    editorPromptQuote(quoted, sizeof(quoted), def);
+    snprintf(prompt, sizeof(prompt), "In directory (default %s): %%s", quoted);
+    char *root = editorPrompt(prompt, NULL, 1);
+    if (!root) {
+        free(pattern);
+        return;
+    }
+    if (!root[0]) {
+        free(root);
+        root = strdup(def);
+    }
+    struct stat st;
+    int found = stat(root, &st) == 0;
+    if (!found || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+        editorSetStatusMessage("Can't grep %s: %s", root,
+                               found ? "not a file or directory" : strerror(errno));
+        free(root);
+        free(pattern);
+        return;
+    }
+    editorGrepStart(pattern, root, S_ISDIR(st.st_mode));
+    free(pattern);
+}
+
+/*** diff ***/
+
+// What changed since the file was opened or saved. Every row knows the
+// line of the file it came from (orig, -1 for one inserted since) and
+// whether it has been edited, and the buffer keeps a hash of every line
+// of the file. A row's change marker (editorDiffMark) then costs a hash of
+// that row if it was edited and nothing otherwise, so the gutter follows
+// each keystroke at the cost of the keystroke. M-x diff-buffer-with-file
+// diffs the rows against the file as it is on disk now, by Myers'
+// algorithm in linear space over line hashes, into a *diff* buffer.
+
+#define CEREAL_DIFF_CONTEXT 3
+#define CEREAL_DIFF_MAX_COST 4096 // edits per split before giving up on one
+
+enum diffMark {
+    DIFF_NONE,
+    DIFF_ADDED,
+    DIFF_CHANGED,
+    DIFF_DELETED // lines of the file deleted just before this row
+};
+
+// Forgets the file's line hashes; nbase -1 has them read from the file
+// when they are needed, 0 makes it empty.
+void editorDiffReset(int nbase) {
+    free(E.buf->base);
+    E.buf->base = NULL;
+    E.buf->nbase = nbase;
+    E.buf->basecap = 0;
+}
+
+// editorHashLine of a row's text. A chunked row is hashed chunk by chunk,
+// so drawing its change marker doesn't copy it out.
+uint64_t editorRowHash(erow *row) {
+    if (!row->chunks) return editorHashLine(editorRowText(row), row->size);
+    uint64_t h = editorHashLine("", 0);
+    for (int k = 0; k < row->chunks->n; ++k) {
+        h = editorHashMore(h, row->chunks->c[k].s, row->chunks->c[k].len);
+    }
+    return h;
+}
+
+// Takes row as it is now to be what is on disk, as a line of a file being
+// read or followed.
+void editorDiffSetBase(erow *row) {
+    struct editorBuffer *b = E.buf;
+    if (b->nbase < 0) return;
+    if (row->orig < 0) {
+        if (b->nbase == b->basecap) {
+            b->basecap = b->basecap ? 2 * b->basecap : 1024;
+            b->base = realloc(b->base, sizeof(uint64_t) * b->basecap);
+        }
+        row->orig = b->nbase++;
+    }
+    b->base[row->orig] = editorRowHash(row);
+    row->edited = 0;
+}
+
+// The rows were just written out as buf, one per line.
+void editorDiffRebase(const char *buf) {
+    struct editorBuffer *b = E.buf;
+    free(b->base);
+    b->basecap = b->numrows ? b->numrows : 1;
+    b->base = malloc(sizeof(uint64_t) * b->basecap);
+    b->nbase = b->numrows;
+    for (int j = 0; j < b->numrows; ++j) {
+        erow *row = &b->row[j];
+        b->base[j] = editorHashLine(buf, row->size);
+        buf += row->size + 1;
+        row->orig = j;
+        row->edited = 0;
+    }
+}
+
+// Reads the file as it is on disk into lines: *text holds it, each line's
+// start and length go in *starts and *lens. Returns the number of lines, or
+// -1 if it can't be read.
+int editorDiffReadFile(const char *filename, char **text, int **starts, int **lens) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size > INT_MAX) {
+        close(fd);
+        return -1;
+    }
+    int size = st.st_size, got = 0;
+    char *buf = malloc(size ? size : 1);
+    while (got < size) {
+        ssize_t r = read(fd, buf + got, size - got);
+        if (r <= 0) break;
+        got += r;
+    }
+    close(fd);
+
+    int n = 0, cap = 0;
+    *starts = NULL;
+    *lens = NULL;
+    for (int at = 0; at < got;) {
+        char *nl = memchr(buf + at, '\n', got - at);
+        int end = nl ? nl - buf : got;
+        int len = end - at;
+        if (len > 0 && buf[end - 1] == '\r') --len;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            *starts = realloc(*starts, sizeof(int) * cap);
+            *lens = realloc(*lens, sizeof(int) * cap);
+        }
+        (*starts)[n] = at;
+        (*lens)[n++] = len;
+        at = end + 1;
+    }
+    *text = buf;
+    return n;
+}
+
+// Hashes the file's lines for a buffer opened through its index, as long
+// as the file is still the one that was opened. Returns 0 if it isn't.
+int editorDiffBase() {
+    struct editorBuffer *b = E.buf;
+    if (b->nbase >= 0) return 1;
+    if (!b->filename) return 0;
+    struct stat st;
+    if (stat(b->filename, &st) == -1 || st.st_size != b->file_size ||
+        st.st_mtim.tv_sec != b->file_mtime.tv_sec ||
+        st.st_mtim.tv_nsec != b->file_mtime.tv_nsec) {
+        return 0;
+    }
+    char *text;
+    int *starts, *lens;
+    int n = editorDiffReadFile(b->filename, &text, &starts, &lens);
+    if (n < 0) return 0;
+    b->basecap = n ? n : 1;
+    b->base = malloc(sizeof(uint64_t) * b->basecap);
+    for (int j = 0; j < n; ++j) {
+        b->base[j] = editorHashLine(text + starts[j], lens[j]);
+    }
+    b->nbase = n;
+    free(text);
+    free(starts);
+    free(lens);
+    return 1;
+}
+
+// The change marker of row y: added, changed, or unchanged but with lines
+// of the file deleted just before it (or after it, for the last row).
+int editorDiffMark(int y) {
+    struct editorBuffer *b = E.buf;
+    erow *row = &b->row[y];
+    if (row->orig < 0) return DIFF_ADDED;
+    if (row->edited) {
+        if (!editorDiffBase() || row->orig >= b->nbase) return DIFF_CHANGED;
+        if (b->base[row->orig] != editorRowHash(row)) {
+            return DIFF_CHANGED;
+        }
+    }
+    int prev = y > 0 ? b->row[y - 1].orig : -1;
+    if (y > 0 && prev < 0) return DIFF_NONE; // part of what was added
+    if (row->orig > prev + 1) return DIFF_DELETED;
+    if (y == b->numrows - 1 && b->nbase >= 0 && row->orig < b->nbase - 1) {
+        return DIFF_DELETED;
+    }
+    return DIFF_NONE;
+}
+
+// M-x diff-gutter shows the change markers in a column left of the text.
+void editorToggleGutter() {
+    E.buf->gutter = !E.buf->gutter;
+    E.frame_valid = 0;
+}
+
+struct diffHunk {
+    int a, alen; // lines of the file replaced
+    int b, blen; // by these rows
+};
+
+struct diffCtx {
+    const uint64_t *a, *b;
+    int *vf, *vb; // the furthest reaching paths, indexed from -(n + m)
+    int ai, bj; // where the last run of equal lines ended
+    struct diffHunk *hunks;
+    int nhunks, hunkcap;
+};
+
+// The lines a[ai..i) and b[bj..j) differ, and len lines from (i, j) on
+// are equal.
+void diffEqual(struct diffCtx *c, int i, int j, int len) {
+    if (i > c->ai || j > c->bj) {
+        if (c->nhunks == c->hunkcap) {
+            c->hunkcap = c->hunkcap ? c->hunkcap * 2 : 64;
+            c->hunks = realloc(c->hunks, sizeof(struct diffHunk) * c->hunkcap);
+        }
+        c->hunks[c->nhunks++] = (struct diffHunk){ c->ai, i - c->ai, c->bj, j - c->bj };
+    }
+    c->ai = i + len;
+    c->bj = j + len;
+}
+
+// Finds the middle snake of a[a0..a1) against b[b0..b1): a run of equal
+// lines that an edit script of least cost passes through halfway, from
+// (*x, *y) to (*u, *v). Returns -1 past CEREAL_DIFF_MAX_COST edits.
+int diffMiddleSnake(struct diffCtx *c, int a0, int a1, int b0, int b1,
+                    int *x, int *y, int *u, int *v) {
+    int n = a1 - a0, m = b1 - b0;
+    int delta = n - m, odd = delta & 1;
+    int *vf = c->vf, *vb = c->vb;
+    vf[1] = 0;
+    vb[1] = 0;
+    int max = (n + m + 1) / 2;
+    if (max > CEREAL_DIFF_MAX_COST) max = CEREAL_DIFF_MAX_COST;
+    for (int d = 0; d <= max; ++d) {
+        for (int k = -d; k <= d; k += 2) {
+            int px = k == -d || (k != d && vf[k - 1] < vf[k + 1]) ? vf[k + 1] : vf[k - 1] + 1;
+            int py = px - k;
+            int sx = px, sy = py;
+            while (px < n && py < m && c->a[a0 + px] == c->b[b0 + py]) {
+                ++px;
+                ++py;
+            }
+            vf[k] = px;
+            int kr = delta - k;
+            if (odd && kr >= -(d - 1) && kr <= d - 1 && vf[k] + vb[kr] >= n) {
+                *x = a0 + sx;
+                *y = b0 + sy;
+                *u = a0 + px;
+                *v = b0 + py;
+                return 2 * d - 1;
+            }
+        }
+        for (int k = -d; k <= d; k += 2) {
+            // the same from the ends, over the reversed lines
+            int px = k == -d || (k != d && vb[k - 1] < vb[k + 1]) ? vb[k + 1] : vb[k - 1] + 1;
+            int py = px - k;
+            int sx = px, sy = py;
+            while (px < n && py < m && c->a[a1 - 1 - px] == c->b[b1 - 1 - py]) {
+                ++px;
+                ++py;
+            }
+            vb[k] = px;
+            int kf = delta - k;
+            if (!odd && kf >= -d && kf <= d && vb[k] + vf[kf] >= n) {
+                *x = a1 - px;
+                *y = b1 - py;
+                *u = a1 - sx;
+                *v = b1 - sy;
+                return 2 * d;
+            }
+        }
+    }
+    return -1;
+}
+
+// Diffs a[a0..a1) against b[b0..b1), reporting the equal runs in order.
+void diffRange(struct diffCtx *c, int a0, int a1, int b0, int b1) {
+    while (a0 < a1 && b0 < b1 && c->a[a0] == c->b[b0]) {
+        diffEqual(c, a0++, b0++, 1);
+    }
+    int tail = 0;
+    while (a1 > a0 && b1 > b0 && c->a[a1 - 1] == c->b[b1 - 1]) {
+        --a1;
+        --b1;
+        ++tail;
+    }
+    if (a0 < a1 && b0 < b1) {
+        int x, y, u, v;
+        int d = diffMiddleSnake(c, a0, a1, b0, b1, &x, &y, &u, &v);
+        // past the cost limit, or no progress: call it all replaced
+        if (d > 1 && !(x == a0 && y == b0 && u == a0 && v == b0) &&
+            !(x == a1 && y == b1)) {
+            diffRange(c, a0, x, b0, y);
+            if (u > x) diffEqual(c, x, y, u - x);
+            diffRange(c, u, a1, v, b1);
+        }
+    }
+    if (tail) diffEqual(c, a1, b1, tail);
+}
+
+// Jumps from a line of the *diff* buffer to its row in the file's buffer.
+void editorDiffVisit() {
+    int y = E.buf->cy, line = 0;
+    for (; y >= 0 && y < E.buf->numrows; --y) {
+        erow *row = &E.buf->row[y];
+        const char *text = editorRowText(row);
+        if (row->size > 0 && text[0] == '@') break;
+        if (row->size == 0 || text[0] != '-') ++line;
+    }
+    if (y < 0 || y >= E.buf->numrows || y == E.buf->cy) return;
+    char *hdr = strndup(editorRowText(&E.buf->row[y]), E.buf->row[y].size);
+    int start = 0;
+    char *plus = strchr(hdr, '+');
+    if (plus) start = atoi(plus + 1);
+    free(hdr);
+    char *file = strndup(editorRowText(&E.buf->row[1]), E.buf->row[1].size);
+
+    struct editorBuffer *diff = E.buf;
+    editorVisitFile(file + 6); // past "+++ b/"
+    free(file);
+    if (E.buf == diff) return;
+    int cy = start + line - 2;
+    if (cy < 0) cy = 0;
+    E.buf->cy = cy < E.buf->numrows ? cy : E.buf->numrows;
+    E.buf->cx = 0;
+    E.buf->rowoff = E.buf->cy > E.screenrows / 2 ? E.buf->cy - E.screenrows / 2 : 0;
+}
+
+void diffAppendLine(struct abuf *ab, char tag, const char *s, int len) {
+    abAppend(ab, &tag, 1);
+    abAppend(ab, s, len);
+    abAppend(ab, "\n", 1);
+}
+
+// M-x diff-buffer-with-file: a unified diff of the file on disk against
+// the buffer, in the *diff* buffer.
+void editorDiffBuffer() {
+    if (!E.buf->filename || E.buf->hex) {
+        editorSetStatusMessage("Buffer is not visiting a text file");
+        return;
+    }
+    char *text;
+    int *starts, *lens;
+    int na = editorDiffReadFile(E.buf->filename, &text, &starts, &lens);
+    if (na < 0) {
+        editorSetStatusMessage("Can't read %s: %s", E.buf->filename, strerror(errno));
+        return;
+    }
+    int nb = E.buf->numrows;
+    struct diffCtx c = { 0 };
+    uint64_t *a = malloc(sizeof(uint64_t) * (na + 1));
+    uint64_t *b = malloc(sizeof(uint64_t) * (nb + 1));
+    for (int j = 0; j < na; ++j) {
+        a[j] = editorHashLine(text + starts[j], lens[j]);
+    }
+    for (int j = 0; j < nb; ++j) {
+        b[j] = editorRowHash(&E.buf->row[j]);
+    }
+    c.a = a;
+    c.b = b;
+    int width = 2 * (na + nb) + 3;
+    if (width > 4 * CEREAL_DIFF_MAX_COST + 3) width = 4 * CEREAL_DIFF_MAX_COST + 3;
+    int *vs = malloc(sizeof(int) * 2 * width);
+    c.vf = vs + width / 2;
+    c.vb = vs + width + width / 2;
+    diffRange(&c, 0, na, 0, nb);
+    diffEqual(&c, na, nb, 0);
+    free(vs);
+    free(a);
+    free(b);
+
+    // hunks closer than twice the context share it
+    struct abuf ab = ABUF_INIT;
+    int added = 0, deleted = 0;
+    if (c.nhunks) {
+        // the name can be longer than any fixed buffer
+        int flen = strlen(E.buf->filename);
+        abAppend(&ab, "--- a/", 6);
+        abAppend(&ab, E.buf->filename, flen);
+        abAppend(&ab, "\n+++ b/", 7);
+        abAppend(&ab, E.buf->filename, flen);
+        abAppend(&ab, "\n", 1);
+    }
+    for (int h = 0; h < c.nhunks;) {
+        int last = h;
+        while (last + 1 < c.nhunks &&
+               c.hunks[last + 1].a - (c.hunks[last].a + c.hunks[last].alen) <= 2 * CEREAL_DIFF_CONTEXT) {
+            ++last;
+        }
+        int a0 = c.hunks[h].a - CEREAL_DIFF_CONTEXT;
+        if (a0 < 0) a0 = 0;
+        int b0 = c.hunks[h].b - (c.hunks[h].a - a0);
+        int a1 = c.hunks[last].a + c.hunks[last].alen + CEREAL_DIFF_CONTEXT;
+        if (a1 > na) a1 = na;
+        int b1 = c.hunks[last].b + c.hunks[last].blen + (a1 - c.hunks[last].a - c.hunks[last].alen);
+
+        char hdr[64];
+        int len = snprintf(hdr, sizeof(hdr), "@@ -%d,%d +%d,%d @@\n",
+                           a1 > a0 ? a0 + 1 : a0, a1 - a0, b1 > b0 ? b0 + 1 : b0, b1 - b0);
+        abAppend(&ab, hdr, len);
+        int i = a0, j = b0;
+        for (int k = h; k <= last; ++k) {
+            struct diffHunk *hk = &c.hunks[k];
+            for (; i < hk->a; ++i, ++j) {
+                diffAppendLine(&ab, ' ', text + starts[i], lens[i]);
+            }
+            for (; i < hk->a + hk->alen; ++i) {
+                diffAppendLine(&ab, '-', text + starts[i], lens[i]);
+            }
+            for (; j < hk->b + hk->blen; ++j) {
+                diffAppendLine(&ab, '+', editorRowText(&E.buf->row[j]), E.buf->row[j].size);
+            }
+            added += hk->blen;
+            deleted += hk->alen;
+        }
+        for (; i < a1; ++i, ++j) {
+            diffAppendLine(&ab, ' ', text + starts[i], lens[i]);
+        }
+        h = last + 1;
+    }
+    free(c.hunks);
+    free(text);
+    free(starts);
+    free(lens);
+
+    int j;
+    for (j = 0; j < E.nbufs && !(E.bufs[j]->name && !strcmp(E.bufs[j]->name, "*diff*")); ++j);
+    if (j < E.nbufs) {
+        editorSwitchToBuffer(j);
+        editorCloseFile();
+    } else {
+        editorNewBuffer();
+        E.buf->name = strdup("*diff*");
+        E.buf->enter = editorDiffVisit;
+    }
+    E.frame_valid = 0;
+    for (char *p = ab.b, *end = ab.b + ab.len; p < end;) {
+        char *nl = memchr(p, '\n', end - p);
+        editorInsertRow(E.buf->numrows, p, nl - p);
+        p = nl + 1;
+    }
+    abFree(&ab);
+    E.buf->dirty = 0;
+    if (E.buf->numrows == 0) {
+        editorSetStatusMessage("No changes");
+    } else {
+        editorSetStatusMessage("%d lines added, %d deleted", added, deleted);
+    }
+}
+
+/*** memory report ***/
+
+// M-x memory-report lists in a *memory* buffer what the rows of each
+// buffer hold, found by walking them, and what the process holds by kind,
+// as memAlloc counted it, next to what the allocator has in use and keeps
+// free. M-x drop-caches freezes every warm row off the screen (see
+// editorFreezeRows), dropping its render and hl and compressing its text
+// until it is next needed, then hands the heap's free memory back.
+
+#define CEREAL_MALLOC_HEADER sizeof(size_t) // the allocator's own, per block
+
+struct memUse {
+    long long rows, cold;
+    long long array, chars, render, hl;
+};
+
+// n bytes, short, into buf.
+void memFormat(char *buf, size_t size, long long n) {
+    static const char units[] = "KMGT";
+    if (n < 1024) {
+        snprintf(buf, size, "%d B", (int)n);
+        return;
+    }
+    double v = n / 1024.0;
+    int u = 0;
+    while (v >= 1024 && u < 3) {
+        v /= 1024;
+        ++u;
+    }
+    snprintf(buf, size, "%.1f %ciB", v, units[u]);
+}
+
+void editorMemoryOf(struct editorBuffer *b, struct memUse *m) {
+    memset(m, 0, sizeof(*m));
+    m->rows = b->numrows;
+    m->array = malloc_usable_size(b->row);
+    for (int j = 0; j < b->numrows; ++j) {
+        erow *row = &b->row[j];
+        if (row->blk) ++m->cold;
+        m->chars += malloc_usable_size(row->chars);
+        if (row->chunks) {
+            for (int k = 0; k < row->chunks->n; ++k) {
+                m->chars += malloc_usable_size(row->chunks->c[k].s);
+            }
+        }
+        m->render += malloc_usable_size(row->render);
+        m->hl += malloc_usable_size(row->hl);
+    }
+}
+
+// Appends one line of the report to *lines.
+void memLine(char ***lines, int *n, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    *lines = realloc(*lines, sizeof(char *) * (*n + 1));
+    (*lines)[(*n)++] = strdup(buf);
+}
+
+void editorMemoryReport() {
+    static const char *names[MEM_CATEGORIES] = {
+        [MEM_ROWS] = "row arrays",
+        [MEM_CHARS] = "chars",
+        [MEM_RENDER] = "render",
+        [MEM_HL] = "hl",
+        [MEM_BLOCKS] = "cold blocks",
+        [MEM_SEARCH] = "search state",
+        [MEM_OUTPUT] = "output buffers",
+    };
+    char **lines = NULL;
+    int n = 0;
+    char a[16], c[16], r[16], h[16];
+
+    memLine(&lines, &n, "%-24s %10s %8s %10s %10s %10s %10s",
+            "Buffer", "rows", "cold", "row array", "chars", "render", "hl");
+    for (int j = 0; j < E.nbufs; ++j) {
+        struct editorBuffer *b = E.bufs[j];
+        if (b->name && !strcmp(b->name, "*memory*")) continue;
+        struct memUse m;
+        editorMemoryOf(b, &m);
+        memFormat(a, sizeof(a), m.array);
+        memFormat(c, sizeof(c), m.chars);
+        memFormat(r, sizeof(r), m.render);
+        memFormat(h, sizeof(h), m.hl);
+        memLine(&lines, &n, "%-24.24s %10lld %8lld %10s %10s %10s %10s",
+                editorBufferName(b), m.rows, m.cold, a, c, r, h);
+    }
+
+    memLine(&lines, &n, "");
+    memLine(&lines, &n, "Counted by kind");
+    long long total = 0, blocks = 0;
+    for (int k = 0; k < MEM_CATEGORIES; ++k) {
+        long long bytes = atomic_load(&E.mem[k].bytes);
+        total += bytes;
+        blocks += atomic_load(&E.mem[k].blocks);
+        memFormat(a, sizeof(a), bytes);
+        memLine(&lines, &n, "  %-24s %12s", names[k], a);
+    }
+    memFormat(a, sizeof(a), blocks * CEREAL_MALLOC_HEADER);
+    memLine(&lines, &n, "  %-24s %12s  (%lld blocks)", "allocator overhead", a, blocks);
+    total += blocks * CEREAL_MALLOC_HEADER;
+    memFormat(a, sizeof(a), total);
+    memLine(&lines, &n, "  %-24s %12s", "total", a);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    long long used = mi.uordblks + mi.hblkhd;
+    memLine(&lines, &n, "");
+    memLine(&lines, &n, "Allocator");
+    memFormat(a, sizeof(a), used);
+    memLine(&lines, &n, "  %-24s %12s", "in use", a);
+    memFormat(a, sizeof(a), used > total ? used - total : 0);
+    memLine(&lines, &n, "  %-24s %12s", "in use, not counted", a);
+    memFormat(a, sizeof(a), mi.fordblks);
+    memLine(&lines, &n, "  %-24s %12s  (M-x drop-caches returns it)", "free, kept", a);
+#endif
+
+    int j;
+    for (j = 0; j < E.nbufs && !(E.bufs[j]->name && !strcmp(E.bufs[j]->name, "*memory*")); ++j);
+    if (j < E.nbufs) {
+        editorSwitchToBuffer(j);
+        editorCloseFile();
+    } else {
+        editorNewBuffer();
+        E.buf->name = strdup("*memory*");
+    }
+    E.frame_valid = 0;
+    for (int k = 0; k < n; ++k) {
+        editorInsertRow(E.buf->numrows, lines[k], strlen(lines[k]));
+        free(lines[k]);
+    }
+    free(lines);
+    E.buf->dirty = 0;
+}
+
+// M-x drop-caches: renders and highlights only what is on screen, and
+// gives what that frees back to the system.
+void editorDropCaches() {
+    long long before = 0, after = 0;
+    for (int k = 0; k < MEM_CATEGORIES; ++k) before += atomic_load(&E.mem[k].bytes);
+
+    struct editorBuffer *cur = E.buf;
+    for (int j = 0; j < E.nbufs; ++j) {
+        E.buf = E.bufs[j];
+        if (E.buf->hex) continue;
+        editorUpdateStaleRows();
+        // other buffers thaw what they show when switched to
+        int lo = 0, hi = 0;
+        if (E.buf == cur) {
+            lo = E.buf->rowoff;
+            hi = editorScreenRow(E.screenrows - 1) + 1;
+        }
+        E.buf->warm_count = 0;
+        editorFreezeRange(0, E.buf->numrows, lo, hi);
+        E.buf->ws_lo = lo;
+        E.buf->ws_hi = hi;
+    }
+    E.buf = cur;
+    malloc_trim(0);
+
+    for (int k = 0; k < MEM_CATEGORIES; ++k) after += atomic_load(&E.mem[k].bytes);
+    char freed[16];
+    memFormat(freed, sizeof(freed), before > after ? before - after : 0);
+    editorSetStatusMessage("Dropped caches off screen, %s freed", freed);
+}
+
+/*** outline ***/
+
+// M-. picks a function, struct, union, enum or typedef of the current file
+// by fuzzy match and jumps to it. Symbols are found by a small tokenizer
+// over the highlighter's output, so strings and comments never yield any,
+// and the bracket depth tells definitions at the top level from code in a
+// body. Edits note the rows to look at again; when no key has come for a
+// tick, the key read loop copies those rows, with some context around
+// them, for a thread to tokenize, and merges what it finds into the
+// buffer's symbols: one array in row order, names packed in a pool.
+
+#define CEREAL_OUTLINE_CONTEXT 16 // rows rescanned around the edited ones
+#define CEREAL_OUTLINE_PICKS 64 // best matches the picker cycles through
+
+enum symbolKind {
+    SYM_FUNCTION,
+    SYM_STRUCT,
+    SYM_UNION,
+    SYM_ENUM,
+    SYM_TYPEDEF
+};
+
+const char *symbolKindNames[] = { "function", "struct", "union", "enum", "typedef" };
+
+struct outlineJob {
+    struct editorBuffer *buf;
+    const struct editorSyntax *syntax;
+    int lo, hi; // rows whose symbols this scan replaces
+    int nrows; // rows copied from lo on: those plus some lookahead
+    char *text; // the rows copied, each NUL-terminated
+    int *starts; // where each starts in text, and where the last ends
+    int depth; // bracket depth at the start of row lo
+    int in_comment; // whether row lo starts inside a comment
+    atomic_int done;
+    atomic_int cancel;
+    pthread_t thread;
+
+    struct outlineSym *syms; // found, in row order
+    int nsyms, symcap;
+    char *pool;
+    int poollen, poolcap;
+
+    // rows inserted or deleted since the copy, as (at, d) pairs, see
+    // editorOutlineShift
+    int *shifts;
+    int nshifts, shiftcap;
+};
+
+// A name met by the tokenizer, pointing into the job's text.
+struct outlineName {
+    const char *s;
+    int len;
+    int row, col;
+};
+
+// What the tokenizer has seen of the statement at hand.
+struct outlineScan {
+    struct outlineJob *job;
+    int depth;
+    int directive; // in a preprocessor line, or its continuation
+    int ident; // the last token was the identifier last
+    struct outlineName last;
+    int fn; // 1: name( at the top level, 2: and its ), so { defines it
+    struct outlineName fn_name;
+    int tag; // 1: struct, union or enum, 2: and its name, so { defines it
+    int tag_kind;
+    struct outlineName tag_name;
+    int td; // 1: in a typedef, 2: in a ( of it, 3: named from there
+    struct outlineName td_name;
+};
+
+// A bit for each letter (case folded), for digits and for '_' in s, so a
+// name missing some letter of the query is ruled out at a glance.
+unsigned int editorLetterMask(const char *s, int len) {
+    unsigned int mask = 0;
+    for (int j = 0; j < len; ++j) {
+        unsigned char c = tolower((unsigned char)s[j]);
+        if (c >= 'a' && c <= 'z') {
+            mask |= 1u << (c - 'a');
+        } else if (isdigit(c)) {
+            mask |= 1u << 26;
+        } else if (c == '_') {
+            mask |= 1u << 27;
+        }
+    }
+    return mask;
+}
+
+void outlineEmit(struct outlineScan *sc, int kind, struct outlineName *n) {
+    struct outlineJob *job = sc->job;
+    if (n->row < job->lo || n->row >= job->hi || n->len == 0) return;
+    int len = n->len > 255 ? 255 : n->len;
+    if (job->nsyms == job->symcap) {
+        job->symcap = job->symcap ? job->symcap * 2 : 64;
+        job->syms = realloc(job->syms, sizeof(job->syms[0]) * job->symcap);
+    }
+    if (job->poollen + len + 1 > job->poolcap) {
+        job->poolcap = job->poolcap ? job->poolcap * 2 : 1024;
+        if (job->poolcap < job->poollen + len + 1) job->poolcap = job->poollen + len + 1;
+        job->pool = realloc(job->pool, job->poolcap);
+    }
+    struct outlineSym *sym = &job->syms[job->nsyms++];
+    sym->row = n->row;
+    sym->col = n->col;
+    sym->name = job->poollen;
+    sym->len = len;
+    sym->kind = kind;
+    sym->letters = editorLetterMask(n->s, len);
+    memcpy(job->pool + job->poollen, n->s, len);
+    job->pool[job->poollen + len] = '\0';
+    job->poollen += len + 1;
+}
+
+void outlineWord(struct outlineScan *sc, struct outlineName *w, int keyword) {
+    if (sc->tag == 2) sc->tag = 0; // struct x not followed by {
+    sc->ident = 0;
+    if (keyword) {
+        int tag = sc->tag;
+        sc->tag = 0;
+        if (w->len == 7 && !strncmp(w->s, "typedef", 7)) {
+            if (sc->depth == 0) {
+                sc->td = 1;
+                sc->td_name.len = 0;
+            }
+        } else if (w->len == 6 && !strncmp(w->s, "struct", 6)) {
+            sc->tag = 1;
+            sc->tag_kind = SYM_STRUCT;
+        } else if (w->len == 5 && !strncmp(w->s, "union", 5)) {
+            sc->tag = 1;
+            sc->tag_kind = SYM_UNION;
+        } else if (w->len == 4 && !strncmp(w->s, "enum", 4)) {
+            sc->tag = 1;
+            sc->tag_kind = SYM_ENUM;
+        } else {
+            sc->tag = tag;
+        }
+        return;
+    }
+    if (isdigit((unsigned char)w->s[0])) {
+        sc->tag = 0;
+        return;
+    }
+
+    if (sc->tag == 1) {
+        sc->tag = 2;
+        sc->tag_name = *w;
+    }
+    // typedef int name; typedef struct {...} name; typedef int (*name)();
+    if (sc->td == 1 && sc->depth == 0) {
+        sc->td_name = *w;
+    } else if (sc->td == 2 && sc->depth == 1) {
+        sc->td_name = *w;
+        sc->td = 3;
+    }
+    sc->ident = 1;
+    sc->last = *w;
+}
+
+void outlinePunct(struct outlineScan *sc, char c) {
+    int ident = sc->ident;
+    int tag = sc->tag;
+    sc->ident = 0;
+    sc->tag = 0;
+    switch (c) {
+    case '(':
+        if (sc->depth == 0) {
+            if (sc->td == 1 && !ident) {
+                sc->td = 2;
+            } else if (!sc->td && ident) {
+                sc->fn = 1;
+                sc->fn_name = sc->last;
+            }
+        }
+        ++sc->depth;
+        break;
+    case '[':
+        ++sc->depth;
+        break;
+    case ')':
+        --sc->depth;
+        if (sc->fn == 1 && sc->depth == 0) sc->fn = 2;
+        break;
+    case ']':
+    case '}':
+        --sc->depth;
+        break;
+    case '{':
+        if (tag == 2) outlineEmit(sc, sc->tag_kind, &sc->tag_name);
+        if (sc->fn == 2 && sc->depth == 0) outlineEmit(sc, SYM_FUNCTION, &sc->fn_name);
+        sc->fn = 0;
+        ++sc->depth;
+        break;
+    case ';':
+        if (sc->depth == 0) {
+            if (sc->td) outlineEmit(sc, SYM_TYPEDEF, &sc->td_name);
+            sc->td = 0;
+        }
+        sc->fn = 0;
+        break;
+    case ',':
+    case '=':
+        if (sc->depth == 0) sc->fn = 0;
+        break;
+    }
+}
+
+int outlineIsWordChar(char c) {
+    return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80;
+}
+
+// Feeds the tokens of one highlighted row to the tokenizer.
+void outlineScanRow(struct outlineScan *sc, const char *text, int len,
+                    const unsigned char *hl, int row) {
+    int i = 0;
+    while (i < len && isspace((unsigned char)text[i])) ++i;
+    // directives hold no symbols, but their brackets still count
+    int directive = sc->directive || (i < len && text[i] == '#');
+    sc->directive = directive && len > 0 && text[len - 1] == '\\';
+
+    while (i < len) {
+        unsigned char h = hl[i];
+        char c = text[i];
+        if (h == HL_COMMENT || h == HL_MLCOMMENT || h == HL_STRING ||
+            isspace((unsigned char)c)) {
+            ++i;
+        } else if (outlineIsWordChar(c)) {
+            struct outlineName w = { &text[i], 0, row, i };
+            while (i < len && outlineIsWordChar(text[i]) && hl[i] == h) ++i;
+            w.len = &text[i] - w.s;
+            if (!directive) {
+                outlineWord(sc, &w, h == HL_KEYWORD1 || h == HL_KEYWORD2);
+            }
+        } else {
+            if (!directive) {
+                outlinePunct(sc, c);
+            } else if (editorBracketDir(c, h)) {
+                sc->depth += editorBracketDir(c, h);
+            }
+            ++i;
+        }
+    }
+}
+
+void *outlineWorker(void *arg) {
+    struct outlineJob *job = arg;
+    struct outlineScan sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.job = job;
+    sc.depth = job->depth;
+
+    int in_comment = job->in_comment;
+    unsigned char *hl = NULL;
+    int hlcap = 0;
+    for (int j = 0; j < job->nrows && !atomic_load(&job->cancel); ++j) {
+        const char *text = job->text + job->starts[j];
+        int len = job->starts[j + 1] - job->starts[j] - 1;
+        if (len + 1 > hlcap) {
+            hlcap = len + 1;
+            hl = realloc(hl, hlcap);
+        }
+        memset(hl, HL_NORMAL, len);
+        struct hlState st = { in_comment, 0, 1, 0 };
+        editorHighlight(job->syntax, text, hl, len, &st, NULL, 0);
+        in_comment = st.in_comment;
+        outlineScanRow(&sc, text, len, hl, job->lo + j);
+    }
+    free(hl);
+    atomic_store(&job->done, 1);
+    return NULL;
+}
+
+void editorOutlineFree(struct outlineJob *job) {
+    free(job->text);
+    free(job->starts);
+    free(job->syms);
+    free(job->pool);
+    free(job->shifts);
+    free(job);
+}
+
+// The first symbol of b at or after row.
+int editorOutlineFind(struct editorBuffer *b, int row) {
+    int lo = 0, hi = b->nsyms;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (b->syms[mid].row < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void editorOutlineDirty(int at) {
+    struct editorBuffer *b = E.buf;
+    if (b->outline_lo >= b->outline_hi) {
+        b->outline_lo = at;
+        b->outline_hi = at + 1;
+    } else if (at < b->outline_lo) {
+        b->outline_lo = at;
+    } else if (at >= b->outline_hi) {
+        b->outline_hi = at + 1;
+    }
+}
+
+// Renumbers the symbols after d rows are inserted at at (d > 0) or -d
+// rows deleted from it (d < 0), and notes it for a scan in progress.
+void editorOutlineShift(int at, int d) {
+    struct editorBuffer *b = E.buf;
+    // before the first scan there are no symbols, and no syms array
+    if (b->nsyms > 0) {
+        int k = editorOutlineFind(b, at);
+        if (d < 0) {
+            int end = editorOutlineFind(b, at - d);
+            memmove(&b->syms[k], &b->syms[end], sizeof(b->syms[0]) * (b->nsyms - end));
+            b->nsyms -= end - k;
+            if (end > k) ++b->outline_gen;
+        }
+        for (; k < b->nsyms; ++k) {
+            b->syms[k].row += d;
+        }
+    }
+    if (b->outline_lo < b->outline_hi && d > 0) {
+        if (at < b->outline_lo) b->outline_lo += d;
+        if (at < b->outline_hi) b->outline_hi += d;
+    } else if (b->outline_lo < b->outline_hi) {
+        b->outline_lo = editorDelBound(b->outline_lo, at, -d);
+        b->outline_hi = editorDelBound(b->outline_hi, at, -d);
+    }
+    if (d < 0) editorOutlineDirty(at);
+
+    struct outlineJob *job = E.outline;
+    if (job && job->buf == b) {
+        if (job->nshifts == job->shiftcap) {
+            job->shiftcap = job->shiftcap ? job->shiftcap * 2 : 64;
+            job->shifts = realloc(job->shifts, sizeof(int) * 2 * job->shiftcap);
+        }
+        job->shifts[2 * job->nshifts] = at;
+        job->shifts[2 * job->nshifts + 1] = d;
+        ++job->nshifts;
+    }
+}
+
+// Cancels a scan of b, if one is running.
+void editorOutlineStop(struct editorBuffer *b) {
+    struct outlineJob *job = E.outline;
+    if (!job || job->buf != b) return;
+    atomic_store(&job->cancel, 1);
+    pthread_join(job->thread, NULL);
+    editorOutlineFree(job);
+    E.outline = NULL;
+}
+
+// Forgets every symbol of the buffer, to find them all again.
+void editorOutlineReset() {
+    editorOutlineStop(E.buf);
+    E.buf->nsyms = 0;
+    E.buf->outline_lo = 0;
+    E.buf->outline_hi = E.buf->numrows;
+    E.buf->outline_net = 0;
+    ++E.buf->outline_gen;
+}
+
+// Copies the rows the current buffer needs tokenized again and starts a
+// thread on them.
+void editorOutlineStart() {
+    struct editorBuffer *b = E.buf;
+    if (E.outline || !b->syntax || b->outline_lo >= b->outline_hi) return;
+
+    editorBracketIndex();
+    int net = b->brk_cap ? b->brk[1].net : 0;
+    int lo = b->outline_lo - CEREAL_OUTLINE_CONTEXT;
+    int hi = b->outline_hi + CEREAL_OUTLINE_CONTEXT;
+    if (net != b->outline_net) {
+        hi = b->numrows; // every later row now sits at another depth
+    }
+    if (lo < 0) lo = 0;
+    if (hi > b->numrows) hi = b->numrows;
+    // from the top level, where no statement is under way
+    while (lo > 0 && editorBracketDepth(lo) > 0) --lo;
+    int end = hi + CEREAL_OUTLINE_CONTEXT;
+    if (end > b->numrows) end = b->numrows;
+    if (lo > hi) lo = hi;
+    b->outline_lo = b->outline_hi = 0;
+    b->outline_net = net;
+
+    struct outlineJob *job = calloc(1, sizeof(*job));
+    job->buf = b;
+    job->syntax = b->syntax;
+    job->lo = lo;
+    job->hi = hi;
+    job->nrows = end - lo;
+    job->depth = editorBracketDepth(lo);
+    job->in_comment = lo > 0 && b->row[lo - 1].hl_open_comment;
+    size_t total = 0;
+    for (int j = lo; j < end; ++j) {
+        total += (b->row[j].chunks ? 0 : b->row[j].size) + 1;
+    }
+    job->text = malloc(total ? total : 1);
+    job->starts = malloc(sizeof(int) * (job->nrows + 1));
+    int off = 0;
+    for (int j = lo; j < end; ++j) {
+        erow *row = &b->row[j];
+        job->starts[j - lo] = off;
+        // long rows are left out, as in the bracket index
+        if (!row->chunks) {
+            memcpy(job->text + off, editorRowText(row), row->size);
+            off += row->size;
+        }
+        job->text[off++] = '\0';
+    }
+    job->starts[job->nrows] = off;
+    atomic_init(&job->done, 0);
+    atomic_init(&job->cancel, 0);
+
+    if (pthread_create(&job->thread, NULL, outlineWorker, job) != 0) {
+        editorOutlineFree(job);
+        b->outline_lo = lo;
+        b->outline_hi = hi;
+        return;
+    }
+    E.outline = job;
+}
+
+// Puts the symbols a finished scan found in place of those it replaces,
+// renumbered for rows inserted or deleted while it ran.
+void editorOutlineMerge(struct outlineJob *job) {
+    struct editorBuffer *b = job->buf;
+    int lo = job->lo, hi = job->hi;
+    for (int s = 0; s < job->nshifts; ++s) {
+        int at = job->shifts[2 * s], d = job->shifts[2 * s + 1];
+        if (d > 0) {
+            if (at <= lo) lo += d;
+            if (at < hi) hi += d;
+        } else {
+            lo = editorDelBound(lo, at, -d);
+            hi = editorDelBound(hi, at, -d);
+        }
+        int from = d < 0 ? at - d : at; // first row that moves
+        for (int k = 0; k < job->nsyms; ++k) {
+            struct outlineSym *sym = &job->syms[k];
+            if (sym->row == -1) continue;
+            if (sym->row >= from) {
+                sym->row += d;
+            } else if (sym->row >= at) {
+                sym->row = -1; // deleted
+            }
+        }
+    }
+
+    int first = editorOutlineFind(b, lo);
+    int last = editorOutlineFind(b, hi);
+    int n = first + job->nsyms + (b->nsyms - last);
+    struct outlineSym *syms = malloc(sizeof(syms[0]) * (n ? n : 1));
+    size_t poolcap = job->poollen + 1;
+    for (int k = 0; k < b->nsyms; ++k) {
+        if (k < first || k >= last) poolcap += b->syms[k].len + 1;
+    }
+    char *pool = malloc(poolcap);
+    int poollen = 0;
+    n = 0;
+    for (int k = 0; k < first; ++k) {
+        syms[n] = b->syms[k];
+        syms[n].name = poollen;
+        memcpy(pool + poollen, b->sympool + b->syms[k].name, b->syms[k].len + 1);
+        poollen += b->syms[k].len + 1;
+        ++n;
+    }
+    for (int k = 0; k < job->nsyms; ++k) {
+        if (job->syms[k].row == -1) continue;
+        syms[n] = job->syms[k];
+        syms[n].name = poollen;
+        memcpy(pool + poollen, job->pool + job->syms[k].name, job->syms[k].len + 1);
+        poollen += job->syms[k].len + 1;
+        ++n;
+    }
+    for (int k = last; k < b->nsyms; ++k) {
+        syms[n] = b->syms[k];
+        syms[n].name = poollen;
+        memcpy(pool + poollen, b->sympool + b->syms[k].name, b->syms[k].len + 1);
+        poollen += b->syms[k].len + 1;
+        ++n;
+    }
+    free(b->syms);
+    free(b->sympool);
+    b->syms = syms;
+    b->sympool = pool;
+    b->nsyms = n;
+    ++b->outline_gen;
+}
+
+// Waits for the scan in progress and takes in what it found.
+void editorOutlineFinish() {
+    struct outlineJob *job = E.outline;
+    pthread_join(job->thread, NULL);
+    E.outline = NULL;
+    editorOutlineMerge(job);
+    editorOutlineFree(job);
+}
+
+// Called from the key read loop: takes in a finished scan, or starts one
+// on the current buffer's edited rows.
+int editorOutlinePoll() {
+    if (!E.outline) {
+        editorOutlineStart();
+    } else if (atomic_load(&E.outline->done)) {
+        editorOutlineFinish();
+    }
+    return 0;
+}
+
+// Scores name as a match for query, whose letters it must hold in order,
+// ignoring case; -1 if it doesn't. Letters that follow one another or
+// start a word (after '_', or a capital after a small letter) score more.
+int editorFuzzyScore(const char *query, int qlen, const char *name, int len) {
+    int score = 0, prev = -2;
+    int j = 0;
+    for (int i = 0; i < qlen; ++i) {
+        char q = tolower((unsigned char)query[i]);
+        while (j < len && tolower((unsigned char)name[j]) != q) ++j;
+        if (j == len) return -1;
+
+        // rather than in the middle of a word, take the letter where a
+        // later word starts, if the rest of the query still fits after it
+        int start = j == 0 || name[j - 1] == '_' ||
+            (islower((unsigned char)name[j - 1]) && isupper((unsigned char)name[j]));
+        if (!start && j != prev + 1) {
+            for (int k = j + 1; k < len; ++k) {
+                if (tolower((unsigned char)name[k]) != q ||
+                    !(name[k - 1] == '_' || (islower((unsigned char)name[k - 1]) &&
+                                             isupper((unsigned char)name[k])))) {
+                    continue;
+                }
+                int r = i + 1, m = k + 1;
+                for (; r < qlen && m < len; ++m) {
+                    if (tolower((unsigned char)name[m]) == tolower((unsigned char)query[r])) ++r;
+                }
+                if (r == qlen) {
+                    j = k;
+                    start = 1;
+                }
+                break;
+            }
+        }
+
+        score += 2;
+        if (j == prev + 1) score += 8;
+        if (start) score += 12;
+        if (name[j] == query[i]) score += 1;
+        prev = j++;
+    }
+    return score * 256 - len;
+}
+
+struct outlinePick {
+    int sym;
+    int score;
+};
+
+// The prompt of the symbol picker, rewritten as the matches change.
+char editorSymbolPrompt[80];
+
+void editorSymbolCallback(char *query, int key) {
+    static struct outlinePick picks[CEREAL_OUTLINE_PICKS];
+    static int npicks, cur, matches;
+    static char *ranked; // the query picks were ranked for
+    static unsigned int gen;
+
+    if (key == '\r' || key == '\x1b' || key == CTRL_KEY('g')) {
+        free(ranked);
+        ranked = NULL;
+        return;
+    }
+
+    struct editorBuffer *b = E.buf;
+    if (!ranked || strcmp(ranked, query) != 0 || gen != b->outline_gen) {
+        int qlen = strlen(query);
+        unsigned int letters = editorLetterMask(query, qlen);
+        npicks = matches = cur = 0;
+        for (int k = 0; qlen && k < b->nsyms; ++k) {
+            struct outlineSym *sym = &b->syms[k];
+            if ((letters & ~sym->letters) || sym->len < qlen) continue;
+            int score = editorFuzzyScore(query, qlen, b->sympool + sym->name, sym->len);
+            if (score < 0) continue;
+            ++matches;
+            if (npicks == CEREAL_OUTLINE_PICKS && score <= picks[npicks - 1].score) {
+                continue;
+            }
+            // insertion into the best few, best first, earlier rows on ties
+            int at = npicks < CEREAL_OUTLINE_PICKS ? npicks++ : npicks - 1;
+            while (at > 0 && picks[at - 1].score < score) {
+                picks[at] = picks[at - 1];
+                --at;
+            }
+            picks[at].sym = k;
+            picks[at].score = score;
+        }
+        free(ranked);
+        ranked = strdup(query);
+        gen = b->outline_gen;
+    } else if (npicks && (key == ARROW_DOWN || key == CTRL_KEY('n') || key == CTRL_KEY('s'))) {
+        cur = (cur + 1) % npicks;
+    } else if (npicks && (key == ARROW_UP || key == CTRL_KEY('p') || key == CTRL_KEY('r'))) {
+        cur = (cur + npicks - 1) % npicks;
+    }
+
+    if (!npicks) {
+        snprintf(editorSymbolPrompt, sizeof(editorSymbolPrompt),
+                 "Go to symbol: %%s (%s of %d)", *query ? "no match" : "any", b->nsyms);
+        return;
+    }
+    struct outlineSym *sym = &b->syms[picks[cur].sym];
+    snprintf(editorSymbolPrompt, sizeof(editorSymbolPrompt),
+             "Go to symbol: %%s (%d/%d, %s %s)", cur + 1, matches,
+             symbolKindNames[sym->kind], b->sympool + sym->name);
+
+    erow *row = &b->row[sym->row];
+    editorRowThaw(row);
+    b->cy = sym->row;
+    b->cx = sym->col <= row->size ? sym->col : row->size;
+    b->rowoff = b->cy > E.screenrows / 2 ? b->cy - E.screenrows / 2 : 0;
 }
 
-void abFree(struct abuf *ab) { free(ab->b); }
+void editorGotoSymbol() {
+    if (!E.buf->syntax) {
+        editorSetStatusMessage("No symbols: no syntax for this buffer");
+        return;
+    }
+    // finish the outline first
+    if (E.outline) editorOutlineFinish();
+    editorOutlineStart();
+    if (E.outline) editorOutlineFinish();
+
+    int orig_cx = E.buf->cx;
+    int orig_cy = E.buf->cy;
+    int orig_coloff = E.buf->coloff;
+    int orig_rowoff = E.buf->rowoff;
+
+    snprintf(editorSymbolPrompt, sizeof(editorSymbolPrompt),
+             "Go to symbol: %%s (any of %d)", E.buf->nsyms);
+    char *query = editorPrompt(editorSymbolPrompt, editorSymbolCallback, 0);
+    if (query) {
+        free(query);
+    } else {
+        E.buf->cx = orig_cx;
+        E.buf->cy = orig_cy;
+        E.buf->coloff = orig_coloff;
+        E.buf->rowoff = orig_rowoff;
+    }
+}
 
 /*** output ***/
 
 void editorScroll() {
-    E.rx = 0;
+    E.buf->rx = 0;
+    if (E.buf->hex) {
+        E.buf->rx = editorHexColumn(E.buf->hex);
+        E.buf->coloff = 0;
+    }
 
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (E.buf->cy < E.buf->numrows) {
+        editorRowThaw(&E.buf->row[E.buf->cy]);
+        E.buf->rx = editorRowCxToRx(&E.buf->row[E.buf->cy], E.buf->cx);
     }
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
+    int fold = editorFoldAt(E.buf->cy);
+    if (fold >= 0) {
+        // a search or a jump landed in a fold: open it
+        int lo, hi;
+        foldBounds(&E.buf->folds, fold, &lo, &hi);
+        editorFoldEdit(lo, hi, 0, 0);
     }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    if (E.buf->occur) {
+        // the same, but over view positions, with rowoff the row shown first
+        struct occurView *v = E.buf->occur;
+        editorOccurCursor(v);
+        v->top = occurLowerBound(v, E.buf->rowoff) + (v->extra && E.buf->cy < E.buf->rowoff);
+        if (v->pos < v->top) {
+            v->top = v->pos;
+        }
+        if (v->pos >= v->top + E.screenrows) {
+            v->top = v->pos - E.screenrows + 1;
+        }
+        E.buf->rowoff = editorOccurRow(v, v->top);
+    } else {
+        // over lines of the screen, which folded rows take none of
+        int cy = editorVisibleIndex(E.buf->cy);
+        int rowoff = editorVisibleIndex(E.buf->rowoff);
+        if (cy < rowoff) {
+            rowoff = cy;
+        }
+        if (cy >= rowoff + E.screenrows) {
+            rowoff = cy - E.screenrows + 1;
+        }
+        E.buf->rowoff = editorVisibleRow(rowoff);
     }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
+    if (E.buf->rx < E.buf->coloff) {
+        E.buf->coloff = E.buf->rx;
     }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+    if (E.buf->rx >= E.buf->coloff + editorTextCols()) {
+        E.buf->coloff = E.buf->rx - editorTextCols() + 1;
     }
 }
 
-// handles how drawing each row of the buffer of text being edited
-void editorDrawRows(struct abuf *ab) {
-    int y;
-    for (y = 0; y < E.screenrows; ++y) {
-        int filerow = y + E.rowoff; // vertical scroll
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                                          "Welcome to Cereal v%s", CEREAL_VERSION);
-                if (welcomelen > E.screencols) {
-                    welcomelen = E.screencols;
-                }
-                // center msg: divide the screen then subtract half of string's length
-                int padding = (E.screencols - welcomelen) / 2;
-                // add ~ to first col
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    --padding;
-                }
-                // add spaces
-                while (padding--) {
-                    abAppend(ab, " ", 1);
-                }
-                // append welcome to ab
-                abAppend(ab, welcome, welcomelen);
-            } else {
+// Columns left for the text beside the change markers.
+int editorTextCols() {
+    return E.screencols - (E.buf->gutter && !E.buf->hex);
+}
+
+// Appends one character (len bytes of s, codepoint cp) colored for hl.
+// Control characters and malformed bytes show as an inverse-video symbol.
+void editorDrawCell(struct abuf *ab, const char *s, int len, int cp,
+                    unsigned char hl, int *current_color) {
+    if (cp < 0 || cp < 32 || cp == 127) {
+        char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &sym, 1);
+        abAppend(ab, "\x1b[m", 3);
+        if (*current_color != -1) {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", *current_color);
+            abAppend(ab, buf, clen);
+        }
+    } else if (hl == HL_CURSOR) {
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, s, len);
+        abAppend(ab, "\x1b[27m", 5);
+    } else if (hl == HL_NORMAL) {
+        if (*current_color != -1) {
+            abAppend(ab, "\x1b[39m", 5);
+            *current_color = -1;
+        }
+        abAppend(ab, s, len);
+    } else {
+        int color = editorSyntaxToColor(hl);
+        if (color != *current_color) {
+            *current_color = color;
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            abAppend(ab, buf, clen);
+        }
+        abAppend(ab, s, len);
+    }
+}
+
+// Gets the highlight of render byte j, with search matches drawn over the
+// syntax colors. *k walks the spans of ov forward as j grows.
+unsigned char editorOverlayHl(struct matchSpans *ov, int *k, int j,
+                              unsigned char hl) {
+    if (!ov) return hl;
+    while (*k < ov->n && ov->rb[2 * *k + 1] <= j) ++*k;
+    if (*k < ov->n && ov->rb[2 * *k] <= j) return HL_MATCH;
+    return hl;
+}
+
+// The row on screen line y, as of the last editorScroll. Past the end of
+// the buffer when greater than or equal to numrows.
+int editorScreenRow(int y) {
+    if (E.buf->occur) return editorOccurRow(E.buf->occur, E.buf->occur->top + y);
+    return editorVisibleRow(editorVisibleIndex(E.buf->rowoff) + y);
+}
+
+// The line of the screen the cursor is on.
+int editorScreenCursor() {
+    if (E.buf->occur) return E.buf->occur->pos - E.buf->occur->top;
+    return editorVisibleIndex(E.buf->cy) - editorVisibleIndex(E.buf->rowoff);
+}
+
+// How far the view is scrolled, in lines of the screen.
+int editorScreenTop() {
+    return E.buf->occur ? E.buf->occur->top : editorVisibleIndex(E.buf->rowoff);
+}
+
+// handles how drawing one screen line y of the buffer of text being edited,
+// without clearing the rest of the line or moving to the next one
+void editorDrawRow(struct abuf *ab, int y) {
+    if (E.buf->hex) {
+        editorHexDrawRow(ab, y);
+        return;
+    }
+    int filerow = editorScreenRow(y); // vertical scroll
+    if (filerow >= E.buf->numrows) {
+        if (E.buf->numrows == 0 && y == E.screenrows / 3) {
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome),
+                                      "Welcome to Cereal v%s", CEREAL_VERSION);
+            if (welcomelen > E.screencols) {
+                welcomelen = E.screencols;
+            }
+            // center msg: divide the screen then subtract half of string's length
+            int padding = (E.screencols - welcomelen) / 2;
+            // add ~ to first col
+            if (padding) {
                 abAppend(ab, "~", 1);
+                --padding;
+            }
+            // add spaces
+            while (padding--) {
+                abAppend(ab, " ", 1);
             }
+            // append welcome to ab
+            abAppend(ab, welcome, welcomelen);
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            abAppend(ab, "~", 1);
+        }
+    } else {
+        erow *row = &E.buf->row[filerow];
+        editorRowThaw(row);
+        int coloff = E.buf->coloff;
+        if (row->chunks) {
+            // long rows keep only the visible window rendered
+            editorChunkRender(row);
+            coloff -= row->chunks->render_col;
+        }
+        struct matchSpans *ov = editorMatchOverlay(row);
+        int k = 0;
+        int current_color = -1;
+        int cols = editorTextCols();
+        int *cells = NULL, kc = 0;
+        int ncells = editorCursorCells(row, &cells);
+        if (E.buf->gutter) {
+            static const char *marks[] = {
+                [DIFF_NONE] = " ",
+                [DIFF_ADDED] = "\x1b[32m+\x1b[39m",
+                [DIFF_CHANGED] = "\x1b[33m~\x1b[39m",
+                [DIFF_DELETED] = "\x1b[31m-\x1b[39m",
+            };
+            const char *m = marks[editorDiffMark(filerow)];
+            abAppend(ab, m, strlen(m));
+        }
+        if (row->ascii) {
+            int len = row->rsize - coloff;
             if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            for (int j = 0; j < len; ++j){
-              if (iscntrl(c[j])) {
-                char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                abAppend(ab, "\x1b[7m", 4);
-                abAppend(ab, &sym, 1);
-                abAppend(ab, "\x1b[m", 3);
-                if (current_color != -1) {
-                    char buf[16];
-                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                    abAppend(ab, buf, clen);
-                }
-              } else if (hl[j] == HL_NORMAL) {
-                if (current_color != -1) {
-                  abAppend(ab, "\x1b[39m", 5);
-                  current_color = -1;
-                }
-                abAppend(ab, &c[j], 1);
-              } else {
-                int color = editorSyntaxToColor(hl[j]);
-                if (color != current_color) {
-                  current_color = color;
-                  char buf[16];
-                  int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                  abAppend(ab, buf, clen);
+            if (len > cols) len = cols;
+            char *c = &row->render[coloff];
+            unsigned char *hl = &row->hl[coloff];
+            for (int j = 0; j < len; ++j) {
+                unsigned char h = editorOverlayHl(ov, &k, coloff + j, hl[j]);
+                editorDrawCell(ab, &c[j], 1, c[j],
+                               editorCursorHl(cells, ncells, &kc, coloff + j, h),
+                               &current_color);
+            }
+        } else {
+            // walk codepoints, counting columns up to the visible window
+            int col = 0;
+            int j = 0;
+            while (j < row->rsize && col < coloff + cols) {
+                int cp;
+                int len = utf8Decode(&row->render[j], row->rsize - j, &cp);
+                int width = utf8Width(cp);
+                if (col < coloff || col + width > coloff + cols) {
+                    // a wide character cut by the window edge
+                    for (int k = col; k < col + width; ++k) {
+                        if (k >= coloff && k < coloff + cols) {
+                            abAppend(ab, " ", 1);
+                        }
+                    }
+                } else {
+                    unsigned char h = editorOverlayHl(ov, &k, j, row->hl[j]);
+                    editorDrawCell(ab, &row->render[j], len, cp,
+                                   editorCursorHl(cells, ncells, &kc, j, h),
+                                   &current_color);
                 }
-                abAppend(ab, &c[j], 1);
-              }
+                col += width;
+                j += len;
             }
-            abAppend(ab, "\x1b[39m", 5);
         }
+        // a cursor at the end of the row
+        if (ncells && cells[ncells - 1] == row->rsize &&
+            editorRowCxToRx(row, row->size) - coloff >= 0 &&
+            editorRowCxToRx(row, row->size) - coloff < cols) {
+            editorDrawCell(ab, " ", 1, ' ', HL_CURSOR, &current_color);
+        }
+        free(cells);
+        abAppend(ab, "\x1b[39m", 5);
+    }
+}
+
+// FNV-1a, which can be fed a line piece by piece: the hash of s[0..len)
+// continued from h.
+uint64_t editorHashMore(uint64_t h, const char *s, int len) {
+    for (int j = 0; j < len; ++j) {
+        h = (h ^ (unsigned char)s[j]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t editorHashLine(const char *s, int len) {
+    return editorHashMore(14695981039346656037ULL, s, len);
+}
+
+// Sends only the lines that differ from what the terminal shows. E.frame
+// holds a hash of every line drawn by the previous refresh. When rowoff
+// moved by less than a screen, the terminal scrolls the text area itself
+// (DECSTBM region, then SU/SD), so only the newly exposed lines are drawn.
+void editorDrawRows(struct abuf *ab) {
+    int shift = editorScreenTop() - E.frame_rowoff;
+    if (E.frame_valid && shift != 0 && abs(shift) < E.screenrows) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                           E.screenrows, abs(shift), shift > 0 ? 'S' : 'T');
+        abAppend(ab, buf, len);
+
+        int keep = E.screenrows - abs(shift);
+        if (shift > 0) {
+            memmove(E.frame, E.frame + shift, sizeof(E.frame[0]) * keep);
+            memset(E.frame + keep, 0, sizeof(E.frame[0]) * shift);
+        } else {
+            memmove(E.frame - shift, E.frame, sizeof(E.frame[0]) * keep);
+            memset(E.frame, 0, sizeof(E.frame[0]) * -shift);
+        }
+    }
 
-        // clear 1 line at a time
+    struct abuf line = ABUF_INIT;
+    for (int y = 0; y < E.screenrows; ++y) {
+        line.len = 0;
+        editorDrawRow(&line, y);
+        uint64_t h = editorHashLine(line.b, line.len);
+        if (E.frame_valid && E.frame[y] == h) continue;
+        E.frame[y] = h;
+
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+        abAppend(ab, buf, len);
+        abAppend(ab, line.b, line.len);
+        // clear the rest of the line
         abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
     }
+    abFree(&line);
+
+    E.frame_rowoff = editorScreenTop();
+    E.frame_valid = 1;
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
@@ -907,10 +9044,25 @@ void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s %s",
-                       E.filename ? E.filename : "[No Name]",
-                       E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | line %d of %d",
-                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+                       editorBufferName(E.buf),
+                       E.buf->dirty ? "(modified)" : "");
+    int rlen;
+    if (E.buf->hex) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "hex | offset %llx of %llx",
+                        (unsigned long long)E.buf->cy * 16 + E.buf->cx,
+                        (unsigned long long)E.buf->hex->size);
+    } else if (E.buf->occur) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | occur %d | line %d of %d",
+                        E.buf->syntax ? E.buf->syntax->filetype : "no ft",
+                        E.buf->occur->n, E.buf->cy + 1, E.buf->numrows);
+    } else if (E.buf->ncursors && E.buf->dirty == E.buf->cursors_dirty) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d cursors | line %d of %d",
+                        E.buf->syntax ? E.buf->syntax->filetype : "no ft",
+                        E.buf->ncursors + 1, E.buf->cy + 1, E.buf->numrows);
+    } else {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | line %d of %d",
+                        E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.buf->cy + 1, E.buf->numrows);
+    }
     if (len > E.screencols) {
         len = E.screencols;
     }
@@ -940,28 +9092,37 @@ void editorDrawMessageBar(struct abuf *ab) {
 }
 
 void editorRefreshScreen() {
+    if (E.macro_pos >= 0) return; // once, when the replay is done
     editorScroll();
+    editorFreezeColdRows();
 
     struct abuf ab = ABUF_INIT;
     // first byte is \x1b (escape sequence)
     // escape sequence instructs terminal to do varias text formatt
 
+    // begin a synchronized update (DEC mode 2026) so the terminal shows the
+    // frame at once; terminals without support ignore it
+    abAppend(&ab, "\x1b[?2026h", 8);
     // hide cursor before displaying onto screen
     abAppend(&ab, "\x1b[?25l", 6);
-    // 3 bytes long, H command cursor position <esc>[1;1H default
-    abAppend(&ab, "\x1b[H", 3);
 
     editorDrawRows(&ab);
+
+    char pos[32];
+    snprintf(pos, sizeof(pos), "\x1b[%d;1H", E.screenrows + 1);
+    abAppend(&ab, pos, strlen(pos));
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
 
     // print moving cursor
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + 1); // terminal uses 1-indexed values
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editorScreenCursor() + 1,
+             // terminal uses 1-indexed values, the markers take a column
+             (E.buf->rx - E.buf->coloff) + 1 + E.screencols - editorTextCols());
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6);
+    abAppend(&ab, "\x1b[?2026l", 8);
 
     write(STDOUT_FILENO, ab.b, ab.len);
     abFree(&ab);
@@ -977,7 +9138,18 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /*** input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)){
+// Copies s into dst with every % doubled, so text such as a file name can
+// go into the format editorPrompt is given. Truncates to fit size.
+void editorPromptQuote(char *dst, size_t size, const char *s) {
+    size_t n = 0;
+    for (; *s && n + 2 < size; ++s) {
+        if (*s == '%') dst[n++] = '%';
+        dst[n++] = *s;
+    }
+    dst[n] = '\0';
+}
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allow_empty){
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
 
@@ -1001,14 +9173,14 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
                 buf[--buflen] = '\0';
             }
         }else if (c == '\r') {
-            if(buflen != 0){
+            if(buflen != 0 || allow_empty){
                 editorSetStatusMessage("");
                 if (callback){
                     callback(buf, c);
                 }
                 return buf;
             }
-        }else if(!iscntrl(c) && c < 128) {
+        }else if(!iscntrl(c) && c < 256) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -1023,47 +9195,256 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
     }
 }
 
+// The row a vertical move from the cursor lands on, dir being -1 or 1, or
+// -1 if there is none: the next row not folded, or the empty line past the
+// end, or in an occur view the next row of the view.
+int editorStepRow(int dir) {
+    struct occurView *v = E.buf->occur;
+    if (!v) {
+        int k = editorVisibleIndex(E.buf->cy) + dir;
+        int y = k >= 0 ? editorVisibleRow(k) : -1;
+        return y <= E.buf->numrows ? y : -1;
+    }
+    editorOccurCursor(v);
+    int k = dir < 0 ? v->pos - 1 : v->pos + !v->extra;
+    return k >= 0 && k < v->n ? v->rows[k] : -1;
+}
+
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.buf->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.buf->cy];
+    if (row) {
+        editorRowThaw(row);
+    }
+    // vertical moves keep the display column rather than the byte offset
+    int rx = row ? editorRowCxToRx(row, E.buf->cx) : 0;
+
+    int up = editorStepRow(-1), down = editorStepRow(1);
+
+    // running off either end of the buffer stops a macro replay
+    int last = down < 0 || down >= E.buf->numrows;
+    if ((key == ARROW_UP && up < 0) ||
+        (key == ARROW_DOWN && last) ||
+        (key == ARROW_LEFT && up < 0 && E.buf->cx == 0) ||
+        (key == ARROW_RIGHT && last && (!row || E.buf->cx == row->size))) {
+        E.macro_failed = 1;
+    }
 
     switch (key) {
     case ARROW_UP:
-        if (E.cy != 0) {
-            --E.cy;
-        } else if (E.cy > 0) {
-            --E.cy;
-            E.cx = E.row[E.cy].size;
+        if (up >= 0) {
+            E.buf->cy = up;
         }
         break;
     case ARROW_DOWN:
-        if (E.cy < E.numrows) {
-            ++E.cy;
+        if (down >= 0) {
+            E.buf->cy = down;
         }
         break;
     case ARROW_LEFT:
-        if (E.cx != 0) {
-            --E.cx;
-        } else if (E.cy > 0) {
+        if (E.buf->cx != 0) {
+            E.buf->cx = editorRowPrevCx(row, E.buf->cx);
+        } else if (up >= 0) {
             // move cursor up
-            --E.cy;
-            E.cx = E.row[E.cy].size;
+            E.buf->cy = up;
+            E.buf->cx = E.buf->row[E.buf->cy].size;
         }
         break;
     case ARROW_RIGHT:
-        if (row && E.cx < row->size) {
-            ++E.cx;
-        } else if (row && E.cx == row->size) {
-            ++E.cy;
-            E.cx = 0;
+        if (row && E.buf->cx < row->size) {
+            E.buf->cx = editorRowNextCx(row, E.buf->cx);
+        } else if (row && E.buf->cx == row->size && down >= 0) {
+            E.buf->cy = down;
+            E.buf->cx = 0;
         }
         break;
     }
 
     // cursor to the end of line when necessary
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.buf->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.buf->cy];
+    if (row && (key == ARROW_UP || key == ARROW_DOWN)) {
+        editorRowThaw(row);
+        E.buf->cx = editorRowRxToCx(row, rx);
+    }
     int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+    if (E.buf->cx > rowlen) {
+        E.buf->cx = rowlen;
+    }
+}
+
+#define CEREAL_MACRO_PROGRESS_MS 250
+
+// Starts recording keys into the keyboard macro, see editorReadKey.
+void editorStartMacro() {
+    if (E.macro_pos >= 0) return;
+    if (E.macro_recording) {
+        editorSetStatusMessage("Already defining a keyboard macro");
+        return;
+    }
+    E.macro_recording = 1;
+    E.macro_len = 0;
+    editorSetStatusMessage("Defining keyboard macro...");
+}
+
+// Stops recording, leaving out the two keys (C-x ) or C-x e) that did.
+void editorEndMacro() {
+    if (!E.macro_recording) return;
+    E.macro_recording = 0;
+    E.macro_len = E.macro_len > 2 ? E.macro_len - 2 : 0;
+    editorSetStatusMessage("Keyboard macro defined");
+}
+
+// Drains the keys typed during a replay, which are dropped. Returns 1 if
+// one of them was C-g.
+int editorMacroCancelled() {
+    struct pollfd pfd = { E.ifd, POLLIN, 0 };
+    char c;
+    int cancel = 0;
+    while (poll(&pfd, 1, 0) == 1 && read(E.ifd, &c, 1) == 1) {
+        if (c == CTRL_KEY('g')) cancel = 1;
+    }
+    return cancel;
+}
+
+// Replays the macro times times, or with 0 until a key runs off the buffer.
+// Keys go through editorProcessKeypress as if typed, but with the screen
+// left alone and row updates deferred (see editorUpdateRow), so a run costs
+// the key handlers and one repaint at the end. Long runs show their
+// progress every CEREAL_MACRO_PROGRESS_MS and stop on C-g.
+void editorCallMacro(int times) {
+    if (E.macro_pos >= 0) return; // a macro calling itself
+    if (E.macro_len == 0) {
+        editorSetStatusMessage("No keyboard macro defined");
+        return;
+    }
+
+    struct timespec now, shown;
+    clock_gettime(CLOCK_MONOTONIC, &shown);
+    E.macro_failed = 0;
+    int runs = 0, cancelled = 0;
+    while (times == 0 || runs < times) {
+        E.macro_pos = 0;
+        while (E.macro_pos < E.macro_len && !E.macro_failed) {
+            editorProcessKeypress();
+        }
+        ++runs;
+        if (E.macro_failed) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (now.tv_sec - shown.tv_sec) * 1000 +
+            (now.tv_nsec - shown.tv_nsec) / 1000000;
+        if (ms >= CEREAL_MACRO_PROGRESS_MS) {
+            shown = now;
+            if (editorMacroCancelled()) {
+                cancelled = 1;
+                break;
+            }
+            E.macro_pos = -1;
+            editorUpdateStaleRows();
+            if (times) {
+                editorSetStatusMessage("Macro: run %d of %d (C-g to stop)", runs, times);
+            } else {
+                editorSetStatusMessage("Macro: run %d (C-g to stop)", runs);
+            }
+            editorRefreshScreen();
+        }
+    }
+    E.macro_pos = -1;
+
+    struct editorBuffer *cur = E.buf;
+    for (int j = 0; j < E.nbufs; ++j) {
+        E.buf = E.bufs[j];
+        editorUpdateStaleRows();
+    }
+    E.buf = cur;
+
+    if (cancelled) {
+        editorSetStatusMessage("Macro stopped after %d runs", runs);
+    } else if (E.macro_failed && (times != 1 || runs > 1)) {
+        editorSetStatusMessage("Macro reached the end of the buffer in run %d", runs);
+    } else if (runs > 1) {
+        editorSetStatusMessage("Macro ran %d times", runs);
+    }
+}
+
+// C-x e, which also ends a recording in progress.
+void editorCallMacroOnce() {
+    editorEndMacro();
+    editorCallMacro(1);
+}
+
+void editorRepeatMacro() {
+    char *s = editorPrompt("Repeat macro how many times (0 until the end of the buffer): %s", NULL, 0);
+    if (!s) return;
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (*end || n < 0 || n > INT_MAX) {
+        editorSetStatusMessage("Not a count: %s", s);
+    } else {
+        editorCallMacro(n);
+    }
+    free(s);
+}
+
+// Commands run by name with M-x.
+struct editorCommand {
+    const char *name;
+    void (*fn)();
+};
+
+struct editorCommand editorCommands[] = {
+    { "add-cursor-at-next-match", editorAddCursorAtNextMatch },
+    { "add-cursors-in-column", editorAddCursorsInColumn },
+    { "diff-buffer-with-file", editorDiffBuffer },
+    { "diff-gutter", editorToggleGutter },
+    { "drop-caches", editorDropCaches },
+    { "find-file", editorFindFile },
+    { "flush-lines", editorFlushLines },
+    { "fold-all", editorFoldAll },
+    { "goto-symbol", editorGotoSymbol },
+    { "grep", editorGrep },
+    { "keep-lines", editorKeepLines },
+    { "kill-buffer", editorKillBuffer },
+    { "kill-server", editorKillServer },
+    { "memory-report", editorMemoryReport },
+    { "occur", editorOccur },
+    { "query-replace", editorQueryReplace },
+    { "repeat-macro", editorRepeatMacro },
+    { "replace-all", editorReplaceAll },
+    { "sort-fields", editorSortFields },
+    { "sort-lines", editorSortLines },
+    { "sort-numeric-fields", editorSortNumericFields },
+    { "switch-to-buffer", editorSelectBuffer },
+    { "toggle-fold", editorToggleFold },
+    { "unfold-all", editorUnfoldAll },
+    { "uniq-lines", editorUniqLines },
+    { NULL, NULL }
+};
+
+// Runs the command named at the prompt; a unique prefix will do.
+void editorExecuteCommand() {
+    char *name = editorPrompt("M-x %s", NULL, 0);
+    if (!name) return;
+
+    struct editorCommand *found = NULL;
+    int matches = 0;
+    for (struct editorCommand *cmd = editorCommands; cmd->name; ++cmd) {
+        if (!strcmp(cmd->name, name)) {
+            found = cmd;
+            matches = 1;
+            break;
+        }
+        if (!strncmp(cmd->name, name, strlen(name))) {
+            found = cmd;
+            ++matches;
+        }
+    }
+
+    if (matches == 1) {
+        free(name);
+        found->fn();
+    } else {
+        editorSetStatusMessage("%s: %s", matches ? "Ambiguous" : "No command", name);
+        free(name);
     }
 }
 
@@ -1071,11 +9452,16 @@ void editorProcessKeypress() {
     static int quit_times = CEREAL_QUIT_TIMES;
 
     int c = editorReadKey();
+    editorMapPoll(0);
 
     // Use EMACS bindings
     switch (c) {
     case '\r':
-        editorInsertNewline();
+        if (E.buf->enter) {
+            E.buf->enter();
+        } else {
+            editorInsertNewline();
+        }
         break;
 
     case CTRL_KEY('a'):
@@ -1103,9 +9489,19 @@ void editorProcessKeypress() {
         c = DEL_KEY;
     }
 
+    if ((E.buf->hex && editorHexProcessKey(c)) || editorCursorsKey(c)) {
+        quit_times = CEREAL_QUIT_TIMES;
+        return;
+    }
+
     switch (c) {
     case CTRL_KEY('q'):
-        if(E.dirty && quit_times > 0){
+        if (E.server_fd != -1) {
+            // the buffers stay with the server for the next client
+            E.attached = 0;
+            break;
+        }
+        if(editorDirtyBuffers() && quit_times > 0){
             editorSetStatusMessage("WARNING! File has unsaved changes. "
                                    "Process C-q %d more times to REAL quit.", quit_times);
             --quit_times;
@@ -1124,16 +9520,40 @@ void editorProcessKeypress() {
         case CTRL_KEY('s'):
             editorSave();
             break;
+        case CTRL_KEY('f'):
+            editorFindFile();
+            break;
+        case 'b':
+            editorSelectBuffer();
+            break;
+        case 'k':
+            editorKillBuffer();
+            break;
+        case 'f':
+            editorToggleFollow();
+            break;
+        case '(':
+            editorStartMacro();
+            break;
+        case ')':
+            editorEndMacro();
+            break;
+        case 'e':
+            editorCallMacroOnce();
+            break;
+        case 'z':
+            editorToggleFold();
+            break;
         }
         break;
     }
 
     case HOME_KEY:
-        E.cx = 0;
+        E.buf->cx = 0;
         break;
     case END_KEY:
-        if (E.cy < E.numrows) {
-            E.cx = E.row[E.cy].size;
+        if (E.buf->cy < E.buf->numrows) {
+            E.buf->cx = E.buf->row[E.buf->cy].size;
         }
         break;
 
@@ -1141,6 +9561,61 @@ void editorProcessKeypress() {
         editorSearch();
         break;
 
+    case META_KEY('%'):
+        editorQueryReplace();
+        break;
+    case META_KEY('x'):
+        editorExecuteCommand();
+        break;
+    case META_KEY('.'):
+        editorGotoSymbol();
+        break;
+
+    case META_KEY(CTRL_KEY('f')):
+    case META_KEY(CTRL_KEY('b')):
+        editorMatchBracket();
+        break;
+    case META_KEY(CTRL_KEY('u')):
+        editorBracketUp();
+        break;
+    case META_KEY(CTRL_KEY('n')):
+        editorBracketNext();
+        break;
+    case META_KEY(CTRL_KEY('p')):
+        editorBracketPrev();
+        break;
+    case META_KEY(CTRL_KEY('a')):
+        editorBeginningOfDefun();
+        break;
+    case META_KEY(CTRL_KEY('e')):
+        editorEndOfDefun();
+        break;
+
+    case CTRL_KEY('w'):
+        editorKillRegion();
+        break;
+    case META_KEY('w'):
+        editorCopyRegion();
+        break;
+    case CTRL_KEY('y'):
+        editorYank();
+        break;
+    case META_KEY('y'):
+        editorYankPop();
+        break;
+
+    case CTRL_KEY('@'):
+        E.buf->markx = E.buf->cx;
+        E.buf->marky = E.buf->cy;
+        E.buf->mark_active = 1;
+        editorSetStatusMessage("Mark set");
+        break;
+    case CTRL_KEY('g'):
+        E.buf->mark_active = 0;
+        editorCursorsClear(E.buf);
+        editorSetStatusMessage("Quit");
+        break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1152,12 +9627,13 @@ void editorProcessKeypress() {
 
     case PAGE_UP:
     case PAGE_DOWN: {
+        editorScroll(); // a macro replay draws nothing, so scroll here
         if (c == PAGE_UP) {
-            E.cy = E.rowoff;
+            E.buf->cy = editorScreenRow(0);
         } else if (c == PAGE_DOWN) {
-            E.cy = E.rowoff + E.screenrows - 1;
-            if (E.cy > E.numrows) {
-                E.cy = E.numrows;
+            E.buf->cy = editorScreenRow(E.screenrows - 1);
+            if (E.buf->cy > E.buf->numrows) {
+                E.buf->cy = E.buf->numrows;
             }
         }
         int times = E.screenrows;
@@ -1173,49 +9649,404 @@ void editorProcessKeypress() {
         editorMoveCursor(c);
         break;
 
-        // ignore C-l and ECTRLSC
     case CTRL_KEY('l'):
+        E.frame_valid = 0; // repaint everything
+        break;
+
+        // Enter was handled above; ignore ECTRLSC
+    case '\r':
     case '\x1b':
         break;
 
     default:
-        editorInsertChar(c);
+        if (c < 256) {
+            editorInsertChar(c);
+        }
         break;
     }
 
     quit_times = CEREAL_QUIT_TIMES;
 }
 
+/*** server ***/
+
+// A server (cereal --daemon) keeps its buffers, with their render and
+// highlighting, alive between sessions. A client (cereal -c FILE) hands the
+// server its terminal over a UNIX socket and sleeps until C-q gives the
+// terminal back, so reopening a file costs a connect, not a load.
+
+struct serverRequest {
+    int follow;
+    char path[PATH_MAX]; // absolute, empty for whatever the server has open
+};
+
+void editorSocketPath(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir) {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/cereal.sock", dir);
+    } else {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/cereal-%d.sock",
+                 (int)getuid());
+    }
+}
+
+// Connects to a running server. Returns the socket, or -1 if none answers.
+int editorServerConnect() {
+    struct sockaddr_un addr;
+    editorSocketPath(&addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The client never writes after its request, so a readable socket means it
+// has hung up.
+int editorClientAlive() {
+    if (!E.attached) return 0;
+    struct pollfd pfd = { E.client_fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// Reads a client's request and the two terminal fds (input, output) sent
+// with it. Only clients of the same user are served.
+int editorServerAccept(int cfd, struct serverRequest *req, int fds[2]) {
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+        cred.uid != getuid()) {
+        return -1;
+    }
+
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { req, sizeof(*req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    ssize_t n = recvmsg(cfd, &msg, MSG_CMSG_CLOEXEC);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (n <= 0 || !cm || cm->cmsg_level != SOL_SOCKET ||
+        cm->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int got[2] = { -1, -1 };
+    memcpy(got, CMSG_DATA(cm), (nfds < 2 ? nfds : 2) * sizeof(int));
+
+    // the rest of the request may trail the fds
+    while (n > 0 && n < (ssize_t)sizeof(*req)) {
+        ssize_t more = read(cfd, (char *)req + n, sizeof(*req) - n);
+        if (more <= 0) break;
+        n += more;
+    }
+    if (nfds != 2 || n != sizeof(*req)) {
+        for (int j = 0; j < nfds && j < 2; ++j) close(got[j]);
+        return -1;
+    }
+    req->path[sizeof(req->path) - 1] = '\0';
+    fds[0] = got[0];
+    fds[1] = got[1];
+    return 0;
+}
+
+// Turns away clients that connect while another one is attached. They
+// print the reply and exit rather than wait on a terminal nobody draws.
+void editorServerRefuse() {
+    struct pollfd pfd = { E.server_fd, POLLIN, 0 };
+    while (poll(&pfd, 1, 0) == 1) {
+        int cfd = accept4(E.server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd == -1) break;
+        dprintf(cfd, "the server is busy with another client\n");
+        close(cfd);
+    }
+}
+
+// Runs one editing session on the terminal of client cfd. A die() on the
+// way ends just the session, see die.
+void editorServeClient(int cfd) {
+    struct serverRequest req;
+    int fds[2];
+    if (editorServerAccept(cfd, &req, fds) == -1) return;
+
+    E.ifd = fds[0];
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    E.client_fd = cfd;
+    E.attached = 1;
+    if (setjmp(E.session) == 0) {
+        enableRawMode();
+        editorResize();
+
+        editorSetStatusMessage("HELP: Save with C-x C-s | Detach with C-q | Search with C-s");
+        if (req.path[0]) {
+            editorVisitFile(req.path);
+        }
+        if (req.follow && !E.buf->follow) {
+            editorToggleFollow();
+        }
+
+        while (E.attached) {
+            editorRefreshScreen();
+            editorProcessKeypress();
+        }
+    } else {
+        // whatever was under way when it died is over
+        E.batch = 0;
+        E.macro_pos = -1;
+    }
+    E.attached = 0;
+
+    // give the terminal back as the client found it
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    tcsetattr(E.ifd, TCSAFLUSH, &E.orig_termios);
+    close(E.ifd);
+    E.ifd = -1;
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    E.client_fd = -1;
+}
+
+// Serves clients one at a time, forever. Others wait in the listen queue.
+void editorServe() {
+    while (1) {
+        int cfd = accept4(E.server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            die("accept");
+        }
+        editorServeClient(cfd);
+        close(cfd);
+    }
+}
+
+// Listens on the socket, then detaches into the background and serves.
+void editorServerStart() {
+    int fd = editorServerConnect();
+    if (fd != -1) {
+        fprintf(stderr, "cereal: a server is already running\n");
+        exit(1);
+    }
+
+    struct sockaddr_un addr;
+    editorSocketPath(&addr);
+    unlink(addr.sun_path); // left behind by a server that died
+    E.server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(077);
+    if (E.server_fd == -1 ||
+        bind(E.server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(E.server_fd, 8) == -1) {
+        perror("cereal: server");
+        exit(1);
+    }
+    umask(mask);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("cereal: fork");
+        exit(1);
+    }
+    if (pid > 0) {
+        printf("cereal: server listening on %s\n", addr.sun_path);
+        exit(0);
+    }
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    editorServe();
+}
+
+// Stops the server, leaving the client's terminal as it was.
+void editorKillServer() {
+    if (E.server_fd == -1) {
+        editorSetStatusMessage("Not running as a server");
+        return;
+    }
+    if (editorDirtyBuffers()) {
+        char *answer = editorPrompt("Buffers have unsaved changes; kill anyway? (yes or no) %s", NULL, 0);
+        int yes = answer && !strcmp(answer, "yes");
+        free(answer);
+        if (!yes) return;
+    }
+    struct sockaddr_un addr;
+    editorSocketPath(&addr);
+    unlink(addr.sun_path);
+
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+}
+
+// Hands this terminal to a running server and waits until it is given back.
+// Returns -1 if no server could be reached, else the exit status: 1 if the
+// server turned us away or ended the session on an error, which is printed.
+int editorClient(const char *filename, int follow) {
+    int fd = editorServerConnect();
+    if (fd == -1) return -1;
+
+    struct serverRequest req;
+    memset(&req, 0, sizeof(req));
+    req.follow = follow;
+    if (filename) {
+        if (!realpath(filename, req.path)) {
+            // a new file: anchor it to our directory instead
+            char cwd[PATH_MAX];
+            int len;
+            if (filename[0] == '/' || !getcwd(cwd, sizeof(cwd))) {
+                len = snprintf(req.path, sizeof(req.path), "%s", filename);
+            } else {
+                len = snprintf(req.path, sizeof(req.path), "%s/%s", cwd, filename);
+            }
+            if (len >= (int)sizeof(req.path)) {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+
+    int tty = STDIN_FILENO;
+    if (!isatty(tty)) {
+        tty = open("/dev/tty", O_RDWR);
+        if (tty == -1) {
+            die("open /dev/tty");
+        }
+    }
+    int fds[2] = { tty, STDOUT_FILENO };
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    // a busy server may have replied and hung up already
+    int sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(req);
+
+    // the server closes the connection when it detaches, having written
+    // why if it didn't go well
+    char reply[256];
+    int len = 0;
+    ssize_t n;
+    while (len < (int)sizeof(reply) &&
+           ((n = read(fd, reply + len, sizeof(reply) - len)) > 0 ||
+            (n == -1 && errno == EINTR))) {
+        if (n > 0) len += n;
+    }
+    close(fd);
+    if (len > 0) {
+        fprintf(stderr, "cereal: %.*s", len, reply);
+        return 1;
+    }
+    return sent ? 0 : -1;
+}
+
 /*** init ***/
 
 void initEditor() {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.bufs = NULL;
+    E.nbufs = 0;
+    editorNewBuffer();
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    E.syntax = NULL;
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
-        die("getwindowsize");
-    }
-    E.screenrows -= 2;
+    memset(E.blklru, 0, sizeof(E.blklru));
+    E.blktab = NULL;
+    E.blktab_size = 0;
+    E.nblocks = 0;
+    E.screenrows = 0;
+    E.frame = NULL;
+    E.search_re = NULL;
+    E.search_gen = 0;
+    E.search_last = NULL;
+    E.overlay = NULL;
+    E.grep = NULL;
+    E.outline = NULL;
+    E.nkills = 0;
+    E.yank_buf = NULL;
+    E.macro = NULL;
+    E.macro_len = E.macro_cap = 0;
+    E.macro_recording = 0;
+    E.macro_pos = -1;
+    E.macro_failed = 0;
+    E.server_fd = -1;
+    E.client_fd = -1;
+    E.attached = 0;
 }
 
+
 int main(int argc, char *argv[]) {
-    enableRawMode();
+    char *filename = NULL;
+    int follow = 0;
+    int client = 0;
+    int serve = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-f")) {
+            follow = 1;
+        } else if (!strcmp(argv[i], "-c")) {
+            client = 1;
+        } else if (!strcmp(argv[i], "--daemon")) {
+            serve = 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+
     initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    if (serve) {
+        editorServerStart();
+    }
+    // with no server to talk to, a client edits on its own
+    if (client) {
+        int status = editorClient(filename, follow);
+        if (status != -1) return status;
+    }
+
+    // keys come from the terminal even when a stream is piped into stdin
+    E.ifd = STDIN_FILENO;
+    if (!isatty(STDIN_FILENO)) {
+        E.ifd = open("/dev/tty", O_RDWR);
+        if (E.ifd == -1) {
+            die("open /dev/tty");
+        }
+    }
+
+    enableRawMode();
+    editorResize();
+    if (filename) {
+        editorOpen(filename);
+        if (follow) {
+            editorToggleFollow();
+        }
+    } else if (E.ifd != STDIN_FILENO) {
+        editorFollowStart(STDIN_FILENO, 1);
     }
 
-    editorSetStatusMessage("HELP: Save with C-x C-s | Quit with C-q | Search with C-s");
+    editorSetStatusMessage("HELP: Save with C-x C-s | Quit with C-q | Search with C-s | Follow with C-x f");
 
     while (1) {
         editorRefreshScreen();
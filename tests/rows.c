@@ -0,0 +1,591 @@
+// Differential fuzzing of the row layer: random edits go both to the
+// editor's rows and to a plain array of strings, and after every step each
+// row's text, idx, render, hl and comment state must be what the array says
+// they should be. render and hl are worked out from scratch over the whole
+// buffer, so any incremental update (the comment cascade, deferred rows,
+// batched splits and joins, frozen rows) that gets it wrong shows up. Each
+// step also gets a budget of renders and highlights, so an edit that starts
+// redoing rows it didn't touch fails the build like a wrong result would.
+// A second, shorter run keeps a few rows past CEREAL_LONG_LINE, so the same
+// edits go through chunked rows, checked in a window as they are drawn.
+//
+// Run through make test, or as tests/rows [seed [steps]].
+
+#define main cereal_main
+#include "../cereal.c"
+#undef main
+
+#define FUZZ_SEEDS 8
+#define FUZZ_STEPS 4000
+#define FUZZ_MAX_ROWS 200
+#define FUZZ_LONG_STEPS 300
+#define FUZZ_LONG_ROWS 8
+
+// The reference: the text of every row, and which row it was before the
+// step, or -1 if the step changed it.
+struct refRow {
+    char *s;
+    int len;
+    int was;
+};
+
+struct refRow *ref;
+int nref, refcap;
+
+// What the rows were like before the step.
+struct fuzzBefore {
+    int out; // the comment state it handed on
+    int cold;
+    int chunked;
+};
+
+struct fuzzBefore *before;
+int *outs; // hl_open_comment of each row, as of the last check
+int nouts;
+int thawed; // cold rows the step had to thaw, or chunked ones to flatten
+int edits; // editor calls the step made, deferred or not
+int was_chunked; // chunked rows the step touched, maybe flattening them
+
+unsigned int run_seed, seed;
+int step;
+const char *opname;
+
+unsigned int fuzzRand() {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+int fuzzUpTo(int n) {
+    return n > 0 ? (int)(fuzzRand() % n) : 0;
+}
+
+void fuzzFail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "rows: seed %u step %d (%s): ", run_seed, step, opname);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
+
+// What text is made of: enough to open and close comments and strings,
+// hit keywords and numbers, and move tab stops with 2-byte characters.
+const char *pieces[] = {
+    "a", "b", "x", " ", "\t", "/", "*", "\"", "'", "\\", "1", "{", "}",
+    "\xc3\xa9", "0x1f", "if", "int", "//", "/*", "*/",
+};
+#define NPIECES (int)(sizeof(pieces) / sizeof(pieces[0]))
+#define NCHARS 14 // pieces[0..NCHARS) are single characters
+
+void fuzzText(char *buf, int *len) {
+    int n = fuzzUpTo(7);
+    *len = 0;
+    for (int k = 0; k < n; ++k) {
+        const char *p = pieces[fuzzUpTo(NPIECES)];
+        memcpy(buf + *len, p, strlen(p));
+        *len += strlen(p);
+    }
+}
+
+// A character boundary of row y.
+int fuzzX(int y) {
+    int x = fuzzUpTo(ref[y].len + 1);
+    while (x > 0 && x < ref[y].len && (ref[y].s[x] & 0xc0) == 0x80) --x;
+    return x;
+}
+
+int fuzzCharLen(int y, int x) {
+    int len = 1;
+    while (x + len < ref[y].len && (ref[y].s[x + len] & 0xc0) == 0x80) ++len;
+    return len;
+}
+
+/*** reference ***/
+
+// Notes that the step changed row y.
+void refTouch(int y) {
+    if (ref[y].was >= 0 &&
+        (before[ref[y].was].cold || before[ref[y].was].chunked)) {
+        ++thawed;
+        was_chunked += before[ref[y].was].chunked;
+    }
+    ref[y].was = -1;
+}
+
+// Replaces rows [at, at + del) with the n rows s.
+void refSplice(int at, int del, char **s, int *len, int n) {
+    for (int j = at; j < at + del; ++j) free(ref[j].s);
+    if (nref - del + n > refcap) {
+        refcap = (nref - del + n) * 2;
+        ref = realloc(ref, sizeof(struct refRow) * refcap);
+    }
+    if (nref > at + del) {
+        memmove(&ref[at + n], &ref[at + del], sizeof(struct refRow) * (nref - at - del));
+    }
+    nref += n - del;
+    for (int j = 0; j < n; ++j) {
+        ref[at + j].s = malloc(len[j] + 1);
+        memcpy(ref[at + j].s, s[j], len[j]);
+        ref[at + j].s[len[j]] = '\0';
+        ref[at + j].len = len[j];
+        ref[at + j].was = -1;
+    }
+}
+
+// Replaces del bytes at x of row y with ins.
+void refEdit(int y, int x, int del, const char *ins, int len) {
+    int n = ref[y].len - del + len;
+    char *t = malloc(n + 1);
+    memcpy(t, ref[y].s, x);
+    memcpy(t + x, ins, len);
+    memcpy(t + x + len, ref[y].s + x + del, ref[y].len - x - del);
+    t[n] = '\0';
+    free(ref[y].s);
+    ref[y].s = t;
+    ref[y].len = n;
+    refTouch(y);
+}
+
+// Moves the text from x on of row y to a new row after it.
+void refSplit(int y, int x) {
+    char *s = ref[y].s + x;
+    int len = ref[y].len - x;
+    refSplice(y + 1, 0, &s, &len, 1);
+    refEdit(y, x, len, "", 0);
+}
+
+// Joins row y onto the end of the row before it.
+void refJoin(int y) {
+    refTouch(y);
+    refEdit(y - 1, ref[y - 1].len, 0, ref[y].s, ref[y].len);
+    refSplice(y, 1, NULL, NULL, 0);
+}
+
+// Tabs to the next multiple of CEREAL_TAB_STOP display columns; every
+// character the fuzzer writes is one column wide.
+char *refRender(const char *s, int len, int *rsize) {
+    char *r = malloc(len * CEREAL_TAB_STOP + 1);
+    int n = 0, col = 0;
+    for (int j = 0; j < len; ++j) {
+        if (s[j] == '\t') {
+            do {
+                r[n++] = ' ';
+            } while (++col % CEREAL_TAB_STOP != 0);
+            continue;
+        }
+        r[n++] = s[j];
+        if ((s[j] & 0xc0) != 0x80) ++col;
+    }
+    r[n] = '\0';
+    *rsize = n;
+    return r;
+}
+
+// The offset in render of display column col.
+int refRenderAt(const char *render, int rsize, int col) {
+    int j = 0;
+    for (; j < rsize; ++j) {
+        if ((render[j] & 0xc0) != 0x80 && col-- == 0) break;
+    }
+    return j;
+}
+
+/*** checks ***/
+
+// Renders the window of a chunked row at a random column, as drawing it
+// would, and compares it with that part of the reference.
+void fuzzCheckChunks(int j, const char *render, const unsigned char *hl, int rsize) {
+    erow *row = &E.buf->row[j];
+    int cols = 0;
+    for (int i = 0; i < rsize; ++i) cols += (render[i] & 0xc0) != 0x80;
+    E.buf->coloff = fuzzUpTo(cols);
+    editorChunkRender(row);
+    E.buf->coloff = 0;
+
+    int at = refRenderAt(render, rsize, row->chunks->render_col);
+    if (at + row->rsize > rsize ||
+        memcmp(row->render, render + at, row->rsize) != 0) {
+        fuzzFail("chunked row %d renders differently from column %d", j,
+                 row->chunks->render_col);
+    }
+    for (int i = 0; i < row->rsize; ++i) {
+        if (row->hl[i] != hl[at + i]) {
+            fuzzFail("chunked row %d has hl %d at %d, expected %d", j,
+                     row->hl[i], at + i, hl[at + i]);
+        }
+    }
+}
+
+// Compares every row with the reference, highlighting the reference from
+// the top of the buffer down. Leaves the comment states in outs.
+void fuzzCheck() {
+    struct editorBuffer *b = E.buf;
+    if (b->numrows != nref) fuzzFail("%d rows, expected %d", b->numrows, nref);
+    if (nref > nouts) {
+        nouts = nref * 2;
+        outs = realloc(outs, sizeof(int) * nouts);
+    }
+
+    int in_comment = 0;
+    for (int j = 0; j < nref; ++j) {
+        erow *row = &b->row[j];
+        if (row->idx != j) fuzzFail("row %d has idx %d", j, row->idx);
+        // leaves a chunked row chunked
+        if (row->size != ref[j].len ||
+            memcmp(editorRowText(row), ref[j].s, ref[j].len) != 0) {
+            fuzzFail("row %d is \"%.*s\", expected \"%s\"", j, row->size,
+                     editorRowText(row), ref[j].s);
+        }
+
+        int rsize;
+        char *render = refRender(ref[j].s, ref[j].len, &rsize);
+        unsigned char *hl = malloc(rsize + 1);
+        memset(hl, HL_NORMAL, rsize);
+        struct hlState st = { 0, 0, 1, 0 };
+        st.in_comment = in_comment;
+        editorHighlight(&HLDB[0], render, hl, rsize, &st, NULL, 0);
+        in_comment = st.in_comment;
+
+        // cold rows keep only their text and the state they hand on
+        if (row->chunks) {
+            fuzzCheckChunks(j, render, hl, rsize);
+        } else if (!row->blk) {
+            if (!row->render) fuzzFail("row %d was left stale", j);
+            if (row->rsize != rsize || memcmp(row->render, render, rsize) != 0) {
+                fuzzFail("row %d renders as \"%s\", expected \"%s\"", j,
+                         row->render, render);
+            }
+            for (int i = 0; i < rsize; ++i) {
+                if (row->hl[i] != hl[i]) {
+                    fuzzFail("row %d \"%s\" has hl %d at %d, expected %d", j,
+                             render, row->hl[i], i, hl[i]);
+                }
+            }
+        }
+        if (row->hl_open_comment != in_comment) {
+            fuzzFail("row %d hands on comment state %d, expected %d", j,
+                     row->hl_open_comment, in_comment);
+        }
+        outs[j] = in_comment;
+        free(render);
+        free(hl);
+    }
+}
+
+// Each row the step changed may be rendered once per editor call that
+// changed it (once in all when they were deferred), and once more if it
+// had to be thawed first, and highlighted about twice as often. Past that,
+// only rows whose comment state on entry changed may be touched, once.
+// Chunked rows aren't deferred: each edit moves their version, also in
+// the edits before one that flattens them.
+void fuzzBudget(int calls, unsigned int renders, unsigned long highlights) {
+    int touched = 0, cascade = 0, chunked = 0;
+    for (int j = 0; j < nref; ++j) {
+        if (ref[j].was < 0) {
+            ++touched;
+            chunked += E.buf->row[j].chunks != NULL;
+            continue;
+        }
+        int entered = ref[j].was > 0 ? before[ref[j].was - 1].out : 0;
+        int enters = j > 0 ? outs[j - 1] : 0;
+        if (entered != enters) ++cascade;
+    }
+    unsigned int max_renders = touched * calls + (chunked + was_chunked) * (edits - calls) +
+        thawed + cascade;
+    unsigned long max_highlights = (2 * touched + 1) * calls + thawed + cascade;
+    if (renders > max_renders) {
+        fuzzFail("rendered %u rows, budget %u", renders, max_renders);
+    }
+    if (highlights > max_highlights) {
+        fuzzFail("highlighted %lu rows, budget %lu", highlights, max_highlights);
+    }
+}
+
+/*** edits ***/
+
+// Each edit applies itself to both sides and returns how many editor
+// calls it made to change a row.
+
+int fuzzInsertChar() {
+    opname = "insert char";
+    int y = fuzzUpTo(nref), x = fuzzX(y);
+    const char *c = pieces[fuzzUpTo(NCHARS)];
+    int len = strlen(c);
+    for (int k = 0; k < len; ++k) {
+        editorRowInsertChar(&E.buf->row[y], x + k, c[k]);
+    }
+    refEdit(y, x, 0, c, len);
+    return len;
+}
+
+int fuzzDelChar() {
+    opname = "delete char";
+    int y = fuzzUpTo(nref), x = fuzzX(y);
+    if (x == ref[y].len) x = 0;
+    if (x == ref[y].len) return 0;
+    int len = fuzzCharLen(y, x);
+    editorRowDelChars(&E.buf->row[y], x, len);
+    refEdit(y, x, len, "", 0);
+    return 1;
+}
+
+// Deletes a run of characters, as killing a region within a row does. On a
+// chunked row it may span several chunks.
+int fuzzDelRange() {
+    opname = "delete range";
+    int y = fuzzUpTo(nref), x0 = fuzzX(y), x1 = fuzzX(y);
+    if (x0 > x1) {
+        int t = x0; x0 = x1; x1 = t;
+    }
+    if (x0 == x1) return 0;
+    editorRowDelChars(&E.buf->row[y], x0, x1 - x0);
+    refEdit(y, x0, x1 - x0, "", 0);
+    return 1;
+}
+
+int fuzzAppend() {
+    opname = "append";
+    int y = fuzzUpTo(nref);
+    char s[64];
+    int len;
+    fuzzText(s, &len);
+    editorRowAppendString(&E.buf->row[y], s, len);
+    refEdit(y, ref[y].len, 0, s, len);
+    return 1;
+}
+
+int fuzzInsertRows() {
+    opname = "insert rows";
+    int at = fuzzUpTo(nref + 1), n = 1 + fuzzUpTo(8);
+    char texts[8][64], *s[8];
+    int len[8];
+    for (int j = 0; j < n; ++j) {
+        fuzzText(texts[j], &len[j]);
+        s[j] = texts[j];
+    }
+    editorInsertRows(at, s, len, n);
+    refSplice(at, 0, s, len, n);
+    return 1;
+}
+
+int fuzzDelRows() {
+    opname = "delete rows";
+    int at = fuzzUpTo(nref), n = 1 + fuzzUpTo(8);
+    if (n > nref - at) n = nref - at;
+    editorDelRows(at, n);
+    refSplice(at, n, NULL, NULL, 0);
+    return 1;
+}
+
+int fuzzNewline() {
+    opname = "newline";
+    int y = fuzzUpTo(nref), x = fuzzX(y);
+    E.buf->cy = y;
+    E.buf->cx = x;
+    editorInsertNewline();
+    refSplit(y, x);
+    return 1;
+}
+
+int fuzzBackspace() {
+    opname = "backspace";
+    int y = fuzzUpTo(nref), x = fuzzX(y);
+    if (x == 0 && y == 0) x = ref[y].len;
+    if (x == 0 && y == 0) return 0;
+    E.buf->cy = y;
+    E.buf->cx = x;
+    editorDelChar();
+
+    if (x > 0) {
+        int prev = x - 1;
+        while (prev > 0 && (ref[y].s[prev] & 0xc0) == 0x80) --prev;
+        refEdit(y, prev, x - prev, "", 0);
+    } else {
+        refJoin(y);
+    }
+    return 1;
+}
+
+// Enter at several points at once, as multiple cursors do.
+int fuzzSplitRows() {
+    opname = "split rows";
+    int n = 1 + fuzzUpTo(4), ys[4], xs[4];
+    for (int k = 0; k < n; ++k) {
+        ys[k] = fuzzUpTo(nref);
+        xs[k] = fuzzX(ys[k]);
+    }
+    // in order, as editorSplitRows wants them
+    for (int k = 1; k < n; ++k) {
+        for (int i = k; i > 0 && (ys[i - 1] > ys[i] ||
+                                  (ys[i - 1] == ys[i] && xs[i - 1] > xs[i])); --i) {
+            int t = ys[i]; ys[i] = ys[i - 1]; ys[i - 1] = t;
+            t = xs[i]; xs[i] = xs[i - 1]; xs[i - 1] = t;
+        }
+    }
+    editorSplitRows(ys, xs, n);
+
+    for (int k = n - 1; k >= 0; --k) {
+        refSplit(ys[k], xs[k]);
+    }
+    return 1;
+}
+
+// Backspace at the start of several rows at once.
+int fuzzJoinRows() {
+    opname = "join rows";
+    if (nref < 2) return 0;
+    int n = 0, ys[4], offs[4];
+    for (int k = 0, want = 1 + fuzzUpTo(4); k < want; ++k) {
+        int y = 1 + fuzzUpTo(nref - 1), i;
+        for (i = 0; i < n && ys[i] != y; ++i);
+        if (i == n) ys[n++] = y;
+    }
+    for (int k = 1; k < n; ++k) {
+        for (int i = k; i > 0 && ys[i - 1] > ys[i]; --i) {
+            int t = ys[i]; ys[i] = ys[i - 1]; ys[i - 1] = t;
+        }
+    }
+    editorJoinRows(ys, n, offs);
+
+    for (int k = n - 1; k >= 0; --k) {
+        refJoin(ys[k]);
+    }
+    return 1;
+}
+
+// Freezes a run of warm rows, as leaving them off-screen would.
+int fuzzFreeze() {
+    opname = "freeze";
+    int at = fuzzUpTo(nref), n = 1 + fuzzUpTo(16);
+    if (n > nref - at) n = nref - at;
+    for (int j = at; j < at + n; ++j) {
+        if (E.buf->row[j].blk || E.buf->row[j].chunks) n = j - at;
+    }
+    if (n > 0) editorFreezeRows(at, n);
+    return 0;
+}
+
+int fuzzThaw() {
+    opname = "thaw";
+    int y = fuzzUpTo(nref);
+    editorRowThaw(&E.buf->row[y]);
+    refTouch(y);
+    return 0;
+}
+
+// Appends to a row until it is long enough to be kept in chunks.
+int fuzzLengthen() {
+    opname = "lengthen";
+    int y = fuzzUpTo(nref);
+    int cap = CEREAL_LONG_LINE + 64, len = 0;
+    char *s = malloc(cap);
+    while (ref[y].len + len < CEREAL_LONG_LINE) {
+        int n;
+        fuzzText(s + len, &n);
+        len += n;
+    }
+    editorRowAppendString(&E.buf->row[y], s, len);
+    refEdit(y, ref[y].len, 0, s, len);
+    free(s);
+    return 1;
+}
+
+typedef int (*fuzzOp)();
+
+fuzzOp ops[] = {
+    fuzzInsertChar, fuzzInsertChar, fuzzInsertChar, fuzzDelChar, fuzzDelChar,
+    fuzzDelRange, fuzzAppend, fuzzNewline, fuzzBackspace, fuzzSplitRows,
+    fuzzJoinRows, fuzzInsertRows, fuzzDelRows, fuzzFreeze, fuzzThaw,
+};
+#define NOPS (int)(sizeof(ops) / sizeof(ops[0]))
+#define NBATCHOPS 11 // the edits a key at every cursor makes
+
+// A few edits with their rows deferred, as at every cursor or in a macro
+// replay, so each row they touched renders once, at the end.
+int fuzzBatch() {
+    int n = 1 + fuzzUpTo(4);
+    E.batch = 1;
+    for (int k = 0; k < n && nref > 0; ++k) {
+        edits += ops[fuzzUpTo(NBATCHOPS)]();
+    }
+    E.batch = 0;
+    editorUpdateStaleRows();
+    opname = "batch";
+    return 1;
+}
+
+/*** driver ***/
+
+// One random edit, then the checks. With long_rows the buffer stays a few
+// rows, some of them lengthened past CEREAL_LONG_LINE.
+void fuzzStep(int long_rows) {
+    int max_rows = long_rows ? FUZZ_LONG_ROWS : FUZZ_MAX_ROWS;
+    before = realloc(before, sizeof(struct fuzzBefore) * (nref + 1));
+    for (int j = 0; j < nref; ++j) {
+        before[j].out = outs[j];
+        before[j].cold = E.buf->row[j].blk != NULL;
+        before[j].chunked = E.buf->row[j].chunks != NULL;
+        ref[j].was = j;
+    }
+    thawed = 0;
+    was_chunked = 0;
+    edits = 0;
+    unsigned int renders = E.render_version;
+    unsigned long highlights = E.highlighted;
+
+    int calls;
+    if (nref == 0 || (nref < max_rows && fuzzUpTo(20) == 0)) {
+        calls = fuzzInsertRows();
+    } else if (nref > max_rows) {
+        calls = fuzzDelRows();
+    } else if (long_rows && fuzzUpTo(8) == 0) {
+        calls = fuzzLengthen();
+    } else if (fuzzUpTo(10) == 0) {
+        calls = fuzzBatch();
+    } else {
+        calls = ops[fuzzUpTo(NOPS)]();
+    }
+    if (edits == 0) edits = calls;
+
+    renders = E.render_version - renders;
+    highlights = E.highlighted - highlights;
+    fuzzCheck();
+    fuzzBudget(calls, renders, highlights);
+}
+
+void fuzzRun(unsigned int s, int steps, int long_rows) {
+    run_seed = seed = s;
+    editorDelRows(0, E.buf->numrows);
+    refSplice(0, nref, NULL, NULL, 0);
+    fuzzCheck();
+    for (step = 0; step < steps; ++step) {
+        fuzzStep(long_rows);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    initEditor();
+    E.screencols = 80; // the window chunked rows are drawn in
+    E.buf->filename = strdup("fuzz.c");
+    editorSelectSyntaxHighlight();
+    if (E.buf->syntax != &HLDB[0]) {
+        fprintf(stderr, "rows: fuzz.c doesn't get the C syntax\n");
+        return 1;
+    }
+
+    if (argc > 1) {
+        unsigned int s = strtoul(argv[1], NULL, 10);
+        fuzzRun(s, argc > 2 ? atoi(argv[2]) : FUZZ_STEPS, 0);
+        fuzzRun(s, argc > 2 ? atoi(argv[2]) : FUZZ_LONG_STEPS, 1);
+        printf("rows: seed %u ok\n", s);
+        return 0;
+    }
+    for (unsigned int s = 1; s <= FUZZ_SEEDS; ++s) {
+        fuzzRun(s, FUZZ_STEPS, 0);
+        fuzzRun(s, FUZZ_LONG_STEPS, 1);
+    }
+    printf("rows: %d seeds of %d steps, and %d with long rows, ok\n",
+           FUZZ_SEEDS, FUZZ_STEPS, FUZZ_LONG_STEPS);
+    return 0;
+}